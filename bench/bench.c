@@ -0,0 +1,362 @@
+// Microbenchmarks of the stream hot paths, the results are printed as JSON:
+//   airplay-mirror-bench [-o <file.json>] [-f <name filter>]
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "convert.h"
+#include "latency.h"
+#include "log.h"
+#include "receiver.h"
+#include "stream.h"
+#include "uring.h"
+
+// Every benchmark runs that long (at least the minimal iterations) after a warm-up run
+#define BENCH_TIME_NS 300000000LL
+#define BENCH_ITERATIONS_MIN 5
+#define BENCH_SAMPLES_MAX 8192
+#define BENCH_RECEIVERS_MAX 32
+
+static FILE *out = NULL;
+static const char *filter = NULL;
+static bool first_result = true;
+
+static int compareSamples(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t threadCpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Runs the function that does ops operations of bytes size each, median & best
+// time per operation are reported with the average CPU time of the calling thread
+// (kernel side of the syscalls included) and the syscalls if they are counted
+static void runBench(const char *name, void (*run)(void *ctx), uint64_t (*syscalls)(void *ctx), void *ctx,
+        int ops, size_t bytes) {
+    if( filter && !strstr(name, filter) )
+        return;
+    static int64_t samples[BENCH_SAMPLES_MAX];
+    run(ctx);
+    int count = 0;
+    uint64_t start_syscalls = syscalls ? syscalls(ctx) : 0;
+    int64_t start_cpu = threadCpuTime();
+    int64_t start = latency_now();
+    while( count < BENCH_SAMPLES_MAX && (count < BENCH_ITERATIONS_MIN || latency_now() - start < BENCH_TIME_NS) ) {
+        int64_t ts = latency_now();
+        run(ctx);
+        samples[count++] = latency_now() - ts;
+    }
+    double cpu_ns = (double)(threadCpuTime() - start_cpu) / count / ops;
+    qsort(samples, count, sizeof(samples[0]), compareSamples);
+    double median_ns = (double)samples[count / 2] / ops;
+    double min_ns = (double)samples[0] / ops;
+
+    fprintf(out, "%s    { \"name\": \"%s\", \"iterations\": %d, \"median_ns\": %.1f, \"min_ns\": %.1f, "
+        "\"cpu_ns\": %.1f, \"bytes\": %zu, \"mb_per_s\": %.1f", first_result ? "" : ",\n", name, count * ops,
+        median_ns, min_ns, cpu_ns, bytes, bytes * 1000.0 / median_ns);
+    first_result = false;
+    if( syscalls ) {
+        double per_op = (double)(syscalls(ctx) - start_syscalls) / count / ops;
+        fprintf(out, ", \"syscalls\": %.2f", per_op);
+        fprintf(stderr, "%-40s %12.1f ns %10.1f MB/s %12.1f cpu ns %8.2f syscalls\n", name, median_ns,
+            bytes * 1000.0 / median_ns, cpu_ns, per_op);
+    } else {
+        fprintf(stderr, "%-40s %12.1f ns %10.1f MB/s %12.1f cpu ns\n", name, median_ns, bytes * 1000.0 / median_ns,
+            cpu_ns);
+    }
+    fprintf(out, " }");
+}
+
+// Conversion of the captured image to the encoder frame, with scaling if the sizes differ
+
+struct convert_bench {
+    enum AVPixelFormat src_fmt;
+    int src_width, src_height;
+    const uint8_t *planes[4];
+    int linesizes[4];
+    struct converter converter;
+    AVFrame *frame;
+};
+
+static void runConvert(void *ctx) {
+    struct convert_bench *b = ctx;
+    convert_frame(&b->converter, b->src_fmt, b->src_width, b->src_height, b->planes, b->linesizes, b->frame);
+}
+
+static void benchConvert(enum AVPixelFormat src_fmt, int src_width, int src_height, int width, int height) {
+    struct convert_bench b = { src_fmt, src_width, src_height, { NULL }, { 0 },
+        { NULL, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE, 0, 0, 0, 0 }, av_frame_alloc() };
+    int stride = av_image_get_linesize(src_fmt, src_width, 0);
+    uint8_t *data = malloc((size_t)stride * src_height * 2);
+    if( !data || !b.frame )
+        goto done;
+    // Not a flat image, so the conversion isn't shortcut on the uniform rows
+    for( size_t i = 0; i < (size_t)stride * src_height * 2; i++ )
+        data[i] = (i * 7) ^ (i >> 11);
+    convert_shm_planes(src_fmt, data, stride, src_height, false, b.planes, b.linesizes);
+
+    b.frame->format = convert_target_format(src_fmt);
+    b.frame->width = width;
+    b.frame->height = height;
+    if( av_frame_get_buffer(b.frame, 0) < 0 )
+        goto done;
+
+    char name[96];
+    if( width != src_width || height != src_height )
+        snprintf(name, sizeof(name), "convert/%s/%dx%d->%dx%d", av_get_pix_fmt_name(src_fmt),
+            src_width, src_height, width, height);
+    else
+        snprintf(name, sizeof(name), "convert/%s/%dx%d", av_get_pix_fmt_name(src_fmt), src_width, src_height);
+    runBench(name, runConvert, NULL, &b, 1, (size_t)stride * src_height);
+
+done:
+    convert_free(&b.converter);
+    av_frame_free(&b.frame);
+    free(data);
+}
+
+// Annex B start codes to the NALU sizes, the start codes are put back before every run
+
+struct annexb_bench {
+    uint8_t *data;
+    size_t size;
+    size_t nalus[4];
+    int nalus_count;
+};
+
+static void runAnnexB(void *ctx) {
+    struct annexb_bench *b = ctx;
+    for( int i = 0; i < b->nalus_count; i++ )
+        memcpy(&b->data[b->nalus[i]], "\0\0\0\1", 4);
+    stream_annexb_to_avcc(b->data, b->size);
+}
+
+static void benchAnnexB(size_t size) {
+    // SEI, slice & two small NALUs like the first frame has, the rest is the slice data
+    struct annexb_bench b = { malloc(size), size, { 0, 64, size - 96, size - 32 }, 4 };
+    if( !b.data )
+        return;
+    for( size_t i = 0; i < size; i++ )
+        b.data[i] = 1 + (i * 31) % 255;
+
+    char name[64];
+    snprintf(name, sizeof(name), "annexb_to_avcc/%zuKB", size / 1024);
+    runBench(name, runAnnexB, NULL, &b, 1, size);
+    free(b.data);
+}
+
+// Header of every payload, built in batches since a single one is a few ns
+
+#define HEADER_BATCH 1000
+
+static void runHeader(void *ctx) {
+    uint8_t *header = ctx;
+    for( int i = 0; i < HEADER_BATCH; i++ )
+        stream_header(header, 1000 + i, STREAM_VIDEO_DATA, (uint64_t)i << 32);
+    __asm__ volatile("" : : "r"(header) : "memory");
+}
+
+static void benchHeader() {
+    uint8_t header[STREAM_HEADER_SIZE];
+    runBench("stream_header", runHeader, NULL, header, HEADER_BATCH, STREAM_HEADER_SIZE);
+}
+
+// Header & frame written to every receiver one by one, like the session does, or
+// by one io_uring submission (--io-uring), loopback readers drain the sockets
+
+struct fanout_bench {
+    int listen_fd;
+    int readers_count;
+    pthread_t readers[BENCH_RECEIVERS_MAX];
+    struct receiver *receivers[BENCH_RECEIVERS_MAX];
+    int receivers_count;
+    uint8_t header[STREAM_HEADER_SIZE];
+    uint8_t *data;
+    size_t size;
+    struct uring *uring;           // NULL - send() one by one
+    struct uring_write writes[BENCH_RECEIVERS_MAX];
+};
+
+static void *readerThread(void *arg) {
+    int fd = (intptr_t)arg;
+    static __thread uint8_t buf[65536];
+    while( recv(fd, buf, sizeof(buf), 0) > 0 ) {
+        // Discarded
+    }
+    close(fd);
+    return NULL;
+}
+
+static void runFanout(void *ctx) {
+    struct fanout_bench *b = ctx;
+    for( int i = 0; i < b->receivers_count; i++ ) {
+        receiver_send(b->receivers[i], b->header, STREAM_HEADER_SIZE);
+        receiver_send(b->receivers[i], b->data, b->size);
+    }
+}
+
+static void runFanoutUring(void *ctx) {
+    struct fanout_bench *b = ctx;
+    uring_write_all(b->uring, b->writes, b->receivers_count, RECEIVER_SEND_TIMEOUT_MS);
+    for( int i = 0; i < b->receivers_count; i++ )
+        receiver_sent(b->receivers[i], b->writes[i].done, b->writes[i].error);
+}
+
+static uint64_t fanoutSyscalls(void *ctx) {
+    struct fanout_bench *b = ctx;
+    if( b->uring )
+        return b->uring->enters;
+    uint64_t calls = 0;
+    for( int i = 0; i < b->receivers_count; i++ )
+        calls += b->receivers[i]->send_calls;
+    return calls;
+}
+
+static void benchFanout(int receivers, size_t size, bool io_uring) {
+    struct fanout_bench b = { .listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), .size = size };
+    if( io_uring && !(b.uring = uring_new(URING_ENTRIES)) )
+        goto done;
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    b.data = calloc(1, size);
+    if( b.listen_fd < 0 || !b.data || bind(b.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(b.listen_fd, receivers) < 0
+            || getsockname(b.listen_fd, (struct sockaddr *)&addr, &addr_len) < 0 ) {
+        LOG_ERROR("Unable to listen on loopback: %m");
+        goto done;
+    }
+
+    char address[32];
+    snprintf(address, sizeof(address), "127.0.0.1:%d", ntohs(addr.sin_port));
+    for( int i = 0; i < receivers; i++ ) {
+        struct receiver *r = receiver_connect(address, 1000);
+        int fd = accept4(b.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if( !r || fd < 0 ) {
+            receiver_free(r);
+            goto done;
+        }
+        b.receivers[b.receivers_count++] = r;
+        if( pthread_create(&b.readers[b.readers_count], NULL, readerThread, (void *)(intptr_t)fd) != 0 ) {
+            close(fd);
+            goto done;
+        }
+        b.readers_count++;
+    }
+    stream_header(b.header, size, STREAM_VIDEO_DATA, 0);
+    for( int i = 0; i < b.receivers_count; i++ ) {
+        b.writes[i].fd = b.receivers[i]->fd;
+        b.writes[i].socket = true;
+        b.writes[i].iov[0] = (struct iovec){ b.header, STREAM_HEADER_SIZE };
+        b.writes[i].iov[1] = (struct iovec){ b.data, size };
+        b.writes[i].iovcnt = 2;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "fanout_%s/%dx%zuKB", io_uring ? "uring" : "send", receivers, size / 1024);
+    runBench(name, io_uring ? runFanoutUring : runFanout, fanoutSyscalls, &b, 1,
+        (STREAM_HEADER_SIZE + size) * receivers);
+
+done:
+    // Closed connections stop the readers
+    for( int i = 0; i < b.receivers_count; i++ )
+        receiver_free(b.receivers[i]);
+    for( int i = 0; i < b.readers_count; i++ )
+        pthread_join(b.readers[i], NULL);
+    if( b.listen_fd >= 0 )
+        close(b.listen_fd);
+    uring_free(b.uring);
+    free(b.data);
+}
+
+// CPU model is stored with the results, the baseline is comparable on the same one
+static void cpuModel(char *model, size_t size) {
+    snprintf(model, size, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if( !f )
+        return;
+    char line[256];
+    while( fgets(line, sizeof(line), f) ) {
+        char *value = strchr(line, ':');
+        if( strncmp(line, "model name", 10) == 0 && value ) {
+            value += strspn(value, ": ");
+            value[strcspn(value, "\n\"\\")] = '\0';
+            snprintf(model, size, "%s", value);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    const char *out_path = NULL;
+    int c;
+    while( (c = getopt(argc, argv, "ho:f:")) != -1 ) {
+        switch( c ) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o <file.json>] [-f <name filter>]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    log_start();
+    log_set_level(LOG_LEVEL_ERROR);
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if( !out ) {
+        LOG_ERROR("Unable to open %s: %m", out_path);
+        log_stop();
+        return 1;
+    }
+
+    char model[128];
+    cpuModel(model, sizeof(model));
+    fprintf(out, "{\n  \"cpu\": \"%s\",\n  \"benchmarks\": [\n", model);
+
+    static const enum AVPixelFormat formats[] = { AV_PIX_FMT_BGR0, AV_PIX_FMT_RGB0, AV_PIX_FMT_NV12 };
+    static const int sizes[][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+    for( size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++ ) {
+        for( size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ )
+            benchConvert(formats[f], sizes[i][0], sizes[i][1], sizes[i][0], sizes[i][1]);
+    }
+    // --encode-size receiver of a 1440p output
+    benchConvert(AV_PIX_FMT_BGR0, 2560, 1440, RECEIVER_WIDTH, RECEIVER_HEIGHT);
+
+    benchAnnexB(4 * 1024);
+    benchAnnexB(64 * 1024);
+    benchAnnexB(512 * 1024);
+    benchHeader();
+    static const int fanouts[] = { 1, 4, 8, 32 };
+    for( size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++ )
+        benchFanout(fanouts[i], 64 * 1024, false);
+    benchFanout(4, 512 * 1024, false);
+    for( size_t i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++ )
+        benchFanout(fanouts[i], 64 * 1024, true);
+
+    fprintf(out, "\n  ]\n}\n");
+    if( out != stdout )
+        fclose(out);
+    log_stop();
+    return 0;
+}
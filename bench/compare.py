@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import os
+import sys
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data.get('cpu', 'unknown'), {b['name']: b for b in data['benchmarks']}
+
+def main():
+    parser = argparse.ArgumentParser(description='Compares the benchmark results with the baseline')
+    parser.add_argument('baseline', help='baseline results JSON')
+    parser.add_argument('current', help='current results JSON')
+    parser.add_argument('--tolerance', type=float, default=10.0,
+                        help='allowed slowdown of the median time in percents (default: 10)')
+    args = parser.parse_args()
+
+    if not os.path.exists(args.baseline):
+        print('No baseline %s, record it with: cmake --build <dir> --target bench-baseline' % args.baseline)
+        return 0
+
+    base_cpu, base = load(args.baseline)
+    cpu, current = load(args.current)
+    if base_cpu != cpu:
+        print('WARNING: baseline was recorded on "%s", the results are from "%s"' % (base_cpu, cpu))
+
+    regressions = 0
+    print('%-40s %12s %12s %8s' % ('benchmark', 'base_ns', 'median_ns', 'change'))
+    for name, result in current.items():
+        if name not in base:
+            print('%-40s %12s %12.1f %8s' % (name, '-', result['median_ns'], 'new'))
+            continue
+        change = (result['median_ns'] / base[name]['median_ns'] - 1.0) * 100.0
+        mark = ''
+        if change > args.tolerance:
+            mark = ' REGRESSION'
+            regressions += 1
+        print('%-40s %12.1f %12.1f %+7.1f%%%s' % (name, base[name]['median_ns'], result['median_ns'], change, mark))
+    for name in base:
+        if name not in current:
+            print('%-40s %12.1f %12s %8s' % (name, base[name]['median_ns'], '-', 'missing'))
+
+    if regressions:
+        print('%d benchmark(s) are slower than the baseline by more than %.0f%%' % (regressions, args.tolerance))
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1 +1,2 @@
-gcc -o wlroots-airplay1-mirror src/wlroots-airplay1-mirror.c src/wlr-screencopy-unstable-v1-protocol.c -lavformat -lavcodec -lavutil -lm -lswresample -lswscale -lrt -lwayland-client -lwlroots
+# Additional compiler flags could be passed as arguments, like: ./build.sh -DALLOC_ACCOUNTING
+gcc "$@" -o wlroots-airplay1-mirror src/wlroots-airplay1-mirror.c src/latency.c src/receiver.c src/control.c src/log.c src/alloc_stats.c src/realtime.c src/convert.c src/capture.c src/wayland.c src/capture_wlr.c src/capture_ext.c src/capture_file.c src/capture_synthetic.c src/capture_push.c src/workers.c src/session.c src/stream.c src/airplay_mirror.c src/roi.c src/replay.c src/relay.c src/uring.c src/governor.c src/perf.c src/bplist.c src/wlr-screencopy-unstable-v1-protocol.c src/ext-image-capture-source-v1-protocol.c src/ext-image-copy-capture-v1-protocol.c -lavformat -lavcodec -lavutil -lm -lswresample -lswscale -lrt -lwayland-client -lwlroots -lpthread
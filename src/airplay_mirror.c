@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "airplay_mirror.h"
+#include "log.h"
+#include "receiver.h"
+#include "session.h"
+#include "workers.h"
+
+struct airplay_mirror {
+    struct session *session;
+    struct capture_source *push_source; // owned by the session
+    bool stopped;
+};
+
+// Session index is the home worker of its jobs & the log prefix
+static _Atomic unsigned int mirrors_index = 0;
+
+int airplay_mirror_init(int workers, const char *device_id) {
+    if( session_init(NULL, device_id) < 0 )
+        return -1;
+    if( workers <= 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? MIN(cpus, WORKERS_MAX) : 1;
+    }
+    return workers_start(workers);
+}
+
+void airplay_mirror_shutdown() {
+    workers_stop();
+}
+
+struct airplay_mirror *airplay_mirror_new(const struct airplay_mirror_config *config) {
+    struct airplay_mirror *m = calloc(1, sizeof(struct airplay_mirror));
+    if( !m )
+        return NULL;
+
+    struct session_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.source_spec = config->source_spec;
+    cfg.capture = config->capture;
+    cfg.receiver_size = config->receiver_size;
+    cfg.file_path = config->file_path;
+    cfg.latency_ms = config->latency_ms > 0 ? config->latency_ms : SESSION_LATENCY_MS;
+    cfg.fps = config->fps > 0 ? config->fps : SESSION_FPS;
+    cfg.capture.fps = cfg.fps;
+    cfg.crf = config->crf > 0 ? config->crf : SESSION_CRF;
+    cfg.max_bitrate = config->max_bitrate;
+    cfg.frame_bytes = config->frame_bytes;
+    cfg.pacing = config->pacing;
+    cfg.replay_seconds = config->replay_seconds;
+    cfg.replay_bytes = (int64_t)(config->replay_mb > 0 ? config->replay_mb : REPLAY_MB_DEFAULT) << 20;
+    cfg.io_uring = config->io_uring;
+    cfg.packet_cb = config->packet;
+    cfg.packet_opaque = config->opaque;
+    if( config->push ) {
+        cfg.source = capture_push_new();
+        if( !cfg.source ) {
+            free(m);
+            return NULL;
+        }
+        m->push_source = cfg.source;
+    }
+
+    m->session = session_new(atomic_fetch_add(&mirrors_index, 1), &cfg);
+    if( !m->session ) {
+        free(m);
+        return NULL;
+    }
+    if( session_start(m->session) < 0 ) {
+        session_free(m->session);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void airplay_mirror_stop(struct airplay_mirror *m) {
+    if( m->stopped )
+        return;
+    session_stop(m->session);
+    session_join(m->session);
+    m->stopped = true;
+}
+
+void airplay_mirror_free(struct airplay_mirror *m) {
+    if( !m )
+        return;
+    airplay_mirror_stop(m);
+    session_report(m->session);
+    session_free(m->session);
+    free(m);
+}
+
+int airplay_mirror_add_sink(struct airplay_mirror *m, const char *address) {
+    // Connecting could take a while, so it's done without the lock
+    struct receiver *r = receiver_connect(address, RECEIVER_CONNECT_TIMEOUT_MS);
+    if( !r )
+        return -1;
+
+    pthread_mutex_lock(&m->session->lock);
+    int ret = session_add_receiver(m->session, r);
+    pthread_mutex_unlock(&m->session->lock);
+    if( ret < 0 ) {
+        LOG_ERROR("Session %u has too many receivers", m->session->index);
+        receiver_free(r);
+    }
+    return ret;
+}
+
+int airplay_mirror_remove_sink(struct airplay_mirror *m, const char *address) {
+    pthread_mutex_lock(&m->session->lock);
+    struct receiver *r = session_remove_receiver(m->session, address);
+    pthread_mutex_unlock(&m->session->lock);
+    if( !r ) {
+        LOG_ERROR("Session %u has no receiver %s", m->session->index, address);
+        return -1;
+    }
+    LOG_INFO("Removed airplay 1.0 device: %s", r->address);
+    receiver_free(r);
+    return 0;
+}
+
+int airplay_mirror_push_frame(struct airplay_mirror *m, const struct capture_frame *frame) {
+    if( !m->push_source ) {
+        LOG_ERROR("Session %u captures from %s source, not the pushed frames", m->session->index,
+            m->session->source->name);
+        return -1;
+    }
+    if( capture_push_frame(m->push_source, frame) < 0 )
+        return -1;
+    capture_push_wait(m->push_source);
+    return 0;
+}
+
+int airplay_mirror_save_replay(struct airplay_mirror *m, const char *path) {
+    return session_save_replay(m->session, path);
+}
+
+bool airplay_mirror_finished(struct airplay_mirror *m, int *exit_code) {
+    bool finished = session_finished(m->session);
+    if( finished && exit_code )
+        *exit_code = m->session->exit_code;
+    return finished;
+}
+
+void airplay_mirror_get_stats(struct airplay_mirror *m, struct airplay_mirror_stats *stats) {
+    struct session *s = m->session;
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&s->lock);
+    stats->fps = s->stats.fps;
+    stats->frames_captured = s->stats.frames_captured;
+    stats->frames_encoded = s->stats.frames_encoded;
+    stats->keyframes = s->stats.keyframes;
+    stats->bytes_encoded = s->stats.bytes_encoded;
+    stats->max_frame_bytes = s->stats.max_frame_bytes;
+    stats->sinks = s->receivers_count;
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        if( s->receivers[i]->state == RECEIVER_UP )
+            stats->sinks_up++;
+        stats->frames_dropped += s->receivers[i]->frames_dropped;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
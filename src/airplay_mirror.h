@@ -0,0 +1,86 @@
+#ifndef AIRPLAY_MIRROR_H
+#define AIRPLAY_MIRROR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "capture.h"
+#include "stream.h"
+
+// Embedding API: every mirror is an independent session (encoder, outputs, stats),
+// so any number of them could run in one process. Functions return -1 or NULL on
+// error instead of exiting, the details are logged (log_start() starts the output).
+
+struct airplay_mirror;
+
+struct airplay_mirror_config {
+    // Frames source: capture spec (see capture_open), or push mode with the frames
+    // given by airplay_mirror_push_frame()
+    const char *source_spec;       // NULL - default wayland capture
+    bool push;
+    struct capture_options capture;
+    bool receiver_size;            // scale to fit the receiver screen
+    const char *file_path;         // stream dump, NULL - off
+    int latency_ms;                // 0 - default
+    int fps;                       // 0 - default, rate of the capture (max rate of the pushed frames)
+    int crf;                       // 0 - default
+    int64_t max_bitrate;           // 0 - off
+    int64_t frame_bytes;           // 0 - off
+    int pacing;                    // 0 - off
+    int replay_seconds;            // instant replay length, 0 - off
+    int replay_mb;                 // 0 - default
+    bool io_uring;                 // batch the frame sends & writes by io_uring if available
+    // Payloads as they go to the sinks, called from the worker thread: avcC record on
+    // the encoder (re)start and the frames with NALU sizes. NULL - off
+    void (*packet)(void *opaque, enum stream_payload type, const uint8_t *data, size_t size,
+        uint64_t ntp_ts, bool keyframe);
+    void *opaque;
+};
+
+struct airplay_mirror_stats {
+    double fps;
+    uint64_t frames_captured;
+    uint64_t frames_encoded;
+    uint64_t keyframes;
+    uint64_t bytes_encoded;
+    uint64_t max_frame_bytes;
+    unsigned int sinks;
+    unsigned int sinks_up;
+    uint64_t frames_dropped;       // sum of the sinks
+};
+
+// Process-wide: finds the encoder & starts the worker pool shared by the mirrors
+// (0 workers - one per core). device_id could be NULL for the default one.
+int airplay_mirror_init(int workers, const char *device_id);
+void airplay_mirror_shutdown();
+
+// Opens the source & starts the session, the capture source gives the first frame
+// before it returns. Push mode session waits for the first pushed frame.
+struct airplay_mirror *airplay_mirror_new(const struct airplay_mirror_config *config);
+// Stops the session after the current frame, blocked & later airplay_mirror_push_frame()
+// calls return -1. Could be called from another thread than the pushing one.
+void airplay_mirror_stop(struct airplay_mirror *m);
+// Stops the session if needed and closes the sinks, no other call of the mirror should
+// be in progress
+void airplay_mirror_free(struct airplay_mirror *m);
+
+// Connects to the receiver "addr[:port]" (blocks up to the connect timeout), it gets
+// the stream from the next keyframe
+int airplay_mirror_add_sink(struct airplay_mirror *m, const char *address);
+// Sink by address or "#<index>"
+int airplay_mirror_remove_sink(struct airplay_mirror *m, const char *address);
+
+// Push mode: the frame is converted straight from the caller buffers, so the call
+// blocks until the session doesn't use them anymore (at most a frame interval).
+// Returns -1 if the session is stopped or failed.
+int airplay_mirror_push_frame(struct airplay_mirror *m, const struct capture_frame *frame);
+
+// Writes the instant replay of the last replay_seconds, container by the path extension
+int airplay_mirror_save_replay(struct airplay_mirror *m, const char *path);
+
+// Session stopped on error or end of the source, the exit code is EXIT_FAILURE then
+bool airplay_mirror_finished(struct airplay_mirror *m, int *exit_code);
+void airplay_mirror_get_stats(struct airplay_mirror *m, struct airplay_mirror_stats *stats);
+
+#endif // AIRPLAY_MIRROR_H
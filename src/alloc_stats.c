@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "alloc_stats.h"
+
+#ifdef ALLOC_ACCOUNTING
+
+// glibc internal allocator entry points, the wrappers below replace the
+// public symbols for the whole process including libav and x264
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread bool tracking = false;
+static __thread struct alloc_stats current;
+
+static inline void account(size_t size) {
+    if( !tracking )
+        return;
+    current.count++;
+    current.bytes += size;
+    if( size >= ALLOC_LARGE_SIZE )
+        current.large++;
+}
+
+void alloc_stats_begin() {
+    current = (struct alloc_stats){ 0 };
+    tracking = true;
+}
+
+void alloc_stats_end(struct alloc_stats *out) {
+    tracking = false;
+    *out = current;
+}
+
+void *malloc(size_t size) {
+    account(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    account(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    account(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    account(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    account(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    account(size);
+    void *ptr = __libc_memalign(alignment, size);
+    if( !ptr )
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+#endif // ALLOC_ACCOUNTING
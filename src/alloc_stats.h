@@ -0,0 +1,24 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <stdint.h>
+
+// Allocations bigger than this are buffers (frames, packets, contexts),
+// the small ones are mostly libav refcount wrappers
+#define ALLOC_LARGE_SIZE 1024
+
+struct alloc_stats {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t large;
+};
+
+// Allocation accounting is available only in the debug builds with
+// -DALLOC_ACCOUNTING and src/alloc_stats.c, which interposes malloc & co
+#ifdef ALLOC_ACCOUNTING
+// Counts allocations of the calling thread from begin to end
+void alloc_stats_begin();
+void alloc_stats_end(struct alloc_stats *out);
+#endif
+
+#endif // ALLOC_STATS_H
@@ -0,0 +1,122 @@
+#include <string.h>
+
+#include "bplist.h"
+
+static void putBytes(struct bplist *p, const void *data, size_t len) {
+    if( p->overflow || p->len + len > p->size ) {
+        p->overflow = true;
+        return;
+    }
+    memcpy(&p->buf[p->len], data, len);
+    p->len += len;
+}
+
+static void putByte(struct bplist *p, uint8_t byte) {
+    putBytes(p, &byte, 1);
+}
+
+// Big-endian unsigned of the given size
+static void putUInt(struct bplist *p, uint64_t value, int size) {
+    for( int i = size - 1; i >= 0; i-- )
+        putByte(p, (value >> (i * 8)) & 0xff);
+}
+
+static void putInt(struct bplist *p, int64_t value) {
+    // Negative & big values are 8 bytes signed, the rest is the shortest unsigned
+    if( value < 0 || value > UINT32_MAX ) {
+        putByte(p, 0x13);
+        putUInt(p, value, 8);
+    } else if( value > UINT16_MAX ) {
+        putByte(p, 0x12);
+        putUInt(p, value, 4);
+    } else if( value > UINT8_MAX ) {
+        putByte(p, 0x11);
+        putUInt(p, value, 2);
+    } else {
+        putByte(p, 0x10);
+        putUInt(p, value, 1);
+    }
+}
+
+// Marker with the count in low nibble, or 0xf followed by the int object
+static void putMarker(struct bplist *p, uint8_t type, size_t count) {
+    if( count < 15 ) {
+        putByte(p, type | count);
+    } else {
+        putByte(p, type | 0x0f);
+        putInt(p, count);
+    }
+}
+
+static int beginObject(struct bplist *p) {
+    if( p->count >= BPLIST_OBJECTS_MAX ) {
+        p->overflow = true;
+        return -1;
+    }
+    p->offsets[p->count] = p->len;
+    return p->count++;
+}
+
+static int endObject(struct bplist *p, int index) {
+    return p->overflow ? -1 : index;
+}
+
+void bplist_init(struct bplist *p, uint8_t *buf, size_t size) {
+    p->buf = buf;
+    p->size = size;
+    p->len = 0;
+    p->count = 0;
+    p->overflow = false;
+    putBytes(p, "bplist00", 8);
+}
+
+int bplist_add_string(struct bplist *p, const char *str) {
+    int index = beginObject(p);
+    size_t len = strlen(str);
+    putMarker(p, 0x50, len);
+    putBytes(p, str, len);
+    return endObject(p, index);
+}
+
+int bplist_add_int(struct bplist *p, int64_t value) {
+    int index = beginObject(p);
+    putInt(p, value);
+    return endObject(p, index);
+}
+
+int bplist_add_array(struct bplist *p, const int *refs, int count) {
+    int index = beginObject(p);
+    putMarker(p, 0xa0, count);
+    for( int i = 0; i < count; i++ )
+        putByte(p, refs[i]);
+    return endObject(p, index);
+}
+
+int bplist_add_dict(struct bplist *p, const int *keys, const int *values, int count) {
+    int index = beginObject(p);
+    putMarker(p, 0xd0, count);
+    for( int i = 0; i < count; i++ )
+        putByte(p, keys[i]);
+    for( int i = 0; i < count; i++ )
+        putByte(p, values[i]);
+    return endObject(p, index);
+}
+
+ssize_t bplist_finish(struct bplist *p) {
+    if( p->count == 0 )
+        return -1;
+    size_t table_offset = p->len;
+    int offset_size = table_offset > UINT16_MAX ? 4 : table_offset > UINT8_MAX ? 2 : 1;
+    for( int i = 0; i < p->count; i++ )
+        putUInt(p, p->offsets[i], offset_size);
+
+    // Trailer: 6 unused bytes, offset & reference sizes, objects count, top object, table offset
+    for( int i = 0; i < 6; i++ )
+        putByte(p, 0);
+    putByte(p, offset_size);
+    putByte(p, 1);
+    putUInt(p, p->count, 8);
+    putUInt(p, p->count - 1, 8);
+    putUInt(p, table_offset, 8);
+    return p->overflow ? -1 : (ssize_t)p->len;
+}
@@ -0,0 +1,35 @@
+#ifndef BPLIST_H
+#define BPLIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Object references are written in one byte
+#define BPLIST_OBJECTS_MAX 255
+
+// Minimal bplist00 writer to the caller buffer. Objects are added children first,
+// the containers refer to the indexes returned for them, and the last added object
+// is the top one.
+struct bplist {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    size_t offsets[BPLIST_OBJECTS_MAX];
+    int count;
+    bool overflow;
+};
+
+void bplist_init(struct bplist *p, uint8_t *buf, size_t size);
+
+// Every add returns the object index or -1 when the buffer or object table is full
+int bplist_add_string(struct bplist *p, const char *str); // ASCII only
+int bplist_add_int(struct bplist *p, int64_t value);
+int bplist_add_array(struct bplist *p, const int *refs, int count);
+int bplist_add_dict(struct bplist *p, const int *keys, const int *values, int count);
+
+// Writes the offset table & trailer, returns the plist size or -1 on overflow
+ssize_t bplist_finish(struct bplist *p);
+
+#endif // BPLIST_H
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "capture.h"
+#include "log.h"
+#include "wayland.h"
+
+int capture_parse_size(const char *str, int *width, int *height) {
+    char end;
+    if( sscanf(str, "%dx%d%c", width, height, &end) != 2 || *width <= 0 || *height <= 0 )
+        return -1;
+    // Encoder needs even size for 4:2:0
+    if( *width % 2 || *height % 2 )
+        return -1;
+    return 0;
+}
+
+int capture_parse_region(const char *str, struct capture_rect *region) {
+    char end;
+    if( sscanf(str, "%d,%d,%d,%d%c", &region->x, &region->y, &region->width, &region->height, &end) != 4 )
+        return -1;
+    if( region->x < 0 || region->y < 0 || region->width <= 0 || region->height <= 0 )
+        return -1;
+    // Encoder needs even size for 4:2:0
+    if( region->width % 2 || region->height % 2 )
+        return -1;
+    return 0;
+}
+
+void capture_add_damage(struct capture_rect *damage, int *count, int x, int y, int width, int height) {
+    if( *count < CAPTURE_DAMAGE_MAX ) {
+        damage[(*count)++] = (struct capture_rect){ x, y, width, height };
+        return;
+    }
+    // Too many rectangles, the last one grows to cover the rest
+    struct capture_rect *last = &damage[CAPTURE_DAMAGE_MAX - 1];
+    int x2 = MAX(last->x + last->width, x + width), y2 = MAX(last->y + last->height, y + height);
+    last->x = MIN(last->x, x);
+    last->y = MIN(last->y, y);
+    last->width = x2 - last->x;
+    last->height = y2 - last->y;
+}
+
+int capture_crop(struct capture_frame *frame, const struct capture_rect *area) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    if( !desc )
+        return -1;
+
+    // Chroma planes have to start on the whole sample, the size stays even
+    int x = area->x & ~((1 << desc->log2_chroma_w) - 1);
+    int y = area->y & ~((1 << desc->log2_chroma_h) - 1);
+    int width = MIN(area->width, frame->width - x) & ~1;
+    int height = MIN(area->height, frame->height - y) & ~1;
+    if( width <= 0 || height <= 0 ) {
+        LOG_ERROR("Region %d,%d,%d,%d is outside of the %dx%d frame", area->x, area->y,
+            area->width, area->height, frame->width, frame->height);
+        return -1;
+    }
+
+    // Negative linesize of the y-inverted frames moves the pointer the right way too
+    for( int i = 0; i < 4 && frame->data[i]; i++ ) {
+        int shift = i > 0 && i < 3 ? desc->log2_chroma_h : 0;
+        frame->data[i] += (ptrdiff_t)(y >> shift) * frame->linesize[i];
+        if( x > 0 )
+            frame->data[i] += av_image_get_linesize(frame->format, x, i);
+    }
+    frame->width = width;
+    frame->height = height;
+
+    // Damage is clipped to the area and moved to its origin
+    int count = 0;
+    for( int i = 0; i < frame->damage_count; i++ ) {
+        struct capture_rect *r = &frame->damage[i];
+        int x1 = MAX(r->x, x), y1 = MAX(r->y, y);
+        int x2 = MIN(r->x + r->width, x + width), y2 = MIN(r->y + r->height, y + height);
+        if( x2 > x1 && y2 > y1 )
+            frame->damage[count++] = (struct capture_rect){ x1 - x, y1 - y, x2 - x1, y2 - y1 };
+    }
+    if( frame->damage_count > 0 )
+        frame->damage_count = count;
+    return 0;
+}
+
+// Session based ext-image-copy-capture when the compositor has it, screencopy otherwise.
+// The region is copied by the compositor only with screencopy (ext copies the whole output
+// and crops it), so it's preferred then.
+static struct capture_source *openWayland(const struct capture_options *opts) {
+    // Connection is kept by the source, so it isn't reopened
+    struct wayland *wl = wayland_acquire();
+    if( !wl )
+        return NULL;
+    bool ext = wl->copy_capture_manager && wl->output_source_manager;
+    struct capture_source *src;
+    if( ext && (opts->region.width == 0 || !wl->screencopy_manager) )
+        src = capture_ext_new(opts);
+    else
+        src = capture_wlr_new(opts);
+    wayland_release();
+    return src;
+}
+
+struct capture_source *capture_open(const char *spec, const struct capture_options *opts) {
+    if( !spec )
+        return openWayland(opts);
+    if( strcmp(spec, "ext") == 0 )
+        return capture_ext_new(opts);
+    if( strcmp(spec, "wlr") == 0 )
+        return capture_wlr_new(opts);
+    if( strncmp(spec, "y4m:", 4) == 0 || strncmp(spec, "raw:", 4) == 0 )
+        return capture_file_new(spec, opts);
+    if( strncmp(spec, "synthetic", 9) == 0 && (spec[9] == '\0' || spec[9] == ':') )
+        return capture_synthetic_new(spec, opts);
+
+    LOG_ERROR("Unknown capture source '%s' (ext, wlr, y4m:, raw:, synthetic)", spec);
+    return NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libavutil/pixfmt.h>
+
+#define CAPTURE_DAMAGE_MAX 32
+// Source waiting for the screen change returns CAPTURE_TIMEOUT after this wait (the session
+// heartbeat period), the capture call continues the wait then
+#define CAPTURE_TIMEOUT_MS 1000
+#define CAPTURE_TIMEOUT 1
+
+struct capture_rect {
+    int x, y, width, height;
+};
+
+// Captured image, valid until the next capture call of the source
+struct capture_frame {
+    enum AVPixelFormat format;
+    int width, height;
+    const uint8_t *data[4];
+    int linesize[4]; // negative for the y-inverted images
+    uint64_t pts;    // nsec, could have an arbitrary offset at start
+    // Changed areas since the previous frame, -1 count if unknown (whole frame could change)
+    struct capture_rect damage[CAPTURE_DAMAGE_MAX];
+    int damage_count;
+};
+
+struct capture_source {
+    const char *name;
+    // Blocks until the next frame is captured, returns -1 on error or end of stream, or
+    // CAPTURE_TIMEOUT without the frame if the source waits for the screen change
+    int (*capture)(struct capture_source *src, struct capture_frame *frame);
+    void (*destroy)(struct capture_source *src);
+    // Optional: makes the blocked and the next captures return -1
+    void (*interrupt)(struct capture_source *src);
+    // Optional: called when the capture is stopped and the last frame isn't used anymore
+    void (*finish)(struct capture_source *src);
+    // Area cut from the captured frames by capture_next, for the sources that can't
+    // capture only the region themselves (zero size - whole frame)
+    struct capture_rect crop;
+    // Frame pts is CLOCK_MONOTONIC time of the capture (compositor presentation clock),
+    // otherwise it's the stream time and the capture time is when the frame was returned
+    bool monotonic_pts;
+};
+
+struct capture_options {
+    int output_num;   // wayland: output number to capture, starting from 1
+    bool with_cursor; // wayland: include cursors in the capture
+    int fps;          // file & synthetic: nominal rate for the timestamps
+    struct capture_rect region; // area to capture, zero size - whole output or frame
+};
+
+// Source by spec:
+//   NULL                                 - ext if advertised by the compositor, else wlr
+//   ext                                  - ext-image-copy-capture session
+//   wlr                                  - wlroots screencopy
+//   y4m:<path>                           - YUV4MPEG2 4:2:0 file, looped
+//   raw:<path>:<w>x<h>                   - raw BGRx frames file, looped
+//   synthetic[:static|scroll|motion][:<w>x<h>] - generated frames
+struct capture_source *capture_open(const char *spec, const struct capture_options *opts);
+
+// Adds the damaged rectangle, too many of them are merged into the last one
+void capture_add_damage(struct capture_rect *damage, int *count, int x, int y, int width, int height);
+
+// Cuts the area from the frame without copying, returns -1 if the area is outside of it
+int capture_crop(struct capture_frame *frame, const struct capture_rect *area);
+
+static inline int capture_next(struct capture_source *src, struct capture_frame *frame) {
+    int ret = src->capture(src, frame);
+    if( ret != 0 )
+        return ret < 0 ? -1 : ret;
+    return src->crop.width > 0 ? capture_crop(frame, &src->crop) : 0;
+}
+
+static inline void capture_close(struct capture_source *src) {
+    if( src )
+        src->destroy(src);
+}
+
+struct capture_source *capture_wlr_new(const struct capture_options *opts);
+struct capture_source *capture_ext_new(const struct capture_options *opts);
+struct capture_source *capture_file_new(const char *spec, const struct capture_options *opts);
+struct capture_source *capture_synthetic_new(const char *spec, const struct capture_options *opts);
+
+// Frames pushed by the caller (library API), captured as is without copying
+struct capture_source *capture_push_new();
+// Hands the frame to the capture, waits while the previous one is still in use.
+// Returns -1 if the source is interrupted.
+int capture_push_frame(struct capture_source *src, const struct capture_frame *frame);
+// Waits until the pushed frame isn't used anymore (the next capture call)
+void capture_push_wait(struct capture_source *src);
+
+// Parses "<w>x<h>", returns -1 on wrong format
+int capture_parse_size(const char *str, int *width, int *height);
+// Parses "<x>,<y>,<w>,<h>", returns -1 on wrong format
+int capture_parse_region(const char *str, struct capture_rect *region);
+
+#endif // CAPTURE_H
@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+
+#include <wayland-client.h>
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "capture.h"
+#include "convert.h"
+#include "latency.h"
+#include "log.h"
+#include "wayland.h"
+
+#define SESSION_FORMATS_MAX 64
+
+// Long-lived capture session: the buffer is allocated once per constraints and
+// every frame only attaches it and requests the copy, the compositor sends the damage
+struct ext_source {
+    struct capture_source base;
+    struct wayland *wl;
+    // Session and frames are on the source queue, so the sources don't dispatch each other
+    struct wl_event_queue *queue;
+    struct ext_image_copy_capture_manager_v1 *manager;
+    struct ext_image_capture_source_v1 *source;
+    struct ext_image_copy_capture_session_v1 *session;
+
+    // Buffer constraints, collected until the session done event
+    struct {
+        uint32_t formats[SESSION_FORMATS_MAX];
+        int formats_count;
+        int width, height;
+        bool complete;
+    } constraints;
+    bool constraints_changed;
+    bool stopped;
+    // Compositor holds the frame until the screen changes, the wait is woken by the eventfd
+    int interrupt_fd;
+    atomic_bool interrupted;
+
+    struct ext_image_copy_capture_frame_v1 *frame; // requested, kept over the timed out captures
+    bool ready;
+    bool failed;
+    uint32_t failure_reason;
+    uint32_t transform;
+    bool has_pts;
+    struct capture_rect damage[CAPTURE_DAMAGE_MAX];
+    int damage_count;
+
+    struct {
+        struct wl_buffer *wl_buffer;
+        void *data;
+        size_t size;
+        uint32_t format;
+        int width, height, stride;
+        bool fresh; // never captured into, the whole buffer has to be damaged
+        uint64_t pts;
+    } buffer;
+};
+
+// Constraints are re-sent as a whole, the first event after done starts a new set
+static void resetConstraints(struct ext_source *src) {
+    if( src->constraints.complete ) {
+        src->constraints.formats_count = 0;
+        src->constraints.complete = false;
+    }
+}
+
+static void session_handle_buffer_size(void *data,
+        struct ext_image_copy_capture_session_v1 *session, uint32_t width, uint32_t height) {
+    struct ext_source *src = data;
+    resetConstraints(src);
+    src->constraints.width = width;
+    src->constraints.height = height;
+}
+
+static void session_handle_shm_format(void *data,
+        struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+    struct ext_source *src = data;
+    resetConstraints(src);
+    if( src->constraints.formats_count < SESSION_FORMATS_MAX )
+        src->constraints.formats[src->constraints.formats_count++] = format;
+}
+
+static void session_handle_dmabuf_device(void *data,
+        struct ext_image_copy_capture_session_v1 *session, struct wl_array *device) {
+    // Reading dmabuf back needs GPU import, so only shm formats are used
+}
+
+static void session_handle_dmabuf_format(void *data,
+        struct ext_image_copy_capture_session_v1 *session, uint32_t format, struct wl_array *modifiers) {
+    LOG_TRACE("Skipping dmabuf format fourcc 0x%08x", format);
+}
+
+static void session_handle_done(void *data,
+        struct ext_image_copy_capture_session_v1 *session) {
+    struct ext_source *src = data;
+    src->constraints.complete = true;
+    src->constraints_changed = true;
+}
+
+static void session_handle_stopped(void *data,
+        struct ext_image_copy_capture_session_v1 *session) {
+    struct ext_source *src = data;
+    LOG_ERROR("capture session stopped by the compositor");
+    src->stopped = true;
+}
+
+static const struct ext_image_copy_capture_session_v1_listener session_listener = {
+    .buffer_size = session_handle_buffer_size,
+    .shm_format = session_handle_shm_format,
+    .dmabuf_device = session_handle_dmabuf_device,
+    .dmabuf_format = session_handle_dmabuf_format,
+    .done = session_handle_done,
+    .stopped = session_handle_stopped,
+};
+
+static void frame_handle_transform(void *data,
+        struct ext_image_copy_capture_frame_v1 *frame, uint32_t transform) {
+    struct ext_source *src = data;
+    if( transform != src->transform && transform != WL_OUTPUT_TRANSFORM_NORMAL &&
+            transform != WL_OUTPUT_TRANSFORM_FLIPPED_180 )
+        LOG_WARN("buffer transform %u is not applied", transform);
+    src->transform = transform;
+}
+
+static void frame_handle_damage(void *data,
+        struct ext_image_copy_capture_frame_v1 *frame,
+        int32_t x, int32_t y, int32_t width, int32_t height) {
+    struct ext_source *src = data;
+    capture_add_damage(src->damage, &src->damage_count, x, y, width, height);
+}
+
+static void frame_handle_presentation_time(void *data,
+        struct ext_image_copy_capture_frame_v1 *frame, uint32_t tv_sec_hi,
+        uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    struct ext_source *src = data;
+    src->buffer.pts = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
+    src->has_pts = true;
+}
+
+static void frame_handle_ready(void *data,
+        struct ext_image_copy_capture_frame_v1 *frame) {
+    struct ext_source *src = data;
+    src->ready = true;
+}
+
+static void frame_handle_failed(void *data,
+        struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
+    struct ext_source *src = data;
+    src->failure_reason = reason;
+    src->failed = true;
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
+    .transform = frame_handle_transform,
+    .damage = frame_handle_damage,
+    .presentation_time = frame_handle_presentation_time,
+    .ready = frame_handle_ready,
+    .failed = frame_handle_failed,
+};
+
+// Returns 1 if dispatched, 0 on timeout, -1 on error or interrupt
+static int dispatchTimeout(struct ext_source *src, int timeout_ms) {
+    if( atomic_load(&src->interrupted) )
+        return -1;
+    return wayland_dispatch_timeout(src->queue, src->interrupt_fd, timeout_ms);
+}
+
+// Waits on the source queue until the condition is set by the listeners
+static int dispatchUntil(struct ext_source *src, const bool *cond) {
+    while( !*cond && !src->stopped ) {
+        if( dispatchTimeout(src, -1) < 0 )
+            return -1;
+    }
+    return src->stopped ? -1 : 0;
+}
+
+// (Re)creates the buffer in the cheapest to encode of the session formats
+static int allocateBuffer(struct ext_source *src) {
+    src->constraints_changed = false;
+    int width = src->constraints.width, height = src->constraints.height;
+    uint32_t format = 0;
+    int64_t cost = INT64_MAX;
+    for( int i = 0; i < src->constraints.formats_count; i++ ) {
+        int64_t c = wayland_format_cost(src->constraints.formats[i], width, height);
+        if( c < cost ) {
+            format = src->constraints.formats[i];
+            cost = c;
+        }
+    }
+    if( cost == INT64_MAX ) {
+        LOG_ERROR("compositor offered no supported shm format");
+        return -1;
+    }
+
+    if( src->buffer.wl_buffer && format == src->buffer.format &&
+            width == src->buffer.width && height == src->buffer.height )
+        return 0;
+
+    wayland_destroy_shm_buffer(src->buffer.wl_buffer, src->buffer.data, src->buffer.size);
+    enum AVPixelFormat pix_fmt = wayland_shm_pixfmt(format);
+    src->buffer.format = format;
+    src->buffer.width = width;
+    src->buffer.height = height;
+    src->buffer.stride = av_image_get_linesize(pix_fmt, width, 0);
+    src->buffer.fresh = true;
+    LOG_INFO("Capturing %dx%d %s", width, height, av_get_pix_fmt_name(pix_fmt));
+    src->buffer.wl_buffer = wayland_create_shm_buffer(format, width, height,
+        src->buffer.stride, &src->buffer.size, &src->buffer.data);
+    if( src->buffer.wl_buffer == NULL ) {
+        LOG_ERROR("failed to create buffer");
+        return -1;
+    }
+    return 0;
+}
+
+static int extCapture(struct capture_source *base, struct capture_frame *out) {
+    struct ext_source *src = (struct ext_source *)base;
+
+    for( ;; ) {
+        if( src->stopped )
+            return -1;
+        // Frame requested by the timed out call is still waited for
+        if( !src->frame ) {
+            if( src->constraints_changed && allocateBuffer(src) < 0 )
+                return -1;
+
+            src->ready = false;
+            src->failed = false;
+            src->has_pts = false;
+            src->damage_count = 0;
+            src->frame = ext_image_copy_capture_session_v1_create_frame(src->session);
+            ext_image_copy_capture_frame_v1_add_listener(src->frame, &frame_listener, src);
+            ext_image_copy_capture_frame_v1_attach_buffer(src->frame, src->buffer.wl_buffer);
+            // The buffer always holds the previous frame, only the compositor damage has to be copied
+            if( src->buffer.fresh )
+                ext_image_copy_capture_frame_v1_damage_buffer(src->frame, 0, 0,
+                    src->buffer.width, src->buffer.height);
+            ext_image_copy_capture_frame_v1_capture(src->frame);
+        }
+
+        // Idle screen isn't copied until it changes, the session keeps the receivers alive meanwhile
+        int64_t deadline = latency_now() + CAPTURE_TIMEOUT_MS * 1000000LL;
+        int ret = 0;
+        while( !src->ready && !src->failed && !src->stopped && ret != -1 ) {
+            int64_t left_ms = (deadline - latency_now() + 999999) / 1000000;
+            if( left_ms <= 0 )
+                return CAPTURE_TIMEOUT;
+            ret = dispatchTimeout(src, left_ms);
+        }
+        ext_image_copy_capture_frame_v1_destroy(src->frame);
+        src->frame = NULL;
+        if( src->ready )
+            break;
+        if( !src->failed || src->failure_reason != EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS ) {
+            if( src->failed )
+                LOG_ERROR("failed to copy frame (reason %u)", src->failure_reason);
+            return -1;
+        }
+        // Output was resized or its format changed, new constraints follow
+        LOG_INFO("Buffer constraints changed, waiting for the new ones");
+        if( dispatchUntil(src, &src->constraints_changed) < 0 )
+            return -1;
+    }
+    src->buffer.fresh = false;
+
+    enum AVPixelFormat pix_fmt = wayland_shm_pixfmt(src->buffer.format);
+    bool y_invert = src->transform == WL_OUTPUT_TRANSFORM_FLIPPED_180;
+    out->format = pix_fmt;
+    out->width = src->buffer.width;
+    out->height = src->buffer.height;
+    out->pts = src->has_pts ? src->buffer.pts : (uint64_t)latency_now();
+    out->damage_count = src->damage_count;
+    for( int i = 0; i < src->damage_count; i++ ) {
+        out->damage[i] = src->damage[i];
+        if( y_invert )
+            out->damage[i].y = src->buffer.height - src->damage[i].y - src->damage[i].height;
+    }
+    convert_shm_planes(pix_fmt, src->buffer.data, src->buffer.stride, src->buffer.height,
+        y_invert, out->data, out->linesize);
+    return 0;
+}
+
+static void extInterrupt(struct capture_source *base) {
+    struct ext_source *src = (struct ext_source *)base;
+    atomic_store(&src->interrupted, true);
+    uint64_t one = 1;
+    if( write(src->interrupt_fd, &one, sizeof(one)) < 0 )
+        LOG_WARN("Unable to interrupt the capture: %m");
+}
+
+static void extDestroy(struct capture_source *base) {
+    struct ext_source *src = (struct ext_source *)base;
+    if( src->frame )
+        ext_image_copy_capture_frame_v1_destroy(src->frame);
+    wayland_destroy_shm_buffer(src->buffer.wl_buffer, src->buffer.data, src->buffer.size);
+    if( src->session )
+        ext_image_copy_capture_session_v1_destroy(src->session);
+    if( src->source )
+        ext_image_capture_source_v1_destroy(src->source);
+    if( src->manager )
+        wl_proxy_wrapper_destroy(src->manager);
+    if( src->queue )
+        wl_event_queue_destroy(src->queue);
+    if( src->interrupt_fd >= 0 )
+        close(src->interrupt_fd);
+    free(src);
+    wayland_release();
+}
+
+struct capture_source *capture_ext_new(const struct capture_options *opts) {
+    struct wayland *wl = wayland_acquire();
+    if( !wl )
+        return NULL;
+
+    if( wl->copy_capture_manager == NULL || wl->output_source_manager == NULL ) {
+        LOG_ERROR("compositor doesn't support ext-image-copy-capture-v1");
+        wayland_release();
+        return NULL;
+    }
+    if( opts->output_num < 1 || opts->output_num > wl->outputs_count ) {
+        LOG_ERROR("no output available (%d outputs, check -o)", wl->outputs_count);
+        wayland_release();
+        return NULL;
+    }
+    LOG_INFO("Using output: %d", opts->output_num);
+
+    struct ext_source *src = calloc(1, sizeof(struct ext_source));
+    if( !src ) {
+        wayland_release();
+        return NULL;
+    }
+    src->base.name = "ext";
+    src->base.capture = extCapture;
+    src->base.destroy = extDestroy;
+    src->base.interrupt = extInterrupt;
+    src->base.monotonic_pts = true;
+    src->base.crop = opts->region;
+    src->wl = wl;
+    src->interrupt_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if( src->interrupt_fd < 0 ) {
+        LOG_ERROR("eventfd failed: %m");
+        free(src);
+        wayland_release();
+        return NULL;
+    }
+    src->queue = wl_display_create_queue(wl->display);
+    src->manager = wl_proxy_create_wrapper(wl->copy_capture_manager);
+    wl_proxy_set_queue((struct wl_proxy *)src->manager, src->queue);
+
+    src->source = ext_output_image_capture_source_manager_v1_create_source(wl->output_source_manager,
+        wl->outputs[opts->output_num - 1]);
+    src->session = ext_image_copy_capture_manager_v1_create_session(src->manager, src->source,
+        opts->with_cursor ? EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS : 0);
+    ext_image_copy_capture_session_v1_add_listener(src->session, &session_listener, src);
+
+    // First constraints come right after the session is created
+    if( dispatchUntil(src, &src->constraints_changed) < 0 || allocateBuffer(src) < 0 ) {
+        extDestroy(&src->base);
+        return NULL;
+    }
+    return &src->base;
+}
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE /* for MAP_POPULATE */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/imgutils.h>
+
+#include "capture.h"
+#include "log.h"
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME"
+
+// Whole file is mapped & prefaulted, so the capture is just a pointer to the frame
+// and the benchmarks don't depend on the disk
+struct file_source {
+    struct capture_source base;
+    uint8_t *map;
+    size_t map_size;
+    enum AVPixelFormat format;
+    int width, height;
+    int rate_num, rate_den;
+    size_t *offsets;
+    size_t frames_count;
+    uint64_t frame_index;
+};
+
+static int fileCapture(struct capture_source *base, struct capture_frame *out) {
+    struct file_source *src = (struct file_source *)base;
+    // File is looped
+    uint8_t *data = src->map + src->offsets[src->frame_index % src->frames_count];
+    uint8_t *planes[4];
+
+    out->format = src->format;
+    out->width = src->width;
+    out->height = src->height;
+    av_image_fill_linesizes(out->linesize, src->format, src->width);
+    av_image_fill_pointers(planes, src->format, src->height, data, out->linesize);
+    memcpy(out->data, planes, sizeof(planes));
+    out->pts = src->frame_index * 1000000000ULL * src->rate_den / src->rate_num;
+    out->damage_count = -1;
+    src->frame_index++;
+    return 0;
+}
+
+static void fileDestroy(struct capture_source *base) {
+    struct file_source *src = (struct file_source *)base;
+    if( src->map )
+        munmap(src->map, src->map_size);
+    free(src->offsets);
+    free(src);
+}
+
+static int mapFile(struct file_source *src, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 ) {
+        LOG_ERROR("Unable to open %s: %m", path);
+        return -1;
+    }
+    struct stat st;
+    if( fstat(fd, &st) < 0 || st.st_size == 0 ) {
+        LOG_ERROR("Unable to read %s", path);
+        close(fd);
+        return -1;
+    }
+    src->map_size = st.st_size;
+    src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if( src->map == MAP_FAILED ) {
+        LOG_ERROR("Unable to map %s: %m", path);
+        src->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// "YUV4MPEG2 W1920 H1080 F30:1 Ip A1:1 C420jpeg\n" followed by "FRAME[ params]\n<data>" frames
+static int parseY4m(struct file_source *src, const char *path) {
+    const char *p = (const char *)src->map;
+    const char *end = p + src->map_size;
+    const char *eol = memchr(p, '\n', src->map_size);
+    if( src->map_size < strlen(Y4M_MAGIC) || memcmp(p, Y4M_MAGIC, strlen(Y4M_MAGIC)) != 0 || !eol ) {
+        LOG_ERROR("%s is not a YUV4MPEG2 file", path);
+        return -1;
+    }
+
+    src->format = AV_PIX_FMT_YUV420P;
+    for( p += strlen(Y4M_MAGIC); p < eol; p++ ) {
+        switch( *p ) {
+        case 'W':
+            src->width = atoi(p + 1);
+            break;
+        case 'H':
+            src->height = atoi(p + 1);
+            break;
+        case 'F':
+            sscanf(p + 1, "%d:%d", &src->rate_num, &src->rate_den);
+            break;
+        case 'C':
+            if( strncmp(p + 1, "420", 3) != 0 ) {
+                LOG_ERROR("%s: only 4:2:0 YUV4MPEG2 is supported", path);
+                return -1;
+            }
+            break;
+        }
+        // Skipping to the next parameter
+        while( p < eol && *p != ' ' )
+            p++;
+    }
+    if( src->width <= 0 || src->height <= 0 ) {
+        LOG_ERROR("%s: wrong frame size", path);
+        return -1;
+    }
+
+    size_t frame_size = av_image_get_buffer_size(src->format, src->width, src->height, 1);
+    size_t max_frames = src->map_size / frame_size + 1;
+    src->offsets = calloc(max_frames, sizeof(src->offsets[0]));
+    if( !src->offsets )
+        return -1;
+
+    for( p = eol + 1; p < end && src->frames_count < max_frames; ) {
+        eol = memchr(p, '\n', end - p);
+        if( !eol || (size_t)(end - p) < strlen(Y4M_FRAME) || memcmp(p, Y4M_FRAME, strlen(Y4M_FRAME)) != 0 )
+            break;
+        if( (size_t)(end - eol - 1) < frame_size )
+            break;
+        src->offsets[src->frames_count++] = (const uint8_t *)eol + 1 - src->map;
+        p = eol + 1 + frame_size;
+    }
+    return 0;
+}
+
+static int parseRaw(struct file_source *src) {
+    src->format = AV_PIX_FMT_BGR0;
+    size_t frame_size = (size_t)src->width * src->height * 4;
+    src->frames_count = src->map_size / frame_size;
+    src->offsets = calloc(src->frames_count ? src->frames_count : 1, sizeof(src->offsets[0]));
+    if( !src->offsets )
+        return -1;
+    for( size_t i = 0; i < src->frames_count; i++ )
+        src->offsets[i] = i * frame_size;
+    return 0;
+}
+
+struct capture_source *capture_file_new(const char *spec, const struct capture_options *opts) {
+    char path[PATH_MAX];
+    bool y4m = strncmp(spec, "y4m:", 4) == 0;
+
+    struct file_source *src = calloc(1, sizeof(struct file_source));
+    if( !src )
+        return NULL;
+    src->base.name = y4m ? "y4m" : "raw";
+    src->base.capture = fileCapture;
+    src->base.destroy = fileDestroy;
+    src->base.crop = opts->region;
+    src->rate_num = opts->fps;
+    src->rate_den = 1;
+
+    // Path could contain ':', so the raw frame size is after the last one
+    snprintf(path, sizeof(path), "%s", strchr(spec, ':') + 1);
+    if( !y4m ) {
+        char *size = strrchr(path, ':');
+        if( !size || capture_parse_size(size + 1, &src->width, &src->height) < 0 ) {
+            LOG_ERROR("Raw source should be raw:<path>:<width>x<height>");
+            fileDestroy(&src->base);
+            return NULL;
+        }
+        *size = '\0';
+    }
+
+    if( mapFile(src, path) < 0 || (y4m ? parseY4m(src, path) : parseRaw(src)) < 0 ) {
+        fileDestroy(&src->base);
+        return NULL;
+    }
+    if( src->frames_count == 0 ) {
+        LOG_ERROR("%s has no complete frames", path);
+        fileDestroy(&src->base);
+        return NULL;
+    }
+    if( src->rate_num <= 0 || src->rate_den <= 0 ) {
+        src->rate_num = opts->fps;
+        src->rate_den = 1;
+    }
+
+    LOG_INFO("Capturing %dx%d %s from %s (%zu frames, looped)", src->width, src->height,
+        src->base.name, path, src->frames_count);
+    return &src->base;
+}
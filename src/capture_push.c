@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "log.h"
+
+// One frame at a time: the pushing thread waits while the capture thread uses
+// the previous one, so the caller buffers are encoded without copying
+struct push_source {
+    struct capture_source base;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct capture_frame frame;
+    bool pending;     // pushed, not captured yet
+    bool in_use;      // captured, valid until the next capture call or finish
+    bool interrupted;
+};
+
+static int pushCapture(struct capture_source *base, struct capture_frame *out) {
+    struct push_source *src = (struct push_source *)base;
+    pthread_mutex_lock(&src->lock);
+    src->in_use = false;
+    pthread_cond_broadcast(&src->cond);
+    while( !src->pending && !src->interrupted )
+        pthread_cond_wait(&src->cond, &src->lock);
+    int ret = -1;
+    if( !src->interrupted ) {
+        *out = src->frame;
+        src->pending = false;
+        src->in_use = true;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&src->lock);
+    return ret;
+}
+
+// Frame that wasn't captured yet is given back, the captured one could be still converted
+static void pushInterrupt(struct capture_source *base) {
+    struct push_source *src = (struct push_source *)base;
+    pthread_mutex_lock(&src->lock);
+    src->interrupted = true;
+    src->pending = false;
+    pthread_cond_broadcast(&src->cond);
+    pthread_mutex_unlock(&src->lock);
+}
+
+static void pushFinish(struct capture_source *base) {
+    struct push_source *src = (struct push_source *)base;
+    pthread_mutex_lock(&src->lock);
+    src->interrupted = true;
+    src->pending = false;
+    src->in_use = false;
+    pthread_cond_broadcast(&src->cond);
+    pthread_mutex_unlock(&src->lock);
+}
+
+static void pushDestroy(struct capture_source *base) {
+    struct push_source *src = (struct push_source *)base;
+    pthread_mutex_destroy(&src->lock);
+    pthread_cond_destroy(&src->cond);
+    free(src);
+}
+
+int capture_push_frame(struct capture_source *base, const struct capture_frame *frame) {
+    struct push_source *src = (struct push_source *)base;
+    pthread_mutex_lock(&src->lock);
+    while( (src->pending || src->in_use) && !src->interrupted )
+        pthread_cond_wait(&src->cond, &src->lock);
+    int ret = -1;
+    if( !src->interrupted ) {
+        src->frame = *frame;
+        src->pending = true;
+        pthread_cond_broadcast(&src->cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&src->lock);
+    return ret;
+}
+
+void capture_push_wait(struct capture_source *base) {
+    struct push_source *src = (struct push_source *)base;
+    pthread_mutex_lock(&src->lock);
+    while( src->pending || src->in_use )
+        pthread_cond_wait(&src->cond, &src->lock);
+    pthread_mutex_unlock(&src->lock);
+}
+
+struct capture_source *capture_push_new() {
+    struct push_source *src = calloc(1, sizeof(struct push_source));
+    if( !src ) {
+        LOG_ERROR("Unable to allocate push source");
+        return NULL;
+    }
+    src->base.name = "push";
+    src->base.capture = pushCapture;
+    src->base.destroy = pushDestroy;
+    src->base.interrupt = pushInterrupt;
+    src->base.finish = pushFinish;
+    pthread_mutex_init(&src->lock, NULL);
+    pthread_cond_init(&src->cond, NULL);
+    return &src->base;
+}
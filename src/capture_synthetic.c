@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "log.h"
+
+#define SYNTHETIC_WIDTH 1920
+#define SYNTHETIC_HEIGHT 1080
+// Terminal-like text: 8x16 cells, scrolled by a few pixels per frame
+#define TEXT_CELL_WIDTH 8
+#define TEXT_CELL_HEIGHT 16
+#define TEXT_SCROLL_SPEED 4
+#define TEXT_BACKGROUND 0x1e1e1e
+#define TEXT_FOREGROUND 0xd0d0d0
+
+enum synthetic_pattern {
+    SYNTHETIC_STATIC, // same image every frame
+    SYNTHETIC_SCROLL, // scrolling text
+    SYNTHETIC_MOTION, // every pixel changes every frame
+};
+
+// Frames are BGRx, like the usual XRGB8888 of the compositors, so the conversion is exercised
+struct synthetic_source {
+    struct capture_source base;
+    enum synthetic_pattern pattern;
+    int width, height, fps;
+    uint32_t *pixels;
+    int pixels_rows;
+    int doc_rows; // scroll period, the image has a copy of the first screen after it
+    uint64_t frame_index;
+};
+
+static uint32_t mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Pseudo-glyph pixel of the text document, lines have different length like the source code
+static uint32_t textPixel(int x, int y) {
+    int line = y / TEXT_CELL_HEIGHT, row = y % TEXT_CELL_HEIGHT;
+    int col = x / TEXT_CELL_WIDTH, bit = x % TEXT_CELL_WIDTH;
+    uint32_t line_len = mix(line) % 100;
+    uint32_t glyph = mix(line * 131 + col);
+    if( col >= (int)line_len || glyph % 7 == 0 || row < 3 || row > 12 || bit == 7 )
+        return TEXT_BACKGROUND;
+    return (mix(glyph + row) >> bit) & 1 ? TEXT_FOREGROUND : TEXT_BACKGROUND;
+}
+
+static void drawStatic(struct synthetic_source *src) {
+    // Colour bars over the horizontal gradient
+    static const uint32_t bars[] = { 0xc0c0c0, 0xc0c000, 0x00c0c0, 0x00c000, 0xc000c0, 0xc00000, 0x0000c0 };
+    int bars_count = sizeof(bars) / sizeof(bars[0]);
+    for( int y = 0; y < src->height; y++ ) {
+        uint32_t *row = &src->pixels[(size_t)y * src->width];
+        for( int x = 0; x < src->width; x++ ) {
+            uint32_t level = x * 255 / src->width;
+            row[x] = y < src->height * 2 / 3 ? bars[x * bars_count / src->width] : level * 0x010101;
+        }
+    }
+}
+
+static void drawDocument(struct synthetic_source *src) {
+    for( int y = 0; y < src->pixels_rows; y++ ) {
+        uint32_t *row = &src->pixels[(size_t)y * src->width];
+        for( int x = 0; x < src->width; x++ )
+            row[x] = textPixel(x, y % src->doc_rows);
+    }
+}
+
+static void drawMotion(struct synthetic_source *src, uint32_t t) {
+    for( int y = 0; y < src->height; y++ ) {
+        uint32_t *row = &src->pixels[(size_t)y * src->width];
+        uint32_t g = (y + t) & 0xff;
+        for( int x = 0; x < src->width; x++ ) {
+            uint32_t b = (x + 2 * t) & 0xff;
+            uint32_t r = ((x ^ y) + 3 * t) & 0xff;
+            row[x] = r << 16 | g << 8 | b;
+        }
+    }
+}
+
+static int syntheticCapture(struct capture_source *base, struct capture_frame *out) {
+    struct synthetic_source *src = (struct synthetic_source *)base;
+    int offset = 0;
+
+    if( src->pattern == SYNTHETIC_SCROLL )
+        offset = (src->frame_index * TEXT_SCROLL_SPEED) % src->doc_rows;
+    else if( src->pattern == SYNTHETIC_MOTION )
+        drawMotion(src, src->frame_index);
+
+    memset(out, 0, sizeof(*out));
+    out->format = AV_PIX_FMT_BGR0;
+    out->width = src->width;
+    out->height = src->height;
+    out->data[0] = (const uint8_t *)&src->pixels[(size_t)offset * src->width];
+    out->linesize[0] = src->width * 4;
+    out->pts = src->frame_index * 1000000000ULL / src->fps;
+    out->damage_count = -1;
+    src->frame_index++;
+    return 0;
+}
+
+static void syntheticDestroy(struct capture_source *base) {
+    struct synthetic_source *src = (struct synthetic_source *)base;
+    free(src->pixels);
+    free(src);
+}
+
+struct capture_source *capture_synthetic_new(const char *spec, const struct capture_options *opts) {
+    struct synthetic_source *src = calloc(1, sizeof(struct synthetic_source));
+    if( !src )
+        return NULL;
+    src->base.name = "synthetic";
+    src->base.capture = syntheticCapture;
+    src->base.destroy = syntheticDestroy;
+    src->base.crop = opts->region;
+    src->pattern = SYNTHETIC_STATIC;
+    src->width = SYNTHETIC_WIDTH;
+    src->height = SYNTHETIC_HEIGHT;
+    src->fps = opts->fps > 0 ? opts->fps : 30;
+
+    // "synthetic[:<pattern>][:<w>x<h>]"
+    const char *p = strchr(spec, ':');
+    while( p ) {
+        p++;
+        if( strncmp(p, "static", 6) == 0 )
+            src->pattern = SYNTHETIC_STATIC;
+        else if( strncmp(p, "scroll", 6) == 0 )
+            src->pattern = SYNTHETIC_SCROLL;
+        else if( strncmp(p, "motion", 6) == 0 )
+            src->pattern = SYNTHETIC_MOTION;
+        else {
+            char size[32];
+            snprintf(size, sizeof(size), "%.*s", (int)strcspn(p, ":"), p);
+            if( capture_parse_size(size, &src->width, &src->height) < 0 ) {
+                LOG_ERROR("Wrong synthetic source '%s' (synthetic[:static|scroll|motion][:<w>x<h>])", spec);
+                syntheticDestroy(&src->base);
+                return NULL;
+            }
+        }
+        p = strchr(p, ':');
+    }
+
+    // Scrolled document is two screens long, the image is a screen taller to not wrap
+    src->doc_rows = (src->height * 2 + TEXT_CELL_HEIGHT - 1) / TEXT_CELL_HEIGHT * TEXT_CELL_HEIGHT;
+    src->pixels_rows = src->pattern == SYNTHETIC_SCROLL ? src->doc_rows + src->height : src->height;
+    src->pixels = malloc((size_t)src->width * src->pixels_rows * 4);
+    if( !src->pixels ) {
+        syntheticDestroy(&src->base);
+        return NULL;
+    }
+
+    if( src->pattern == SYNTHETIC_STATIC )
+        drawStatic(src);
+    else if( src->pattern == SYNTHETIC_SCROLL )
+        drawDocument(src);
+
+    static const char *pattern_names[] = { "static", "scroll", "motion" };
+    LOG_INFO("Capturing %dx%d synthetic %s frames", src->width, src->height, pattern_names[src->pattern]);
+    return &src->base;
+}
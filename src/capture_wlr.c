@@ -0,0 +1,293 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <wayland-client.h>
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+
+#include <libavutil/pixdesc.h>
+
+#include "capture.h"
+#include "convert.h"
+#include "latency.h"
+#include "log.h"
+#include "wayland.h"
+
+// Shm buffers offered by the compositor for one frame
+#define BUFFER_OFFERS_MAX 8
+// copy_with_damage & damage events
+#define SCREENCOPY_DAMAGE_VERSION 2
+
+struct buffer_offer {
+    enum wl_shm_format format;
+    int width, height, stride;
+};
+
+struct wlr_source {
+    struct capture_source base;
+    struct wayland *wl;
+    struct wl_output *output;
+    bool with_cursor;
+    // Compositor copies only the region (in output logical coordinates) if it's set
+    struct capture_rect region;
+    // Frames are created on the source queue, so the sources don't dispatch each other
+    struct wl_event_queue *queue;
+    struct zwlr_screencopy_manager_v1 *manager;
+    // Copy with damage waits for the screen change, the wait is woken by the eventfd
+    int interrupt_fd;
+    atomic_bool interrupted;
+
+    struct zwlr_screencopy_frame_v1 *frame; // requested, kept over the timed out captures
+    bool ready;
+    bool failed;
+    struct capture_rect damage[CAPTURE_DAMAGE_MAX];
+    int damage_count;
+
+    struct buffer_offer offers[BUFFER_OFFERS_MAX];
+    int offers_count;
+
+    struct {
+        struct wl_buffer *wl_buffer;
+        void *data;
+        size_t size;
+        enum wl_shm_format format;
+        int width, height, stride;
+        bool y_invert;
+        bool fresh; // damage is since the copy into the previous buffer, the whole one is new
+        uint64_t pts;
+    } buffer;
+};
+
+// Creates the buffer of the cheapest to encode offer and requests the copy into it
+static void copyFrame(struct wlr_source *src, struct zwlr_screencopy_frame_v1 *frame) {
+    if( src->offers_count == 0 ) {
+        LOG_ERROR("compositor offered no shm buffer");
+        src->failed = true;
+        return;
+    }
+    int width = src->offers[0].width, height = src->offers[0].height;
+    struct buffer_offer *offer = &src->offers[0];
+    for( int i = 1; i < src->offers_count; i++ ) {
+        if( wayland_format_cost(src->offers[i].format, width, height) <
+                wayland_format_cost(offer->format, width, height) )
+            offer = &src->offers[i];
+    }
+    src->offers_count = 0;
+
+    if( wayland_shm_pixfmt(offer->format) == AV_PIX_FMT_NONE ) {
+        LOG_ERROR("unsupported shm format 0x%08x", offer->format);
+        src->failed = true;
+        return;
+    }
+
+    // Output mode, scale or transform change gives the offer of another size or format
+    if( src->buffer.wl_buffer && (offer->format != src->buffer.format || offer->width != src->buffer.width
+            || offer->height != src->buffer.height || offer->stride != src->buffer.stride) ) {
+        wayland_destroy_shm_buffer(src->buffer.wl_buffer, src->buffer.data, src->buffer.size);
+        src->buffer.wl_buffer = NULL;
+    }
+
+    src->buffer.format = offer->format;
+    src->buffer.width = offer->width;
+    src->buffer.height = offer->height;
+    src->buffer.stride = offer->stride;
+
+    if( !src->buffer.wl_buffer ) {
+        LOG_INFO("Capturing %dx%d %s", src->buffer.width, src->buffer.height,
+            av_get_pix_fmt_name(wayland_shm_pixfmt(src->buffer.format)));
+        src->buffer.wl_buffer = wayland_create_shm_buffer(src->buffer.format, src->buffer.width,
+            src->buffer.height, src->buffer.stride, &src->buffer.size, &src->buffer.data);
+        if( src->buffer.wl_buffer == NULL ) {
+            LOG_ERROR("failed to create buffer");
+            src->failed = true;
+            return;
+        }
+        src->buffer.fresh = true;
+    }
+
+    // Damage since the previous copy drives the region of interest, the compositor copies
+    // the frame when there is any
+    if( src->wl->screencopy_version >= SCREENCOPY_DAMAGE_VERSION )
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, src->buffer.wl_buffer);
+    else
+        zwlr_screencopy_frame_v1_copy(frame, src->buffer.wl_buffer);
+}
+
+static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+        uint32_t width, uint32_t height, uint32_t stride) {
+    struct wlr_source *src = data;
+    if( src->offers_count < BUFFER_OFFERS_MAX )
+        src->offers[src->offers_count++] = (struct buffer_offer){ format, width, height, stride };
+    // Before version 3 it's the only offer and there is no buffer_done
+    if( src->wl->screencopy_version < 3 )
+        copyFrame(src, frame);
+}
+
+static void frame_handle_flags(void *data,
+        struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
+    struct wlr_source *src = data;
+    src->buffer.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void frame_handle_ready(void *data,
+        struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
+        uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    struct wlr_source *src = data;
+    src->buffer.pts = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
+    src->ready = true;
+}
+
+static void frame_handle_failed(void *data,
+        struct zwlr_screencopy_frame_v1 *frame) {
+    struct wlr_source *src = data;
+    LOG_ERROR("failed to copy frame");
+    src->failed = true;
+}
+
+static void frame_handle_linux_dmabuf(void *data,
+        struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+        uint32_t width, uint32_t height) {
+    // Reading dmabuf back needs GPU import, so only shm offers are used
+    LOG_TRACE("Skipping dmabuf offer %ux%u fourcc 0x%08x", width, height, format);
+}
+
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    struct wlr_source *src = data;
+    capture_add_damage(src->damage, &src->damage_count, x, y, width, height);
+}
+
+static void frame_handle_buffer_done(void *data,
+        struct zwlr_screencopy_frame_v1 *frame) {
+    copyFrame(data, frame);
+}
+
+static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
+    .buffer = frame_handle_buffer,
+    .flags = frame_handle_flags,
+    .ready = frame_handle_ready,
+    .failed = frame_handle_failed,
+    .damage = frame_handle_damage,
+    .linux_dmabuf = frame_handle_linux_dmabuf,
+    .buffer_done = frame_handle_buffer_done,
+};
+
+static int wlrCapture(struct capture_source *base, struct capture_frame *out) {
+    struct wlr_source *src = (struct wlr_source *)base;
+
+    // Frame requested by the timed out call is still waited for
+    if( !src->frame ) {
+        src->ready = false;
+        src->failed = false;
+        src->damage_count = 0;
+        if( src->region.width > 0 )
+            src->frame = zwlr_screencopy_manager_v1_capture_output_region(src->manager, src->with_cursor,
+                src->output, src->region.x, src->region.y, src->region.width, src->region.height);
+        else
+            src->frame = zwlr_screencopy_manager_v1_capture_output(src->manager, src->with_cursor, src->output);
+        zwlr_screencopy_frame_v1_add_listener(src->frame, &frame_listener, src);
+    }
+
+    // Idle screen isn't copied until it changes, the session keeps the receivers alive meanwhile
+    int64_t deadline = latency_now() + CAPTURE_TIMEOUT_MS * 1000000LL;
+    int ret = 0;
+    while( !src->ready && !src->failed && ret != -1 ) {
+        int64_t left_ms = (deadline - latency_now() + 999999) / 1000000;
+        if( left_ms <= 0 )
+            return CAPTURE_TIMEOUT;
+        ret = atomic_load(&src->interrupted) ? -1 : wayland_dispatch_timeout(src->queue, src->interrupt_fd, left_ms);
+    }
+
+    zwlr_screencopy_frame_v1_destroy(src->frame);
+    src->frame = NULL;
+    if( !src->ready )
+        return -1;
+
+    enum AVPixelFormat pix_fmt = wayland_shm_pixfmt(src->buffer.format);
+    out->format = pix_fmt;
+    out->width = src->buffer.width;
+    out->height = src->buffer.height;
+    out->pts = src->buffer.pts;
+    // Version 1 has no damage, the new buffer has the previous frames missing
+    bool damaged = src->wl->screencopy_version >= SCREENCOPY_DAMAGE_VERSION && !src->buffer.fresh;
+    out->damage_count = damaged ? src->damage_count : -1;
+    for( int i = 0; damaged && i < src->damage_count; i++ ) {
+        out->damage[i] = src->damage[i];
+        if( src->buffer.y_invert )
+            out->damage[i].y = src->buffer.height - src->damage[i].y - src->damage[i].height;
+    }
+    src->buffer.fresh = false;
+    convert_shm_planes(pix_fmt, src->buffer.data, src->buffer.stride, src->buffer.height,
+        src->buffer.y_invert, out->data, out->linesize);
+    return 0;
+}
+
+static void wlrInterrupt(struct capture_source *base) {
+    struct wlr_source *src = (struct wlr_source *)base;
+    atomic_store(&src->interrupted, true);
+    uint64_t one = 1;
+    if( write(src->interrupt_fd, &one, sizeof(one)) < 0 )
+        LOG_WARN("Unable to interrupt the capture: %m");
+}
+
+static void wlrDestroy(struct capture_source *base) {
+    struct wlr_source *src = (struct wlr_source *)base;
+    if( src->frame )
+        zwlr_screencopy_frame_v1_destroy(src->frame);
+    wayland_destroy_shm_buffer(src->buffer.wl_buffer, src->buffer.data, src->buffer.size);
+    wl_proxy_wrapper_destroy(src->manager);
+    wl_event_queue_destroy(src->queue);
+    close(src->interrupt_fd);
+    free(src);
+    wayland_release();
+}
+
+struct capture_source *capture_wlr_new(const struct capture_options *opts) {
+    struct wayland *wl = wayland_acquire();
+    if( !wl )
+        return NULL;
+
+    if( wl->screencopy_manager == NULL ) {
+        LOG_ERROR("compositor doesn't support wlr-screencopy-unstable-v1");
+        wayland_release();
+        return NULL;
+    }
+    if( opts->output_num < 1 || opts->output_num > wl->outputs_count ) {
+        LOG_ERROR("no output available (%d outputs, check -o)", wl->outputs_count);
+        wayland_release();
+        return NULL;
+    }
+    LOG_INFO("Using output: %d", opts->output_num);
+
+    struct wlr_source *src = calloc(1, sizeof(struct wlr_source));
+    if( !src ) {
+        wayland_release();
+        return NULL;
+    }
+    src->base.name = "wlr";
+    src->base.capture = wlrCapture;
+    src->base.destroy = wlrDestroy;
+    src->base.interrupt = wlrInterrupt;
+    src->base.monotonic_pts = true;
+    src->wl = wl;
+    src->interrupt_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if( src->interrupt_fd < 0 ) {
+        LOG_ERROR("eventfd failed: %m");
+        free(src);
+        wayland_release();
+        return NULL;
+    }
+    src->output = wl->outputs[opts->output_num - 1];
+    src->with_cursor = opts->with_cursor;
+    src->region = opts->region;
+    src->queue = wl_display_create_queue(wl->display);
+    src->manager = wl_proxy_create_wrapper(wl->screencopy_manager);
+    wl_proxy_set_queue((struct wl_proxy *)src->manager, src->queue);
+
+    return &src->base;
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE /* for accept4, pipe2 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "log.h"
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_MAX 1024
+
+struct control_client {
+    int fd;
+    size_t len;
+    char line[CONTROL_LINE_MAX];
+};
+
+static const struct control_command *control_commands = NULL;
+static struct control_client clients[CONTROL_MAX_CLIENTS];
+static struct sockaddr_un control_addr;
+static int listen_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_t control_thread;
+
+static void writeAll(int fd, const char *data, size_t len) {
+    while( len > 0 ) {
+        ssize_t ret = send(fd, data, len, MSG_NOSIGNAL);
+        if( ret < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return;
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+static int helpCommand(char *args, FILE *reply) {
+    fprintf(reply, "help\n    Show this message.\n");
+    for( const struct control_command *cmd = control_commands; cmd->name; cmd++ )
+        fprintf(reply, "%s %s\n    %s\n", cmd->name, cmd->args ? cmd->args : "", cmd->help);
+    return 0;
+}
+
+static void handleLine(int fd, char *line) {
+    // Split command name and the arguments
+    char *args = line + strspn(line, " \t");
+    char *name = strsep(&args, " \t");
+    if( !name || name[0] == '\0' )
+        return;
+    if( args )
+        args += strspn(args, " \t");
+    else
+        args = "";
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *reply = open_memstream(&body, &body_len);
+    if( !reply )
+        return;
+
+    int ret = -1;
+    if( strcmp(name, "help") == 0 ) {
+        ret = helpCommand(args, reply);
+    } else {
+        const struct control_command *cmd = control_commands;
+        while( cmd->name && strcmp(cmd->name, name) != 0 )
+            cmd++;
+        if( cmd->name )
+            ret = cmd->handler(args, reply);
+        else
+            fprintf(reply, "Unknown command '%s', try 'help'\n", name);
+    }
+    fprintf(reply, ret == 0 ? "OK\n" : "FAIL\n");
+    fclose(reply);
+
+    writeAll(fd, body, body_len);
+    free(body);
+}
+
+// Returns -1 when the client should be disconnected
+static int readClient(struct control_client *cl) {
+    ssize_t ret = read(cl->fd, &cl->line[cl->len], CONTROL_LINE_MAX - cl->len);
+    if( ret <= 0 )
+        return ret < 0 && errno == EINTR ? 0 : -1;
+    cl->len += ret;
+
+    char *start = cl->line;
+    char *end;
+    while( (end = memchr(start, '\n', cl->len - (start - cl->line))) != NULL ) {
+        *end = '\0';
+        if( end > start && end[-1] == '\r' )
+            end[-1] = '\0';
+        handleLine(cl->fd, start);
+        start = end + 1;
+    }
+    cl->len -= start - cl->line;
+    memmove(cl->line, start, cl->len);
+
+    if( cl->len == CONTROL_LINE_MAX ) {
+        const char *err = "Line is too long\nFAIL\n";
+        writeAll(cl->fd, err, strlen(err));
+        return -1;
+    }
+    return 0;
+}
+
+static void *controlLoop(void *arg) {
+    struct pollfd fds[2 + CONTROL_MAX_CLIENTS];
+
+    for( ;; ) {
+        fds[0] = (struct pollfd){ .fd = wake_pipe[0], .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = listen_fd, .events = POLLIN };
+        for( int i = 0; i < CONTROL_MAX_CLIENTS; i++ )
+            fds[2 + i] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+
+        if( poll(fds, 2 + CONTROL_MAX_CLIENTS, -1) < 0 ) {
+            if( errno == EINTR )
+                continue;
+            LOG_ERROR("control socket poll failed: %m");
+            break;
+        }
+
+        if( fds[0].revents )
+            break;
+
+        if( fds[1].revents & POLLIN ) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if( fd >= 0 ) {
+                int i = 0;
+                while( i < CONTROL_MAX_CLIENTS && clients[i].fd >= 0 )
+                    i++;
+                if( i < CONTROL_MAX_CLIENTS ) {
+                    clients[i].fd = fd;
+                    clients[i].len = 0;
+                } else {
+                    const char *err = "Too many control clients\nFAIL\n";
+                    writeAll(fd, err, strlen(err));
+                    close(fd);
+                }
+            }
+        }
+
+        for( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+            if( clients[i].fd < 0 || !fds[2 + i].revents )
+                continue;
+            if( readClient(&clients[i]) < 0 ) {
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int control_start(const char *path, const struct control_command *commands) {
+    if( strlen(path) >= sizeof(control_addr.sun_path) ) {
+        LOG_ERROR("control socket path is too long: %s", path);
+        return -1;
+    }
+
+    control_commands = commands;
+    for( int i = 0; i < CONTROL_MAX_CLIENTS; i++ )
+        clients[i].fd = -1;
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( listen_fd < 0 ) {
+        LOG_ERROR("control socket creation error: %m");
+        return -1;
+    }
+
+    control_addr.sun_family = AF_UNIX;
+    strcpy(control_addr.sun_path, path);
+    // Previous instance could leave the socket file behind
+    unlink(path);
+    if( bind(listen_fd, (struct sockaddr *)&control_addr, sizeof(control_addr)) < 0 ||
+            listen(listen_fd, CONTROL_MAX_CLIENTS) < 0 ) {
+        LOG_ERROR("unable to listen control socket %s: %m", path);
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    if( pipe2(wake_pipe, O_CLOEXEC) < 0 ||
+            pthread_create(&control_thread, NULL, controlLoop, NULL) != 0 ) {
+        LOG_ERROR("unable to start control thread");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    LOG_INFO("Listening control socket: %s", path);
+    return 0;
+}
+
+void control_stop() {
+    if( listen_fd < 0 )
+        return;
+
+    write(wake_pipe[1], "", 1);
+    pthread_join(control_thread, NULL);
+
+    for( int i = 0; i < CONTROL_MAX_CLIENTS; i++ ) {
+        if( clients[i].fd >= 0 )
+            close(clients[i].fd);
+    }
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(control_addr.sun_path);
+}
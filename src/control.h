@@ -0,0 +1,21 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdio.h>
+
+// Command of the control socket line protocol: "<name> [args...]\n"
+// Handler writes the reply body and returns 0 on success, the control
+// socket terminates the reply with "OK" or "FAIL" line.
+struct control_command {
+    const char *name;
+    const char *args;
+    const char *help;
+    int (*handler)(char *args, FILE *reply);
+};
+
+// Starts the control thread listening on unix socket path,
+// commands array should be terminated by empty item
+int control_start(const char *path, const struct control_command *commands);
+void control_stop();
+
+#endif // CONTROL_H
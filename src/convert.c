@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "convert.h"
+#include "latency.h"
+#include "log.h"
+
+#define CONVERT_COST_RUNS 3
+
+enum AVPixelFormat convert_target_format(enum AVPixelFormat src_fmt) {
+    switch( src_fmt ) {
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_YUV420P:
+        return src_fmt;
+    default:
+        return AV_PIX_FMT_YUV420P;
+    }
+}
+
+static int planeHeight(const AVPixFmtDescriptor *desc, int plane, int height) {
+    int shift = plane > 0 && plane < 3 ? desc->log2_chroma_h : 0;
+    return (height + (1 << shift) - 1) >> shift;
+}
+
+int convert_shm_planes(enum AVPixelFormat fmt, const uint8_t *data, int stride, int height,
+        bool y_invert, const uint8_t *planes[4], int linesizes[4]) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+    int count = av_pix_fmt_count_planes(fmt);
+    if( !desc || count <= 0 )
+        return -1;
+
+    memset(planes, 0, 4 * sizeof(planes[0]));
+    memset(linesizes, 0, 4 * sizeof(linesizes[0]));
+    for( int i = 0; i < count; i++ ) {
+        int plane_height = planeHeight(desc, i, height);
+        planes[i] = data;
+        linesizes[i] = stride;
+        // Inverted planes are read bottom-up with negative stride
+        if( y_invert ) {
+            planes[i] += stride * (plane_height - 1);
+            linesizes[i] = -stride;
+        }
+        data += stride * plane_height;
+    }
+    return count;
+}
+
+int convert_frame(struct converter *c, enum AVPixelFormat src_fmt, int src_width, int src_height,
+        const uint8_t *const planes[4], const int linesizes[4], AVFrame *frame) {
+    if( src_fmt == frame->format && src_width == frame->width && src_height == frame->height ) {
+        // No colour conversion, the planes are just copied to the frame
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src_fmt);
+        for( int i = 0; i < av_pix_fmt_count_planes(src_fmt); i++ )
+            av_image_copy_plane(frame->data[i], frame->linesize[i], planes[i], linesizes[i],
+                av_image_get_linesize(src_fmt, frame->width, i), planeHeight(desc, i, frame->height));
+        return 0;
+    }
+
+    // Context is rebuilt only on format or size change
+    if( !c->sws || src_fmt != c->src_fmt || frame->format != c->dst_fmt
+            || frame->width != c->width || frame->height != c->height
+            || src_width != c->src_width || src_height != c->src_height ) {
+        bool scaled = src_width != frame->width || src_height != frame->height;
+        c->sws = sws_getCachedContext(c->sws,
+            src_width, src_height, src_fmt,
+            frame->width, frame->height, frame->format, scaled ? SWS_BILINEAR : 0, NULL, NULL, NULL);
+        if( !c->sws ) {
+            LOG_ERROR("Unable to convert %s to %s", av_get_pix_fmt_name(src_fmt), av_get_pix_fmt_name(frame->format));
+            return -1;
+        }
+        c->src_fmt = src_fmt;
+        c->dst_fmt = frame->format;
+        c->width = frame->width;
+        c->height = frame->height;
+        c->src_width = src_width;
+        c->src_height = src_height;
+        //int *inv_table, srcrange, *table, dstrange, brightness, contrast, saturation;
+        //sws_getColorspaceDetails(sws_ctx, &inv_table, &srcrange, &table, &dstrange, &brightness, &contrast, &saturation);
+        //sws_setColorspaceDetails(sws_ctx, inv_table, srcrange, table, 1, brightness, contrast, saturation);
+    }
+
+    sws_scale(c->sws, planes, linesizes, 0, src_height, frame->data, frame->linesize);
+    return 0;
+}
+
+void convert_free(struct converter *c) {
+    sws_freeContext(c->sws);
+    c->sws = NULL;
+    c->src_fmt = c->dst_fmt = AV_PIX_FMT_NONE;
+}
+
+int64_t convert_cost(enum AVPixelFormat src_fmt, int width, int height) {
+    if( src_fmt == AV_PIX_FMT_NONE || width <= 0 || height <= 0 )
+        return -1;
+    if( src_fmt != convert_target_format(src_fmt) && !sws_isSupportedInput(src_fmt) )
+        return -1;
+
+    // 4:2:0 and packed formats fit in two luma-sized planes
+    int stride = av_image_get_linesize(src_fmt, width, 0);
+    uint8_t *data = stride > 0 ? malloc((size_t)stride * height * 2) : NULL;
+    AVFrame *frame = av_frame_alloc();
+    if( !data || !frame ) {
+        free(data);
+        av_frame_free(&frame);
+        return -1;
+    }
+    // Not a flat image, so the conversion isn't shortcut on the uniform rows
+    for( size_t i = 0; i < (size_t)stride * height * 2; i++ )
+        data[i] = (i * 7) ^ (i >> 11);
+
+    frame->format = convert_target_format(src_fmt);
+    frame->width = width;
+    frame->height = height;
+
+    const uint8_t *planes[4];
+    int linesizes[4];
+    convert_shm_planes(src_fmt, data, stride, height, false, planes, linesizes);
+
+    int64_t best = -1;
+    struct converter c = { NULL, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE, 0, 0, 0, 0 };
+    if( av_frame_get_buffer(frame, 0) >= 0 ) {
+        // First run includes the context setup & page faults, the best one is kept
+        for( int i = 0; i < CONVERT_COST_RUNS; i++ ) {
+            int64_t start = latency_now();
+            if( convert_frame(&c, src_fmt, width, height, planes, linesizes, frame) < 0 ) {
+                best = -1;
+                break;
+            }
+            int64_t elapsed = latency_now() - start;
+            if( best < 0 || elapsed < best )
+                best = elapsed;
+        }
+    }
+
+    convert_free(&c);
+    av_frame_free(&frame);
+    free(data);
+    return best;
+}
@@ -0,0 +1,37 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+// Captured image to frame conversion, swscale context is kept between the frames
+struct converter {
+    struct SwsContext *sws;
+    enum AVPixelFormat src_fmt, dst_fmt;
+    int width, height;
+    int src_width, src_height;
+};
+
+// Encoder input format for the captured one: x264 takes NV12 & YUV420P as is,
+// everything else is converted to YUV420P
+enum AVPixelFormat convert_target_format(enum AVPixelFormat src_fmt);
+
+// Splits the wl_shm image to planes following each other with the same stride,
+// y-inverted ones get negative stride. Returns number of planes or -1
+int convert_shm_planes(enum AVPixelFormat fmt, const uint8_t *data, int stride, int height,
+        bool y_invert, const uint8_t *planes[4], int linesizes[4]);
+
+// Converts the image to the frame format & size in one pass, or copies the planes
+// if the formats and sizes are the same. Cropped images are passed with the offset planes.
+int convert_frame(struct converter *c, enum AVPixelFormat src_fmt, int src_width, int src_height,
+        const uint8_t *const planes[4], const int linesizes[4], AVFrame *frame);
+void convert_free(struct converter *c);
+
+// Time of the image conversion to the target format in nsec (best of a few runs),
+// -1 if the format is not supported
+int64_t convert_cost(enum AVPixelFormat src_fmt, int width, int height);
+
+#endif // CONVERT_H
@@ -0,0 +1,43 @@
+#include <sys/param.h>
+
+#include "governor.h"
+#include "log.h"
+
+void governor_init(struct governor *g, double min_fps, int max_fps) {
+    g->min_fps = MIN(min_fps, max_fps);
+    g->fps = max_fps;
+    g->level = 1.0;
+    g->hold_ts = 0;
+    g->changes = 0;
+}
+
+double governor_update(struct governor *g, double changed_area, double bits_per_pixel, bool keyframe,
+        int max_fps, int64_t now) {
+    double level = changed_area / GOVERNOR_FULL_AREA;
+    if( !keyframe )
+        level = MAX(level, bits_per_pixel / GOVERNOR_FULL_BPP);
+    g->level = MIN(level, 1.0);
+
+    double min_fps = MIN(g->min_fps, max_fps);
+    double target = min_fps + (max_fps - min_fps) * g->level;
+    double fps = g->fps;
+    if( fps > max_fps ) {
+        // Session fps was lowered by the control command
+        fps = max_fps;
+    } else if( target > fps * (1 + GOVERNOR_DEADBAND) || (target > fps && target == max_fps) ) {
+        // Motion is followed right away
+        fps = target;
+    } else if( target < fps * (1 - GOVERNOR_DEADBAND) && now - g->hold_ts >= GOVERNOR_HOLD_MS * 1000000LL ) {
+        fps = MAX(target, fps / 2);
+    }
+    if( target >= fps * (1 - GOVERNOR_DEADBAND) )
+        g->hold_ts = now;
+
+    if( fps != g->fps ) {
+        LOG_DEBUG("Capture rate %.1f -> %.1f fps (activity %.2f)", g->fps, fps, g->level);
+        g->fps = fps;
+        g->hold_ts = now;
+        g->changes++;
+    }
+    return g->fps;
+}
@@ -0,0 +1,31 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Activity giving the full rate: changed fraction of the frame & encoded bits per pixel
+#define GOVERNOR_FULL_AREA 0.02
+#define GOVERNOR_FULL_BPP 0.05
+// Rate goes down only when the content stays calmer that long, and not below half at once
+#define GOVERNOR_HOLD_MS 1000
+// Rate changes smaller than that are ignored
+#define GOVERNOR_DEADBAND 0.15
+
+// Variable capture rate: the frames with motion raise it up to the session fps right
+// away, static content lowers it step by step down to the floor rate
+struct governor {
+    double min_fps;  // floor rate, 0 - governor is off (fixed rate)
+    double fps;      // current capture rate
+    double level;    // activity of the last frame, 0..1
+    int64_t hold_ts; // last time the rate was raised or lowered
+    uint64_t changes;
+};
+
+void governor_init(struct governor *g, double min_fps, int max_fps);
+// Takes the changed fraction & encoded size of the frame (keyframes are big regardless
+// of the content, so their size isn't counted). Returns the rate for the next frame.
+double governor_update(struct governor *g, double changed_area, double bits_per_pixel, bool keyframe,
+    int max_fps, int64_t now);
+
+#endif // GOVERNOR_H
@@ -0,0 +1,137 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "latency.h"
+
+// Log-linear buckets: 8 sub-buckets per power of two (~12% precision),
+// 40 octaves are more than enough to hold any latency in usec
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (LATENCY_SUB_COUNT * 40)
+
+struct latency_hist {
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t max;
+};
+
+static const char *stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_STAGE_CAPTURE] = "capture",
+    [LATENCY_STAGE_CONVERT] = "convert",
+    [LATENCY_STAGE_ENCODE] = "encode",
+    [LATENCY_STAGE_QUEUE] = "queue",
+    [LATENCY_STAGE_SEND] = "send",
+    [LATENCY_STAGE_TOTAL] = "total",
+    [LATENCY_STAGE_WAKEUP] = "wakeup",
+};
+
+static struct latency_hist stages[LATENCY_STAGE_COUNT];
+
+int64_t latency_now() {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_nsec + tm.tv_sec * 1000000000LL;
+}
+
+struct latency_hist *latency_hist_new() {
+    return calloc(1, sizeof(struct latency_hist));
+}
+
+void latency_hist_free(struct latency_hist *h) {
+    free(h);
+}
+
+static unsigned int bucket_index(uint64_t value) {
+    if( value < LATENCY_SUB_COUNT )
+        return value;
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int idx = (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT
+        + ((value >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1));
+    return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+// Highest value that falls into the bucket, so percentiles are never underestimated
+static uint64_t bucket_upper(unsigned int idx) {
+    if( idx < LATENCY_SUB_COUNT )
+        return idx;
+    unsigned int shift = idx / LATENCY_SUB_COUNT - 1;
+    uint64_t lower = (uint64_t)(LATENCY_SUB_COUNT + idx % LATENCY_SUB_COUNT) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void latency_hist_add(struct latency_hist *h, int64_t from_ns, int64_t to_ns) {
+    if( from_ns <= 0 || to_ns < from_ns )
+        return;
+    latency_hist_add_value(h, (to_ns - from_ns) / 1000);
+}
+
+void latency_hist_add_value(struct latency_hist *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while( value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+                memory_order_relaxed, memory_order_relaxed) ) {
+        // max is reloaded by the failed exchange
+    }
+}
+
+void latency_record(enum latency_stage stage, int64_t from_ns, int64_t to_ns) {
+    latency_hist_add(&stages[stage], from_ns, to_ns);
+}
+
+void latency_record_frame(const struct latency_frame *lf, int64_t sent_ns) {
+    latency_record(LATENCY_STAGE_CAPTURE, lf->requested, lf->ready);
+    latency_record(LATENCY_STAGE_CONVERT, lf->ready, lf->converted);
+    latency_record(LATENCY_STAGE_ENCODE, lf->converted, lf->encoded);
+    latency_record(LATENCY_STAGE_QUEUE, lf->encoded, lf->queued);
+    latency_record(LATENCY_STAGE_SEND, lf->queued, sent_ns);
+    latency_record(LATENCY_STAGE_TOTAL, lf->ready, sent_ns);
+}
+
+void latency_hist_report(FILE *out, const char *name, struct latency_hist *h) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if( count == 0 ) {
+        fprintf(out, "  %-12s %10d %10s %10s %10s %10s\n", name, 0, "-", "-", "-", "-");
+        return;
+    }
+
+    // Buckets could be updated concurrently, so the total is taken from the snapshot
+    uint64_t snapshot[LATENCY_BUCKETS];
+    uint64_t total = 0;
+    for( unsigned int i = 0; i < LATENCY_BUCKETS; i++ ) {
+        snapshot[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += snapshot[i];
+    }
+
+    const double pcts[3] = { 0.50, 0.95, 0.99 };
+    uint64_t values[3] = { 0 };
+    uint64_t seen = 0;
+    unsigned int p = 0;
+    for( unsigned int i = 0; i < LATENCY_BUCKETS && p < 3; i++ ) {
+        seen += snapshot[i];
+        while( p < 3 && seen > 0 && seen >= pcts[p] * total ) {
+            values[p] = bucket_upper(i);
+            p++;
+        }
+    }
+
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    for( p = 0; p < 3; p++ ) {
+        if( values[p] > max )
+            values[p] = max;
+    }
+
+    fprintf(out, "  %-12s %10lu %10lu %10lu %10lu %10lu\n", name,
+        count, values[0], values[1], values[2], max);
+}
+
+void latency_report(FILE *out) {
+    fprintf(out, "INFO: Frame latency (usec):\n");
+    fprintf(out, "  %-12s %10s %10s %10s %10s %10s\n", "stage", "count", "p50", "p95", "p99", "max");
+    for( unsigned int i = 0; i < LATENCY_STAGE_COUNT; i++ )
+        latency_hist_report(out, stage_names[i], &stages[i]);
+}
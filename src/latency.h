@@ -0,0 +1,47 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Pipeline stages measured for every frame, all durations are in usec
+enum latency_stage {
+    LATENCY_STAGE_CAPTURE, // capture requested -> screencopy ready
+    LATENCY_STAGE_CONVERT, // screencopy ready -> conversion done
+    LATENCY_STAGE_ENCODE,  // conversion done -> encode done
+    LATENCY_STAGE_QUEUE,   // encode done -> packet queued for sending
+    LATENCY_STAGE_SEND,    // packet queued -> fully sent to all the outputs
+    LATENCY_STAGE_TOTAL,   // screencopy ready -> fully sent to all the outputs
+    LATENCY_STAGE_WAKEUP,  // frame sleep deadline -> actual wakeup (scheduling latency)
+    LATENCY_STAGE_COUNT
+};
+
+// Timestamps of the frame passing through the pipeline (CLOCK_MONOTONIC nsec)
+struct latency_frame {
+    int64_t requested;
+    int64_t ready;
+    int64_t converted;
+    int64_t encoded;
+    int64_t queued;
+};
+
+struct latency_hist;
+
+int64_t latency_now();
+
+// Standalone histograms (like per-receiver send latency)
+struct latency_hist *latency_hist_new();
+void latency_hist_free(struct latency_hist *h);
+
+// Lock-free, could be called from any thread
+void latency_hist_add(struct latency_hist *h, int64_t from_ns, int64_t to_ns);
+// Value in any units (like the frame sizes in bytes)
+void latency_hist_add_value(struct latency_hist *h, uint64_t value);
+void latency_record(enum latency_stage stage, int64_t from_ns, int64_t to_ns);
+void latency_record_frame(const struct latency_frame *lf, int64_t sent_ns);
+
+// Prints p50/p95/p99/max table of the collected values
+void latency_report(FILE *out);
+void latency_hist_report(FILE *out, const char *name, struct latency_hist *h);
+
+#endif // LATENCY_H
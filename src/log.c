@@ -0,0 +1,248 @@
+#define _GNU_SOURCE /* for strsignal */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "log.h"
+
+// Bounded MPSC ring (Vyukov sequence numbers): producers reserve a slot
+// with CAS on head, the writer thread is the only consumer of the tail.
+// Slot seq is relative to the lap start, so zeroed ring is ready to use:
+// lap - free, lap + 1 - committed, lap + LOG_RING_SIZE - consumed
+#define LOG_RING_SIZE 1024
+#define LOG_LINE_MAX 240
+// Writer is woken up by the producers only when the ring is getting full,
+// otherwise it wakes by itself, so logging in the hot loop has no syscalls
+#define LOG_FLUSH_INTERVAL_NS 50000000
+#define LOG_WAKE_THRESHOLD (LOG_RING_SIZE / 2)
+#define LOG_LAP(pos) ((pos) & ~(uint64_t)(LOG_RING_SIZE - 1))
+
+struct log_slot {
+    _Atomic uint64_t seq;
+    int level;
+    int len;
+    char text[LOG_LINE_MAX];
+};
+
+_Atomic int log_level = LOG_LEVEL_INFO;
+
+static struct log_slot ring[LOG_RING_SIZE];
+static _Atomic uint64_t ring_head = 0;
+static _Atomic uint64_t ring_tail = 0;
+static _Atomic uint64_t dropped = 0;
+// Only one consumer is allowed, but on crash the handler drains the ring too
+static atomic_flag consumer_busy = ATOMIC_FLAG_INIT;
+
+static bool started = false;
+static _Atomic bool stopping = false;
+static pthread_t writer_thread;
+static sem_t writer_sem;
+
+static const char *level_names[] = {
+    [LOG_LEVEL_ERROR] = "ERROR",
+    [LOG_LEVEL_WARN] = "WARN",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_DEBUG] = "DEBUG",
+    [LOG_LEVEL_TRACE] = "TRACE",
+};
+
+static void writeOut(const char *data, size_t len) {
+    while( len > 0 ) {
+        ssize_t ret = write(STDERR_FILENO, data, len);
+        if( ret < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return;
+        }
+        data += ret;
+        len -= ret;
+    }
+}
+
+// Writes out everything committed to the ring, batching into one write
+static void drainRing() {
+    char out[16384];
+    size_t out_len = 0;
+
+    uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    for( ;; ) {
+        struct log_slot *slot = &ring[tail & (LOG_RING_SIZE - 1)];
+        if( atomic_load_explicit(&slot->seq, memory_order_acquire) != LOG_LAP(tail) + 1 )
+            break;
+
+        if( out_len + LOG_LINE_MAX + 16 > sizeof(out) ) {
+            writeOut(out, out_len);
+            out_len = 0;
+        }
+        out_len += snprintf(&out[out_len], sizeof(out) - out_len, "%s: %.*s\n",
+            level_names[slot->level], slot->len, slot->text);
+
+        atomic_store_explicit(&slot->seq, LOG_LAP(tail) + LOG_RING_SIZE, memory_order_release);
+        tail++;
+        atomic_store_explicit(&ring_tail, tail, memory_order_relaxed);
+    }
+
+    uint64_t lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if( lost > 0 )
+        out_len += snprintf(&out[out_len], sizeof(out) - out_len,
+            "WARN: log ring overflow, dropped %lu messages\n", lost);
+
+    if( out_len > 0 )
+        writeOut(out, out_len);
+}
+
+static void drainLocked() {
+    while( atomic_flag_test_and_set_explicit(&consumer_busy, memory_order_acquire) ) {
+        // Writer thread is in the middle of the drain
+    }
+    drainRing();
+    atomic_flag_clear_explicit(&consumer_busy, memory_order_release);
+}
+
+static void *writerLoop(void *arg) {
+    while( !atomic_load(&stopping) ) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_INTERVAL_NS;
+        if( ts.tv_nsec >= 1000000000 ) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&writer_sem, &ts);
+        drainLocked();
+    }
+    return NULL;
+}
+
+static void flushOnExit() {
+    if( started )
+        log_stop();
+    else
+        drainLocked();
+}
+
+static void flushOnCrash(int sig) {
+    // The crashed thread could be the writer itself, so the busy flag is not awaited
+    drainRing();
+    const char *msg = strsignal(sig);
+    writeOut("ERROR: crashed: ", 16);
+    writeOut(msg, strlen(msg));
+    writeOut("\n", 1);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int log_start() {
+    if( sem_init(&writer_sem, 0, 0) < 0 )
+        return -1;
+    if( pthread_create(&writer_thread, NULL, writerLoop, NULL) != 0 )
+        return -1;
+    started = true;
+
+    atexit(flushOnExit);
+    struct sigaction sa = { .sa_handler = flushOnCrash, .sa_flags = SA_RESETHAND };
+    sigaction(SIGSEGV, &sa, NULL);
+    sigaction(SIGBUS, &sa, NULL);
+    sigaction(SIGFPE, &sa, NULL);
+    sigaction(SIGILL, &sa, NULL);
+    sigaction(SIGABRT, &sa, NULL);
+    return 0;
+}
+
+void log_stop() {
+    if( !started )
+        return;
+    atomic_store(&stopping, true);
+    sem_post(&writer_sem);
+    pthread_join(writer_thread, NULL);
+    started = false;
+    drainLocked();
+    sem_destroy(&writer_sem);
+}
+
+void log_set_level(int level) {
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+static struct log_slot *reserveSlot(uint64_t *pos_out) {
+    uint64_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    for( ;; ) {
+        struct log_slot *slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - LOG_LAP(pos));
+        if( diff == 0 ) {
+            if( atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed) ) {
+                *pos_out = pos;
+                return slot;
+            }
+        } else if( diff < 0 ) {
+            // Ring is full
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+}
+
+static void commitText(int level, const char *text, int len) {
+    uint64_t pos;
+    struct log_slot *slot = reserveSlot(&pos);
+    if( !slot ) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        if( started )
+            sem_post(&writer_sem);
+        return;
+    }
+
+    if( len > LOG_LINE_MAX )
+        len = LOG_LINE_MAX;
+    memcpy(slot->text, text, len);
+    slot->level = level;
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, LOG_LAP(pos) + 1, memory_order_release);
+
+    if( !started ) {
+        // No writer yet (or already stopped), so writing synchronously
+        drainLocked();
+    } else if( level <= LOG_LEVEL_WARN || pos - atomic_load_explicit(&ring_tail, memory_order_relaxed) >= LOG_WAKE_THRESHOLD ) {
+        sem_post(&writer_sem);
+    }
+}
+
+void log_write(int level, const char *fmt, ...) {
+    char text[LOG_LINE_MAX + 1];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if( len < 0 )
+        return;
+    if( len > LOG_LINE_MAX )
+        len = LOG_LINE_MAX;
+    // Messages are lines, so the trailing newline is added by the writer
+    while( len > 0 && text[len - 1] == '\n' )
+        len--;
+    commitText(level, text, len);
+}
+
+void log_lines(int level, const char *text) {
+    if( level > atomic_load_explicit(&log_level, memory_order_relaxed) )
+        return;
+    while( *text ) {
+        const char *end = strchrnul(text, '\n');
+        commitText(level, text, end - text);
+        text = *end ? end + 1 : end;
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+// Statements above this level are not compiled at all,
+// release builds could use -DLOG_LEVEL_COMPILE=LOG_LEVEL_INFO
+#ifndef LOG_LEVEL_COMPILE
+#define LOG_LEVEL_COMPILE LOG_LEVEL_DEBUG
+#endif
+
+extern _Atomic int log_level;
+
+#define LOG_AT(level, ...) do { \
+        if( (level) <= atomic_load_explicit(&log_level, memory_order_relaxed) ) \
+            log_write(level, __VA_ARGS__); \
+    } while( 0 )
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+
+#if LOG_LEVEL_COMPILE >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while( 0 )
+#endif
+
+#if LOG_LEVEL_COMPILE >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do { } while( 0 )
+#endif
+
+// Starts the background writer thread and installs exit & crash flush
+int log_start();
+// Writes everything left in the ring and stops the writer thread
+void log_stop();
+
+void log_set_level(int level);
+
+// Formats the message into the lock-free ring, never blocks:
+// if the ring is full the message is dropped and counted
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Logs every line of the multiline text separately
+void log_lines(int level, const char *text);
+
+#endif // LOG_H
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE /* for syscall */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+#include "log.h"
+
+struct perf_event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const struct perf_event events[PERF_COUNTERS] = {
+    [PERF_COUNTER_TASK_CLOCK] = { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    [PERF_COUNTER_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERF_COUNTER_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERF_COUNTER_CACHE_MISSES] = { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERF_COUNTER_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static const char *stage_names[PERF_STAGE_COUNT] = {
+    [PERF_STAGE_CAPTURE] = "capture",
+    [PERF_STAGE_CONVERT] = "convert",
+    [PERF_STAGE_ENCODE] = "encode",
+    [PERF_STAGE_PACKETIZE] = "packetize",
+    [PERF_STAGE_SEND] = "send",
+};
+
+static bool enabled = false;
+// Counter opened by any of the threads
+static atomic_bool available[PERF_COUNTERS];
+
+static struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t totals[PERF_COUNTERS];
+} stages[PERF_STAGE_COUNT];
+
+// Group of the counters of the thread, read at once. Kept open till the exit, the
+// threads calling it (capture & workers) live for the whole run.
+static _Thread_local struct {
+    bool opened;
+    int leader;
+    int count;
+    int counters[PERF_COUNTERS]; // counter of every group value
+} group = { false, -1, 0, { 0 } };
+
+static int openEvent(enum perf_counter counter, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[counter].type;
+    attr.config = events[counter].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    // Kernel side is counted when allowed (perf_event_paranoid < 2), context switches
+    // happen there entirely, so they are not counted without it
+    if( fd < 0 && (errno == EACCES || errno == EPERM) && counter != PERF_COUNTER_CONTEXT_SWITCHES ) {
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+static void openGroup() {
+    group.opened = true;
+    for( int i = 0; i < PERF_COUNTERS; i++ ) {
+        int fd = openEvent(i, group.leader);
+        if( fd < 0 ) {
+            LOG_DEBUG("Counter %s is not available: %m", events[i].name);
+            continue;
+        }
+        if( group.leader < 0 )
+            group.leader = fd;
+        group.counters[group.count++] = i;
+        atomic_store(&available[i], true);
+    }
+}
+
+static bool readGroup(uint64_t *values) {
+    if( !group.opened )
+        openGroup();
+    if( group.leader < 0 )
+        return false;
+    uint64_t data[1 + PERF_COUNTERS];
+    if( read(group.leader, data, sizeof(data)) < (ssize_t)((1 + group.count) * sizeof(uint64_t)) )
+        return false;
+    for( int i = 0; i < group.count; i++ )
+        values[group.counters[i]] = data[1 + i];
+    return true;
+}
+
+int perf_init() {
+    // Task clock is the group leader, so the group could be opened where it could
+    int fd = openEvent(PERF_COUNTER_TASK_CLOCK, -1);
+    if( fd < 0 ) {
+        LOG_ERROR("Performance counters are not available: %m");
+        return -1;
+    }
+    close(fd);
+    enabled = true;
+    return 0;
+}
+
+void perf_begin(struct perf_sample *sample) {
+    sample->valid = enabled && readGroup(sample->values);
+}
+
+void perf_end(enum perf_stage stage, const struct perf_sample *sample) {
+    uint64_t values[PERF_COUNTERS];
+    if( !sample->valid || !readGroup(values) )
+        return;
+    for( int i = 0; i < group.count; i++ ) {
+        int counter = group.counters[i];
+        atomic_fetch_add_explicit(&stages[stage].totals[counter], values[counter] - sample->values[counter],
+            memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&stages[stage].count, 1, memory_order_relaxed);
+}
+
+static void printCounter(FILE *out, enum perf_counter counter, uint64_t total, uint64_t count, double scale) {
+    if( atomic_load(&available[counter]) )
+        fprintf(out, " %10.1f", total * scale / count);
+    else
+        fprintf(out, " %10s", "-");
+}
+
+void perf_report(FILE *out) {
+    if( !enabled )
+        return;
+    fprintf(out, "INFO: Stage counters per frame:\n");
+    fprintf(out, "  %-12s %10s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "cpu_usec", "kcycles",
+        "kinstr", "ipc", "cache_miss", "ctx_switch");
+    for( int i = 0; i < PERF_STAGE_COUNT; i++ ) {
+        uint64_t count = atomic_load_explicit(&stages[i].count, memory_order_relaxed);
+        uint64_t totals[PERF_COUNTERS];
+        for( int c = 0; c < PERF_COUNTERS; c++ )
+            totals[c] = atomic_load_explicit(&stages[i].totals[c], memory_order_relaxed);
+        fprintf(out, "  %-12s %10lu", stage_names[i], count);
+        if( count == 0 ) {
+            fprintf(out, "\n");
+            continue;
+        }
+        printCounter(out, PERF_COUNTER_TASK_CLOCK, totals[PERF_COUNTER_TASK_CLOCK], count, 0.001);
+        printCounter(out, PERF_COUNTER_CYCLES, totals[PERF_COUNTER_CYCLES], count, 0.001);
+        printCounter(out, PERF_COUNTER_INSTRUCTIONS, totals[PERF_COUNTER_INSTRUCTIONS], count, 0.001);
+        // Instructions per cycle tell the memory-bound stages (low) from the compute-bound ones
+        if( atomic_load(&available[PERF_COUNTER_CYCLES]) && atomic_load(&available[PERF_COUNTER_INSTRUCTIONS])
+                && totals[PERF_COUNTER_CYCLES] > 0 )
+            fprintf(out, " %10.2f", (double)totals[PERF_COUNTER_INSTRUCTIONS] / totals[PERF_COUNTER_CYCLES]);
+        else
+            fprintf(out, " %10s", "-");
+        printCounter(out, PERF_COUNTER_CACHE_MISSES, totals[PERF_COUNTER_CACHE_MISSES], count, 1);
+        printCounter(out, PERF_COUNTER_CONTEXT_SWITCHES, totals[PERF_COUNTER_CONTEXT_SWITCHES], count, 1);
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Pipeline stages profiled with the hardware counters
+enum perf_stage {
+    PERF_STAGE_CAPTURE,   // waiting for the capture source
+    PERF_STAGE_CONVERT,   // colour conversion & scaling
+    PERF_STAGE_ENCODE,    // x264 from the frame to the packet
+    PERF_STAGE_PACKETIZE, // NALU start codes to sizes & the header
+    PERF_STAGE_SEND,      // writing to the receivers & files
+    PERF_STAGE_COUNT
+};
+
+enum perf_counter {
+    PERF_COUNTER_TASK_CLOCK, // CPU time of the thread, nsec
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_CACHE_MISSES,
+    PERF_COUNTER_CONTEXT_SWITCHES,
+    PERF_COUNTERS
+};
+
+// Counter values of the calling thread at the stage start
+struct perf_sample {
+    uint64_t values[PERF_COUNTERS];
+    bool valid;
+};
+
+// Enables the profiling, the counters are opened for every thread on its first sample.
+// Returns -1 if perf events aren't available at all.
+int perf_init();
+
+// No-op unless enabled
+void perf_begin(struct perf_sample *sample);
+void perf_end(enum perf_stage stage, const struct perf_sample *sample);
+
+// Prints per-frame averages of every stage
+void perf_report(FILE *out);
+
+#endif // PERF_H
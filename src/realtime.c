@@ -0,0 +1,169 @@
+#define _GNU_SOURCE /* for CPU_* macros & pthread_setaffinity_np */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "realtime.h"
+#include "log.h"
+
+#define REALTIME_ROLES 4
+#define REALTIME_DEFAULT_PRIORITY 10
+#define REALTIME_NICE_VALUE -10
+
+static const char *role_names[REALTIME_ROLES] = { "capture", "convert", "encode", "send" };
+
+static enum realtime_policy policy = REALTIME_OFF;
+static int priority = REALTIME_DEFAULT_PRIORITY;
+static cpu_set_t role_cpus[REALTIME_ROLES];
+static bool role_pinned[REALTIME_ROLES];
+static bool lock_failed = false;
+
+int realtime_set_policy(const char *name) {
+    if( !name || strcmp(name, "fifo") == 0 )
+        policy = REALTIME_FIFO;
+    else if( strcmp(name, "rr") == 0 )
+        policy = REALTIME_RR;
+    else if( strcmp(name, "nice") == 0 )
+        policy = REALTIME_NICE;
+    else {
+        LOG_ERROR("Unknown realtime policy '%s' (fifo, rr, nice)", name);
+        return -1;
+    }
+    return 0;
+}
+
+void realtime_set_priority(int value) {
+    priority = value;
+}
+
+static int parseCpuList(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while( *list ) {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if( end == list || first < 0 )
+            return -1;
+        if( *end == '-' ) {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if( end == list || last < first )
+                return -1;
+        }
+        if( last >= CPU_SETSIZE )
+            return -1;
+        for( long cpu = first; cpu <= last; cpu++ )
+            CPU_SET(cpu, set);
+        if( *end == ',' )
+            end++;
+        else if( *end != '\0' )
+            return -1;
+        list = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int realtime_set_cpus(const char *spec) {
+    cpu_set_t set;
+    const char *eq = strchr(spec, '=');
+    const char *list = eq ? eq + 1 : spec;
+
+    if( parseCpuList(list, &set) < 0 ) {
+        LOG_ERROR("Wrong cpu list '%s'", spec);
+        return -1;
+    }
+
+    for( int i = 0; i < REALTIME_ROLES; i++ ) {
+        if( eq && (strlen(role_names[i]) != (size_t)(eq - spec) || strncmp(spec, role_names[i], eq - spec) != 0) )
+            continue;
+        role_cpus[i] = set;
+        role_pinned[i] = true;
+        if( eq )
+            return 0;
+    }
+    if( eq ) {
+        LOG_ERROR("Unknown thread role in '%s' (capture, convert, encode, send)", spec);
+        return -1;
+    }
+    return 0;
+}
+
+bool realtime_enabled() {
+    return policy != REALTIME_OFF;
+}
+
+static int setupAffinity(unsigned int roles) {
+    cpu_set_t set;
+    bool pinned = false;
+    CPU_ZERO(&set);
+    for( int i = 0; i < REALTIME_ROLES; i++ ) {
+        if( !(roles & (1u << i)) || !role_pinned[i] )
+            continue;
+        CPU_OR(&set, &set, &role_cpus[i]);
+        pinned = true;
+    }
+    if( !pinned )
+        return 0;
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if( ret != 0 ) {
+        LOG_ERROR("Unable to set thread cpu affinity: %s", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+static int setupNice() {
+    // On linux the niceness is per-thread
+    if( setpriority(PRIO_PROCESS, syscall(SYS_gettid), REALTIME_NICE_VALUE) < 0 ) {
+        LOG_WARN("Unable to set thread niceness %d: %m", REALTIME_NICE_VALUE);
+        return -1;
+    }
+    LOG_INFO("Realtime: thread niceness is %d", REALTIME_NICE_VALUE);
+    return 0;
+}
+
+int realtime_setup_thread(unsigned int roles) {
+    int ret = setupAffinity(roles);
+    if( policy == REALTIME_OFF )
+        return ret;
+
+    if( policy == REALTIME_NICE )
+        return setupNice() < 0 ? -1 : ret;
+
+    int sched = policy == REALTIME_RR ? SCHED_RR : SCHED_FIFO;
+    struct sched_param param = { .sched_priority = priority };
+    int err = pthread_setschedparam(pthread_self(), sched, &param);
+    if( err != 0 ) {
+        // Without CAP_SYS_NICE or RLIMIT_RTPRIO the niceness boost is the best we can do
+        LOG_WARN("Unable to set %s scheduling with priority %d: %s, falling back to niceness",
+            sched == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", priority, strerror(err));
+        return setupNice() < 0 ? -1 : ret;
+    }
+    LOG_INFO("Realtime: thread scheduling %s, priority %d",
+        sched == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", priority);
+    return ret;
+}
+
+void realtime_lock(void *addr, size_t len) {
+    if( policy == REALTIME_OFF || !addr || len == 0 )
+        return;
+    if( mlock(addr, len) < 0 && !lock_failed ) {
+        // Usually RLIMIT_MEMLOCK is too low, reported once
+        LOG_WARN("Unable to lock %zu bytes in memory: %m", len);
+        lock_failed = true;
+    }
+}
+
+void realtime_unlock(void *addr, size_t len) {
+    if( policy == REALTIME_OFF || !addr || len == 0 )
+        return;
+    munlock(addr, len);
+}
@@ -0,0 +1,39 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum realtime_policy {
+    REALTIME_OFF,
+    REALTIME_NICE, // niceness boost, doesn't need CAP_SYS_NICE for small values with rlimit
+    REALTIME_FIFO,
+    REALTIME_RR,
+};
+
+// Pipeline thread roles, thread doing several roles is pinned to the union of the cores
+enum realtime_role {
+    REALTIME_ROLE_CAPTURE = 1 << 0,
+    REALTIME_ROLE_CONVERT = 1 << 1,
+    REALTIME_ROLE_ENCODE = 1 << 2,
+    REALTIME_ROLE_SEND = 1 << 3,
+    REALTIME_ROLE_ALL = 0xf,
+};
+
+// "fifo", "rr" or "nice", NULL - default (fifo)
+int realtime_set_policy(const char *name);
+void realtime_set_priority(int priority);
+// "[<role>=]<cpu>[-<cpu>][,...]", without role applies to every role
+int realtime_set_cpus(const char *spec);
+
+bool realtime_enabled();
+
+// Applies affinity & scheduling to the calling thread, should be called
+// after the auxiliary threads (log, control) are started to not pass it to them
+int realtime_setup_thread(unsigned int roles);
+
+// Locks memory in RAM if realtime mode is enabled, failures are only reported
+void realtime_lock(void *addr, size_t len);
+void realtime_unlock(void *addr, size_t len);
+
+#endif // REALTIME_H
@@ -0,0 +1,310 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <asm/socket.h>
+#include <linux/sockios.h>
+// Instead of netinet/tcp.h for tcp_info with the pacing & delivery rates
+#include <linux/tcp.h>
+
+#include "latency.h"
+#include "receiver.h"
+#include "log.h"
+
+// Non-blocking connect, so the wait for the unreachable device is limited
+static int connectTimeout(int fd, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms) {
+    int flags = fcntl(fd, F_GETFL);
+    if( fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 )
+        return -1;
+    if( connect(fd, addr, addr_len) < 0 ) {
+        if( errno != EINPROGRESS )
+            return -1;
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int ret;
+        while( (ret = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1)) < 0 && errno == EINTR ) {
+            // Interrupted by signal
+        }
+        if( ret == 0 ) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if( ret < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 )
+            return -1;
+        if( err ) {
+            errno = err;
+            return -1;
+        }
+    }
+    // Sending stays blocking
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// Resolves & connects "addr[:port]", returns the socket or -1
+static int openSocket(const char *address, int timeout_ms, bool verbose) {
+    char host[256];
+    const char *port = NULL;
+    char default_port[8];
+
+    snprintf(host, sizeof(host), "%s", address);
+    char *port_ptr = strchr(host, ':');
+    if( port_ptr != NULL ) {
+        port = &port_ptr[1];
+        port_ptr[0] = '\0';
+    } else {
+        snprintf(default_port, sizeof(default_port), "%d", RECEIVER_DEFAULT_PORT);
+        port = default_port;
+    }
+
+    if( verbose )
+        LOG_INFO("Writing stream to airplay 1.0 device: %s:%s", host, port);
+
+    // IPv4 is parsed without lookup, the names are resolved thread-safe (unlike gethostbyname)
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    int gai_ret = getaddrinfo(host, port, &hints, &res);
+    if( gai_ret != 0 ) {
+        if( verbose )
+            LOG_ERROR("Wrong address %s: %s", host, gai_strerror(gai_ret));
+        return -1;
+    }
+
+    // Create socket
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( fd < 0 ) {
+        LOG_ERROR("Socket creation error");
+        freeaddrinfo(res);
+        return -1;
+    }
+    int yes = 1;
+    if( setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1 ) {
+        LOG_ERROR("Socket setsockopt TCP_NODELAY error");
+        freeaddrinfo(res);
+        close(fd);
+        return -1;
+    }
+    // Gone device is detected by the unacknowledged data instead of the minutes of retransmits,
+    // and the send blocked by the full queue fails instead of stalling the session
+    unsigned int ack_timeout = RECEIVER_ACK_TIMEOUT_MS;
+    struct timeval send_timeout = { RECEIVER_SEND_TIMEOUT_MS / 1000, RECEIVER_SEND_TIMEOUT_MS % 1000 * 1000 };
+    if( setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ack_timeout, sizeof(ack_timeout)) == -1
+            || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == -1 )
+        LOG_WARN("Unable to set %s socket timeouts: %m", address);
+
+    // Connect to socket
+    int ret = connectTimeout(fd, res->ai_addr, res->ai_addrlen, timeout_ms);
+    freeaddrinfo(res);
+    if( ret < 0 ) {
+        if( verbose )
+            LOG_ERROR("Connection Failed: %s: %m", address);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static struct receiver *receiverAlloc(const char *address, int fd, int64_t connect_ts) {
+    struct receiver *r = calloc(1, sizeof(struct receiver));
+    if( !r )
+        return NULL;
+    r->latency = latency_hist_new();
+    if( !r->latency ) {
+        free(r);
+        return NULL;
+    }
+    snprintf(r->address, sizeof(r->address), "%s", address);
+    r->fd = fd;
+    r->state = RECEIVER_UP;
+    r->need_setup = true;
+    r->need_keyframe = true;
+    r->backoff_ms = RECEIVER_BACKOFF_MIN_MS;
+    r->connect_ts = connect_ts;
+    return r;
+}
+
+struct receiver *receiver_connect(const char *address, int timeout_ms) {
+    int64_t connect_ts = latency_now();
+    int fd = openSocket(address, timeout_ms, true);
+    if( fd < 0 )
+        return NULL;
+
+    struct receiver *r = receiverAlloc(address, fd, connect_ts);
+    if( !r ) {
+        close(fd);
+        return NULL;
+    }
+    r->connected_ts = latency_now();
+    LOG_DEBUG("Connected to %s in %.1f ms", address, (r->connected_ts - connect_ts) / 1000000.0);
+
+    return r;
+}
+
+struct receiver *receiver_new_down(const char *address) {
+    struct receiver *r = receiverAlloc(address, -1, latency_now());
+    if( !r )
+        return NULL;
+    r->state = RECEIVER_DOWN;
+    r->retry_ts = latency_now() + r->backoff_ms * 1000000LL;
+    return r;
+}
+
+void receiver_fail(struct receiver *r) {
+    if( r->state != RECEIVER_UP )
+        return;
+    LOG_WARN("Receiver %s failed: %m, reconnecting in %d ms", r->address, r->backoff_ms);
+    close(r->fd);
+    r->fd = -1;
+    r->state = RECEIVER_DOWN;
+    r->retry_ts = latency_now() + r->backoff_ms * 1000000LL;
+}
+
+void receiver_reconnect(struct receiver *r) {
+    if( r->state != RECEIVER_UP )
+        return;
+    close(r->fd);
+    r->fd = -1;
+    r->state = RECEIVER_DOWN;
+    r->retry_ts = latency_now();
+}
+
+static void *reconnectThread(void *arg) {
+    struct receiver *r = arg;
+    r->fd = openSocket(r->address, RECEIVER_CONNECT_TIMEOUT_MS, false);
+    atomic_store(&r->reconnect_done, true);
+    return NULL;
+}
+
+bool receiver_poll(struct receiver *r) {
+    if( r->state == RECEIVER_DOWN && latency_now() >= r->retry_ts ) {
+        atomic_store(&r->reconnect_done, false);
+        if( pthread_create(&r->reconnect_thread, NULL, reconnectThread, r) != 0 ) {
+            r->retry_ts = latency_now() + r->backoff_ms * 1000000LL;
+            return false;
+        }
+        r->state = RECEIVER_RECONNECTING;
+        return false;
+    }
+    if( r->state != RECEIVER_RECONNECTING || !atomic_load(&r->reconnect_done) )
+        return false;
+
+    pthread_join(r->reconnect_thread, NULL);
+    if( r->fd < 0 ) {
+        r->backoff_ms = MIN(r->backoff_ms * 2, RECEIVER_BACKOFF_MAX_MS);
+        LOG_DEBUG("Receiver %s is still unreachable, next try in %d ms", r->address, r->backoff_ms);
+        r->state = RECEIVER_DOWN;
+        r->retry_ts = latency_now() + r->backoff_ms * 1000000LL;
+        return false;
+    }
+    LOG_INFO("Receiver %s reconnected", r->address);
+    r->state = RECEIVER_UP;
+    r->need_setup = true;
+    r->stream_requested = false;
+    r->need_keyframe = true;
+    r->backoff_ms = RECEIVER_BACKOFF_MIN_MS;
+    r->pacing_rate = 0;
+    r->reconnects++;
+    return true;
+}
+
+void receiver_free(struct receiver *r) {
+    if( !r )
+        return;
+    if( r->state == RECEIVER_RECONNECTING )
+        pthread_join(r->reconnect_thread, NULL);
+    if( r->fd >= 0 )
+        close(r->fd);
+    latency_hist_free(r->latency);
+    free(r);
+}
+
+ssize_t receiver_send(struct receiver *r, const void *data, size_t len) {
+    if( r->state != RECEIVER_UP )
+        return -1;
+    const uint8_t *p = data;
+    size_t left = len;
+    while( left > 0 ) {
+        // No SIGPIPE if the device is gone, it's handled as an error
+        ssize_t sent = send(r->fd, p, left, MSG_NOSIGNAL);
+        r->send_calls++;
+        if( sent < 0 ) {
+            if( errno == EINTR )
+                continue;
+            // Timed out send (EAGAIN) means the device stopped reading
+            receiver_fail(r);
+            return -1;
+        }
+        p += sent;
+        left -= sent;
+    }
+    r->bytes_sent += len;
+    return len;
+}
+
+int receiver_sent(struct receiver *r, size_t bytes, int error) {
+    r->bytes_sent += bytes;
+    if( !error )
+        return 0;
+    errno = error;
+    receiver_fail(r);
+    return -1;
+}
+
+void receiver_pace(struct receiver *r, size_t bytes, int64_t window_ns) {
+    if( r->state != RECEIVER_UP || r->pacing_unsupported )
+        return;
+    unsigned int rate = ~0U;
+    if( window_ns > 0 ) {
+        // The rest of the previous frame would be slowed down by the new rate otherwise
+        int queued = receiver_queued_bytes(r);
+        uint64_t backlog = queued > 0 ? queued : 0;
+        if( backlog > r->pacing_backlog_max )
+            r->pacing_backlog_max = backlog;
+        uint64_t paced = (bytes + backlog) * 1000000000ULL / window_ns;
+        rate = MIN(MAX(paced, RECEIVER_PACING_MIN_RATE), UINT32_MAX - 1);
+    } else if( r->pacing_rate == 0 ) {
+        return;
+    }
+    if( rate == r->pacing_rate )
+        return;
+    if( setsockopt(r->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0 ) {
+        LOG_WARN("Unable to set %s pacing rate, sending unpaced: %m", r->address);
+        r->pacing_unsupported = true;
+        return;
+    }
+    r->pacing_rate = rate == ~0U ? 0 : rate;
+}
+
+uint64_t receiver_delivery_rate(struct receiver *r) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if( r->state != RECEIVER_UP || getsockopt(r->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0
+            || len < offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate) )
+        return 0;
+    return info.tcpi_delivery_rate;
+}
+
+int receiver_queued_bytes(struct receiver *r) {
+    int queued = 0;
+    // Socket of the receiver being reconnected is owned by the reconnect thread
+    if( r->state != RECEIVER_UP )
+        return 0;
+    if( ioctl(r->fd, SIOCOUTQ, &queued) < 0 )
+        return -1;
+    return queued;
+}
@@ -0,0 +1,96 @@
+#ifndef RECEIVER_H
+#define RECEIVER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define RECEIVER_DEFAULT_PORT 7100
+#define RECEIVERS_MAX 255
+// Unreachable device shouldn't hold the startup for the TCP retries
+#define RECEIVER_CONNECT_TIMEOUT_MS 3000
+// Connection is failed when the sent data isn't acknowledged or can't be queued that long
+#define RECEIVER_ACK_TIMEOUT_MS 5000
+#define RECEIVER_SEND_TIMEOUT_MS 2000
+// Reconnect attempts delay, doubled after every failed one
+#define RECEIVER_BACKOFF_MIN_MS 500
+#define RECEIVER_BACKOFF_MAX_MS 30000
+// Paced rate floor (1 Mbit/s), so the small frames don't hold the headers & heartbeats
+#define RECEIVER_PACING_MIN_RATE 125000
+
+enum receiver_state {
+    RECEIVER_UP,
+    RECEIVER_DOWN,         // waiting for the next reconnect attempt
+    RECEIVER_RECONNECTING, // connecting in background
+};
+
+// AirPlay 1.0 mirroring device connection
+struct receiver {
+    char address[256]; // addr:port as it was specified
+    int fd;
+    enum receiver_state state;
+    // Receiver needs POST /stream and codec header before the video data
+    bool need_setup;
+    // POST /stream was sent while connecting, only the codec header is left
+    bool stream_requested;
+    // Decoder could start only from the keyframe, video data is skipped till then
+    bool need_keyframe;
+
+    int64_t retry_ts;
+    int backoff_ms;
+    pthread_t reconnect_thread;
+    atomic_bool reconnect_done;
+    uint64_t reconnects;
+
+    // Startup timing (latency_now): connecting began, connected and the first frame sent
+    int64_t connect_ts;
+    int64_t connected_ts;
+    int64_t first_frame_ts;
+
+    uint64_t bytes_sent;
+    uint64_t send_calls;   // send() syscalls, several per payload when the socket buffer is full
+    uint64_t frames_sent;
+    uint64_t frames_dropped;
+    // Send pacing: current SO_MAX_PACING_RATE in bytes/sec (0 - unpaced), the biggest frame
+    // and the most of the previous frames still queued when the next one was sent
+    unsigned int pacing_rate;
+    bool pacing_unsupported;
+    uint64_t max_burst_bytes;
+    uint64_t pacing_backlog_max;
+    struct latency_hist *latency;
+};
+
+// Connects to "addr[:port]" waiting up to timeout_ms for the connection (0 - system
+// default), returns NULL on failure. Name resolution is bounded by the resolver timeouts.
+struct receiver *receiver_connect(const char *address, int timeout_ms);
+// Receiver unreachable for now, connected by receiver_poll after the backoff like the failed one
+struct receiver *receiver_new_down(const char *address);
+void receiver_free(struct receiver *r);
+
+// Sends the whole buffer, returns -1 on error or if the receiver is down.
+// Send error fails the receiver.
+ssize_t receiver_send(struct receiver *r, const void *data, size_t len);
+// Result of the send done by io_uring: counts the bytes sent and fails the receiver on
+// the error (errno value, 0 - sent). Returns -1 on error.
+int receiver_sent(struct receiver *r, size_t bytes, int error);
+
+// Closes the connection, it's reconnected after the backoff by receiver_poll
+void receiver_fail(struct receiver *r);
+// Closes the working connection to start the new stream on the next receiver_poll
+void receiver_reconnect(struct receiver *r);
+// Called on every frame: starts the reconnect when it's time and collects its result.
+// Returns true when the receiver is back up and needs the stream setup & keyframe.
+bool receiver_poll(struct receiver *r);
+
+// Spreads the next bytes and the ones still queued over window_ns by the kernel pacing,
+// window_ns 0 turns the pacing off
+void receiver_pace(struct receiver *r, size_t bytes, int64_t window_ns);
+// Delivery rate measured by TCP in bytes/sec, 0 if unknown
+uint64_t receiver_delivery_rate(struct receiver *r);
+
+// Amount of bytes waiting in the kernel socket send queue, 0 unless the receiver is up
+int receiver_queued_bytes(struct receiver *r);
+
+#endif // RECEIVER_H
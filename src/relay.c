@@ -0,0 +1,535 @@
+#define _GNU_SOURCE /* for pthread_setname_np & accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "latency.h"
+#include "log.h"
+#include "realtime.h"
+#include "relay.h"
+
+static struct relay_packet *packetNew(size_t size) {
+    struct relay_packet *p = malloc(sizeof(struct relay_packet) + size);
+    if( !p ) {
+        LOG_ERROR("Unable to allocate %zu bytes relay packet", size);
+        return NULL;
+    }
+    atomic_init(&p->refs, 1);
+    p->type = STREAM_VIDEO_DATA;
+    p->keyframe = false;
+    p->size = size;
+    return p;
+}
+
+static struct relay_packet *packetRef(struct relay_packet *p) {
+    if( p )
+        atomic_fetch_add(&p->refs, 1);
+    return p;
+}
+
+static void packetUnref(struct relay_packet *p) {
+    if( p && atomic_fetch_sub(&p->refs, 1) == 1 )
+        free(p);
+}
+
+static uint32_t readUInt32LE(const uint8_t *buff) {
+    return buff[0] | buff[1] << 8 | buff[2] << 16 | (uint32_t)buff[3] << 24;
+}
+
+// Waits for the whole buffer, fails on the closed or silent connection and on stop
+static int readFull(struct relay *relay, int fd, void *buffer, size_t size) {
+    uint8_t *p = buffer;
+    int64_t deadline = latency_now() + RELAY_UPSTREAM_TIMEOUT_MS * 1000000LL;
+    while( size > 0 ) {
+        if( atomic_load(&relay->stopping) )
+            return -1;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, RELAY_HEARTBEAT_MS);
+        if( ret < 0 && errno != EINTR )
+            return -1;
+        if( ret <= 0 ) {
+            if( latency_now() >= deadline ) {
+                LOG_WARN("Relay sender %s is silent for %d ms", relay->upstream, RELAY_UPSTREAM_TIMEOUT_MS);
+                return -1;
+            }
+            continue;
+        }
+        ssize_t got = recv(fd, p, size, 0);
+        if( got < 0 && errno == EINTR )
+            continue;
+        if( got <= 0 ) {
+            if( got < 0 )
+                LOG_ERROR("Relay receive error from %s: %m", relay->upstream);
+            return -1;
+        }
+        p += got;
+        size -= got;
+        deadline = latency_now() + RELAY_UPSTREAM_TIMEOUT_MS * 1000000LL;
+    }
+    return 0;
+}
+
+// "POST /stream" headers & plist body, kept as is to forward them to the receivers
+static struct relay_packet *readRequest(struct relay *relay, int fd) {
+    char headers[RELAY_REQUEST_MAX];
+    size_t len = 0;
+    // Byte by byte to not read into the stream, it's only once per sender
+    while( len < 4 || memcmp(&headers[len - 4], "\r\n\r\n", 4) != 0 ) {
+        if( len == sizeof(headers) - 1 ) {
+            LOG_ERROR("Relay stream request headers from %s are too long", relay->upstream);
+            return NULL;
+        }
+        if( readFull(relay, fd, &headers[len], 1) < 0 )
+            return NULL;
+        len++;
+    }
+    headers[len] = '\0';
+    if( strncmp(headers, "POST /stream ", 13) != 0 ) {
+        LOG_ERROR("Relay supports mirror stream only, got from %s: %.*s", relay->upstream,
+            (int)strcspn(headers, "\r\n"), headers);
+        return NULL;
+    }
+
+    size_t body_len = 0;
+    for( const char *line = strstr(headers, "\r\n"); line; line = strstr(line, "\r\n") ) {
+        line += 2;
+        if( strncasecmp(line, "Content-Length:", 15) == 0 )
+            body_len = strtoul(&line[15], NULL, 10);
+    }
+    if( body_len > sizeof(headers) - len ) {
+        LOG_ERROR("Relay stream request from %s is too long: %zu bytes", relay->upstream, body_len);
+        return NULL;
+    }
+
+    struct relay_packet *request = packetNew(len + body_len);
+    if( !request )
+        return NULL;
+    memcpy(request->data, headers, len);
+    if( readFull(relay, fd, &request->data[len], body_len) < 0 ) {
+        packetUnref(request);
+        return NULL;
+    }
+    return request;
+}
+
+// Flushes the queue of the receiver that can't keep up, the frames in it are too late anyway
+static void sinkPush(struct relay_sink *sink, struct relay_packet *p) {
+    pthread_mutex_lock(&sink->lock);
+    if( sink->count == RELAY_QUEUE_PACKETS || sink->queued_bytes + p->size > RELAY_QUEUE_BYTES ) {
+        for( ; sink->count > 0; sink->count-- ) {
+            struct relay_packet *queued = sink->queue[sink->first];
+            if( queued->type == STREAM_VIDEO_DATA )
+                sink->frames_flushed++;
+            packetUnref(queued);
+            sink->first = (sink->first + 1) % RELAY_QUEUE_PACKETS;
+        }
+        sink->queued_bytes = 0;
+        sink->overflows++;
+        sink->resync = true;
+    }
+    sink->queue[(sink->first + sink->count) % RELAY_QUEUE_PACKETS] = packetRef(p);
+    sink->count++;
+    sink->queued_bytes += p->size;
+    pthread_cond_signal(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+}
+
+// Caches the stream data for the receivers set up later and queues the packet to all of them
+static void publish(struct relay *relay, struct relay_packet *p) {
+    pthread_mutex_lock(&relay->lock);
+    relay->stats.packets_received++;
+    relay->stats.bytes_received += p->size;
+    if( p->keyframe )
+        relay->stats.keyframes++;
+    if( p->type == STREAM_VIDEO_CODEC ) {
+        packetUnref(relay->codec);
+        relay->codec = packetRef(p);
+    }
+    if( p->type != STREAM_HEART_BEAT )
+        memcpy(relay->last_ntp, &p->data[8], sizeof(relay->last_ntp));
+    for( unsigned int i = 0; i < relay->sinks_count; i++ )
+        sinkPush(relay->sinks[i], p);
+    pthread_mutex_unlock(&relay->lock);
+}
+
+static void receiveStream(struct relay *relay, int fd) {
+    struct relay_packet *request = readRequest(relay, fd);
+    if( !request )
+        return;
+    // Receivers of the previous stream are reconnected by their threads for this one
+    pthread_mutex_lock(&relay->lock);
+    packetUnref(relay->request);
+    packetUnref(relay->codec);
+    relay->request = request;
+    relay->codec = NULL;
+    relay->stats.streams++;
+    atomic_fetch_add(&relay->stream, 1);
+    pthread_mutex_unlock(&relay->lock);
+    LOG_INFO("Relay started the stream from %s", relay->upstream);
+
+    uint8_t header[STREAM_HEADER_SIZE];
+    while( readFull(relay, fd, header, STREAM_HEADER_SIZE) == 0 ) {
+        uint32_t size = readUInt32LE(header);
+        if( size > RELAY_PAYLOAD_MAX ) {
+            LOG_ERROR("Relay got too big payload from %s: %u bytes", relay->upstream, size);
+            return;
+        }
+        struct relay_packet *p = packetNew(STREAM_HEADER_SIZE + size);
+        if( !p )
+            return;
+        memcpy(p->data, header, STREAM_HEADER_SIZE);
+        if( readFull(relay, fd, &p->data[STREAM_HEADER_SIZE], size) < 0 ) {
+            packetUnref(p);
+            return;
+        }
+        p->type = header[4] | header[5] << 8;
+        p->keyframe = p->type == STREAM_VIDEO_DATA && stream_avcc_keyframe(&p->data[STREAM_HEADER_SIZE], size);
+        publish(relay, p);
+        packetUnref(p);
+    }
+}
+
+// Accepts one sender at a time, the next one waits in the listen backlog
+static void *upstreamThread(void *arg) {
+    struct relay *relay = arg;
+    realtime_setup_thread(REALTIME_ROLE_CAPTURE);
+    while( !atomic_load(&relay->stopping) ) {
+        struct pollfd pfd = { relay->listen_fd, POLLIN, 0 };
+        if( poll(&pfd, 1, RELAY_HEARTBEAT_MS) <= 0 )
+            continue;
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(relay->listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_CLOEXEC);
+        if( fd < 0 ) {
+            LOG_WARN("Relay accept error: %m");
+            continue;
+        }
+        char upstream[sizeof(relay->upstream)];
+        char ip[INET_ADDRSTRLEN];
+        snprintf(upstream, sizeof(upstream), "%s:%u", inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)),
+            ntohs(addr.sin_port));
+        pthread_mutex_lock(&relay->lock);
+        snprintf(relay->upstream, sizeof(relay->upstream), "%s", upstream);
+        pthread_mutex_unlock(&relay->lock);
+        LOG_INFO("Relay accepted the sender %s", upstream);
+
+        receiveStream(relay, fd);
+        close(fd);
+
+        pthread_mutex_lock(&relay->lock);
+        relay->upstream[0] = '\0';
+        pthread_mutex_unlock(&relay->lock);
+        LOG_INFO("Relay stream from %s ended", upstream);
+    }
+    return NULL;
+}
+
+// Stream request for the new connection, then the cached codec data stamped by the last
+// packet time, so the receiver starts with the next keyframe
+static int sendSetup(struct relay_sink *sink, bool request) {
+    struct relay *relay = sink->relay;
+    struct receiver *r = sink->receiver;
+    pthread_mutex_lock(&relay->lock);
+    struct relay_packet *req = packetRef(relay->request);
+    struct relay_packet *codec = packetRef(relay->codec);
+    uint64_t stream = atomic_load(&relay->stream);
+    uint8_t header[STREAM_HEADER_SIZE];
+    if( codec ) {
+        memcpy(header, codec->data, STREAM_HEADER_SIZE);
+        memcpy(&header[8], relay->last_ntp, sizeof(relay->last_ntp));
+    }
+    pthread_mutex_unlock(&relay->lock);
+
+    int ret = -1;
+    // Sender's codec data comes right after the request, there is nothing to start without it
+    if( req && codec ) {
+        uint8_t heartbeat[STREAM_HEADER_SIZE];
+        stream_header(heartbeat, 0, STREAM_HEART_BEAT, 0);
+        if( (!request || receiver_send(r, req->data, req->size) >= 0)
+                && receiver_send(r, heartbeat, STREAM_HEADER_SIZE) >= 0
+                && receiver_send(r, header, STREAM_HEADER_SIZE) >= 0
+                && receiver_send(r, &codec->data[STREAM_HEADER_SIZE], codec->size - STREAM_HEADER_SIZE) >= 0 ) {
+            r->need_setup = false;
+            r->need_keyframe = true;
+            sink->stream = stream;
+            ret = 0;
+        }
+    }
+    packetUnref(req);
+    packetUnref(codec);
+    return ret;
+}
+
+static void sendPacket(struct relay_sink *sink, struct relay_packet *p) {
+    struct receiver *r = sink->receiver;
+    bool frame = p->type == STREAM_VIDEO_DATA;
+    if( r->state != RECEIVER_UP || r->need_setup ) {
+        if( frame )
+            r->frames_dropped++;
+        return;
+    }
+    // Codec packet of the new stream is sent by the setup
+    if( sink->stream != atomic_load(&sink->relay->stream) )
+        return;
+    if( frame ) {
+        if( r->need_keyframe && !p->keyframe )
+            return;
+        r->need_keyframe = false;
+    }
+    if( receiver_send(r, p->data, p->size) < 0 ) {
+        LOG_ERROR("Unable to send to %s: %m", r->address);
+        if( frame )
+            r->frames_dropped++;
+        return;
+    }
+    if( !frame )
+        return;
+    r->frames_sent++;
+    if( p->size > r->max_burst_bytes )
+        r->max_burst_bytes = p->size;
+    if( !r->first_frame_ts ) {
+        r->first_frame_ts = latency_now();
+        LOG_INFO("Receiver %s: connected in %.1f ms, first frame in %.1f ms", r->address,
+            (r->connected_ts - r->connect_ts) / 1000000.0, (r->first_frame_ts - r->connect_ts) / 1000000.0);
+    }
+}
+
+static void *sinkThread(void *arg) {
+    struct relay_sink *sink = arg;
+    struct relay *relay = sink->relay;
+    struct receiver *r = sink->receiver;
+    realtime_setup_thread(REALTIME_ROLE_SEND);
+
+    pthread_mutex_lock(&sink->lock);
+    while( !sink->stop ) {
+        sink->state = r->state;
+        sink->reconnects = r->reconnects;
+        sink->bytes_sent = r->bytes_sent;
+        sink->frames_sent = r->frames_sent;
+        sink->frames_dropped = r->frames_dropped;
+
+        if( sink->count == 0 && !sink->resync ) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += RELAY_HEARTBEAT_MS * 1000000LL;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&sink->cond, &sink->lock, &deadline);
+            if( sink->stop )
+                break;
+        }
+        struct relay_packet *p = NULL;
+        if( sink->count > 0 ) {
+            p = sink->queue[sink->first];
+            sink->first = (sink->first + 1) % RELAY_QUEUE_PACKETS;
+            sink->count--;
+            sink->queued_bytes -= p->size;
+        }
+        bool resync = sink->resync;
+        sink->resync = false;
+        pthread_mutex_unlock(&sink->lock);
+
+        receiver_poll(r);
+        if( r->state == RECEIVER_UP && !r->need_setup && sink->stream != atomic_load(&relay->stream) ) {
+            LOG_INFO("Relay reconnects %s for the new stream", r->address);
+            receiver_reconnect(r);
+        }
+        if( r->state == RECEIVER_UP && r->need_setup )
+            sendSetup(sink, true);
+        else if( resync && r->state == RECEIVER_UP )
+            sendSetup(sink, false);
+
+        if( p ) {
+            sendPacket(sink, p);
+            packetUnref(p);
+        } else if( !resync && r->state == RECEIVER_UP && !r->need_setup ) {
+            // Nothing came from the sender for a while, the connection is kept alive
+            uint8_t heartbeat[STREAM_HEADER_SIZE];
+            stream_header(heartbeat, 0, STREAM_HEART_BEAT, 0);
+            receiver_send(r, heartbeat, STREAM_HEADER_SIZE);
+        }
+        pthread_mutex_lock(&sink->lock);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return NULL;
+}
+
+static void sinkFree(struct relay_sink *sink) {
+    pthread_mutex_lock(&sink->lock);
+    sink->stop = true;
+    pthread_cond_signal(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->thread, NULL);
+    for( ; sink->count > 0; sink->count-- ) {
+        packetUnref(sink->queue[sink->first]);
+        sink->first = (sink->first + 1) % RELAY_QUEUE_PACKETS;
+    }
+    receiver_free(sink->receiver);
+    pthread_cond_destroy(&sink->cond);
+    pthread_mutex_destroy(&sink->lock);
+    free(sink);
+}
+
+struct relay *relay_new(int port) {
+    struct relay *relay = calloc(1, sizeof(struct relay));
+    if( !relay )
+        return NULL;
+    relay->port = port;
+    pthread_mutex_init(&relay->lock, NULL);
+
+    relay->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( relay->listen_fd < 0 ) {
+        LOG_ERROR("Relay socket creation error: %m");
+        free(relay);
+        return NULL;
+    }
+    int yes = 1;
+    setsockopt(relay->listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if( bind(relay->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(relay->listen_fd, 4) < 0 ) {
+        LOG_ERROR("Relay is unable to listen on port %d: %m", port);
+        close(relay->listen_fd);
+        free(relay);
+        return NULL;
+    }
+    LOG_INFO("Relay is listening for the airplay 1.0 mirror stream on port %d", port);
+    return relay;
+}
+
+void relay_free(struct relay *relay) {
+    if( !relay )
+        return;
+    relay_stop(relay);
+    for( unsigned int i = 0; i < relay->sinks_count; i++ )
+        sinkFree(relay->sinks[i]);
+    packetUnref(relay->request);
+    packetUnref(relay->codec);
+    close(relay->listen_fd);
+    pthread_mutex_destroy(&relay->lock);
+    free(relay);
+}
+
+struct relay_connect {
+    char *address;
+    struct receiver *receiver;
+    pthread_t thread;
+    bool started;
+};
+
+static void *connectThread(void *arg) {
+    struct relay_connect *c = arg;
+    c->receiver = receiver_connect(c->address, RECEIVER_CONNECT_TIMEOUT_MS);
+    return NULL;
+}
+
+void relay_connect(struct relay *relay, char *receivers) {
+    struct relay_connect *connects = calloc(RECEIVERS_MAX, sizeof(struct relay_connect));
+    if( !connects )
+        return;
+    unsigned int count = 0;
+    char *saveptr = NULL;
+    for( char *addr = strtok_r(receivers, ",", &saveptr); addr && count < RECEIVERS_MAX;
+            addr = strtok_r(NULL, ",", &saveptr) ) {
+        struct relay_connect *c = &connects[count++];
+        c->address = addr;
+        c->started = pthread_create(&c->thread, NULL, connectThread, c) == 0;
+        if( !c->started )
+            connectThread(c);
+    }
+    for( unsigned int i = 0; i < count; i++ ) {
+        struct relay_connect *c = &connects[i];
+        if( c->started )
+            pthread_join(c->thread, NULL);
+        if( !c->receiver )
+            LOG_ERROR("Relay skips unreachable receiver %s", c->address);
+        else if( relay_add_receiver(relay, c->receiver) < 0 )
+            receiver_free(c->receiver);
+    }
+    free(connects);
+}
+
+int relay_start(struct relay *relay) {
+    if( pthread_create(&relay->thread, NULL, upstreamThread, relay) != 0 ) {
+        LOG_ERROR("Unable to start relay thread");
+        return -1;
+    }
+    pthread_setname_np(relay->thread, "relay");
+    relay->started = true;
+    return 0;
+}
+
+void relay_stop(struct relay *relay) {
+    atomic_store(&relay->stopping, true);
+    if( relay->started )
+        pthread_join(relay->thread, NULL);
+    relay->started = false;
+}
+
+int relay_add_receiver(struct relay *relay, struct receiver *r) {
+    struct relay_sink *sink = calloc(1, sizeof(struct relay_sink));
+    if( !sink )
+        return -1;
+    sink->relay = relay;
+    sink->receiver = r;
+    sink->state = r->state;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+
+    pthread_mutex_lock(&relay->lock);
+    if( relay->sinks_count >= RECEIVERS_MAX ) {
+        pthread_mutex_unlock(&relay->lock);
+        LOG_ERROR("Relay has too many receivers");
+        goto error;
+    }
+    if( pthread_create(&sink->thread, NULL, sinkThread, sink) != 0 ) {
+        pthread_mutex_unlock(&relay->lock);
+        LOG_ERROR("Unable to start relay thread for %s", r->address);
+        goto error;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "relay-%u", relay->sinks_count);
+    pthread_setname_np(sink->thread, name);
+    relay->sinks[relay->sinks_count++] = sink;
+    pthread_mutex_unlock(&relay->lock);
+    return 0;
+
+error:
+    pthread_cond_destroy(&sink->cond);
+    pthread_mutex_destroy(&sink->lock);
+    free(sink);
+    return -1;
+}
+
+int relay_remove_receiver(struct relay *relay, const char *id) {
+    struct relay_sink *sink = NULL;
+    pthread_mutex_lock(&relay->lock);
+    for( unsigned int i = 0; i < relay->sinks_count; i++ ) {
+        struct relay_sink *s = relay->sinks[i];
+        if( (id[0] == '#' && (unsigned int)atoi(&id[1]) == i) || strcmp(s->receiver->address, id) == 0 ) {
+            sink = s;
+            relay->sinks_count--;
+            memmove(&relay->sinks[i], &relay->sinks[i + 1], (relay->sinks_count - i) * sizeof(relay->sinks[0]));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&relay->lock);
+    if( !sink )
+        return -1;
+    // Thread could be in the middle of the send, it's waited without the relay lock
+    LOG_INFO("Removed airplay 1.0 device: %s", sink->receiver->address);
+    sinkFree(sink);
+    return 0;
+}
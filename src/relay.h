@@ -0,0 +1,102 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "receiver.h"
+#include "stream.h"
+
+// Stream request (HTTP headers & plist) and payload size limits of the incoming stream
+#define RELAY_REQUEST_MAX 65536
+#define RELAY_PAYLOAD_MAX (16 << 20)
+// Sender heartbeats every second, the silent one is dropped to accept the next sender
+#define RELAY_UPSTREAM_TIMEOUT_MS 5000
+// Receivers get the relay heartbeats when there is nothing to forward
+#define RELAY_HEARTBEAT_MS 1000
+// Queue of every receiver, the one that can't keep up skips to the next keyframe
+#define RELAY_QUEUE_PACKETS 256
+#define RELAY_QUEUE_BYTES (8 << 20)
+
+// Received header & payload as they came, shared by the receiver queues
+struct relay_packet {
+    atomic_int refs;
+    enum stream_payload type;
+    bool keyframe;
+    size_t size;
+    uint8_t data[];
+};
+
+// Downstream receiver sent by its own thread from the queue, so the slow one
+// doesn't hold the others and the incoming stream
+struct relay_sink {
+    struct relay *relay;
+    struct receiver *receiver;     // used by the sink thread only
+    uint64_t stream;               // upstream stream the receiver is set up for, sink thread only
+    pthread_t thread;
+    pthread_mutex_t lock;          // queue, stop & the counters below
+    pthread_cond_t cond;
+    struct relay_packet *queue[RELAY_QUEUE_PACKETS];
+    unsigned int first, count;
+    size_t queued_bytes;
+    // Queue overflowed & was flushed: the codec data is sent again and the frames
+    // are skipped till the keyframe
+    bool resync;
+    bool stop;
+    uint64_t overflows;
+    uint64_t frames_flushed;
+    // Receiver counters copied by the sink thread for the stats
+    enum receiver_state state;
+    uint64_t reconnects;
+    uint64_t bytes_sent;
+    uint64_t frames_sent;
+    uint64_t frames_dropped;
+};
+
+// Relay mode: accepts the AirPlay 1.0 mirror stream from the sender (one at a time)
+// and forwards its packets unchanged to the receivers. The stream request & the last
+// codec data are cached for the receivers joining or reconnecting later, they start
+// from the next keyframe.
+struct relay {
+    int listen_fd;
+    int port;
+    pthread_t thread;
+    bool started;
+    atomic_bool stopping;
+    pthread_mutex_t lock;          // sinks, cached stream data & stats
+    struct relay_sink *sinks[RECEIVERS_MAX];
+    unsigned int sinks_count;
+    struct relay_packet *request;  // POST /stream of the current sender
+    struct relay_packet *codec;    // last codec header & avcC
+    uint8_t last_ntp[8];           // timestamp of the last packet, restamps the cached codec
+    _Atomic uint64_t stream;       // counts the incoming streams
+    char upstream[64];             // sender address, empty if none
+
+    struct {
+        uint64_t streams;
+        uint64_t packets_received;
+        uint64_t bytes_received;
+        uint64_t keyframes;
+    } stats;
+};
+
+// Listens on the port (all interfaces)
+struct relay *relay_new(int port);
+void relay_free(struct relay *relay);
+
+// Connects to the "addr[:port],..." list in parallel, the unreachable ones are skipped
+void relay_connect(struct relay *relay, char *receivers);
+// Starts accepting the sender
+int relay_start(struct relay *relay);
+// Stops the incoming stream & the sink threads
+void relay_stop(struct relay *relay);
+
+// Receiver is owned by the relay then, it's set up with the cached stream request & codec
+int relay_add_receiver(struct relay *relay, struct receiver *r);
+// Receiver by address or "#<index>", stops its thread & frees it
+int relay_remove_receiver(struct relay *relay, const char *id);
+
+#endif // RELAY_H
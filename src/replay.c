@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+
+#include "replay.h"
+#include "log.h"
+
+static struct replay_entry *entryAt(const struct replay *r, int i) {
+    return &r->entries[(r->first + i) % r->entries_max];
+}
+
+// Drops the oldest frame and the ones depending on it, till the next keyframe
+static void dropGop(struct replay *r) {
+    do {
+        r->used -= r->entries[r->first].size;
+        r->first = (r->first + 1) % r->entries_max;
+        r->count--;
+    } while( r->count > 0 && !r->entries[r->first].keyframe );
+}
+
+// Frame is written in one piece after the newest one, or from the ring start if
+// the tail is too short. Returns the offset, the oldest GOPs are dropped for space.
+static size_t freeSpace(struct replay *r, size_t size) {
+    for( ;; ) {
+        if( r->count == 0 ) {
+            r->head = 0;
+            return 0;
+        }
+        size_t front = r->entries[r->first].offset;
+        if( front < r->head ) {
+            if( r->head + size <= r->size )
+                return r->head;
+            if( size <= front )
+                return 0;
+        } else if( r->head + size <= front ) {
+            return r->head;
+        }
+        dropGop(r);
+    }
+}
+
+struct replay *replay_new(int seconds, size_t bytes) {
+    struct replay *r = calloc(1, sizeof(struct replay));
+    if( !r )
+        return NULL;
+    r->window_ns = seconds * 1000000000LL;
+    r->size = bytes;
+    r->entries_max = seconds * REPLAY_FPS_MAX + 1;
+    r->buf = malloc(r->size);
+    r->entries = calloc(r->entries_max, sizeof(struct replay_entry));
+    if( !r->buf || !r->entries ) {
+        LOG_ERROR("Unable to allocate %zu bytes replay buffer", bytes);
+        replay_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void replay_free(struct replay *r) {
+    if( !r )
+        return;
+    free(r->buf);
+    free(r->entries);
+    free(r);
+}
+
+void replay_set_codec(struct replay *r, const uint8_t *avcc, size_t size, int width, int height) {
+    if( size > sizeof(r->avcc) )
+        size = 0;
+    memcpy(r->avcc, avcc, size);
+    r->avcc_len = size;
+    r->width = width;
+    r->height = height;
+    r->count = 0;
+    r->used = 0;
+}
+
+void replay_add(struct replay *r, const uint8_t *data, size_t size, int64_t ts, bool keyframe) {
+    // Frames without the keyframe before them can't be decoded
+    if( !keyframe && r->count == 0 ) {
+        r->frames_dropped++;
+        return;
+    }
+    if( size > r->size ) {
+        r->count = 0;
+        r->used = 0;
+        r->frames_dropped++;
+        return;
+    }
+    if( r->count == r->entries_max )
+        dropGop(r);
+    size_t offset = freeSpace(r, size);
+    // Space is made by dropping the current GOP too
+    if( !keyframe && r->count == 0 ) {
+        r->frames_dropped++;
+        return;
+    }
+
+    memcpy(&r->buf[offset], data, size);
+    r->head = offset + size;
+    *entryAt(r, r->count) = (struct replay_entry){ offset, size, ts, keyframe };
+    r->count++;
+    r->used += size;
+
+    // Oldest GOP goes when the next one still covers the window
+    for( ;; ) {
+        int next = 1;
+        while( next < r->count && !entryAt(r, next)->keyframe )
+            next++;
+        if( next >= r->count || ts - entryAt(r, next)->ts < r->window_ns )
+            break;
+        dropGop(r);
+    }
+}
+
+double replay_seconds(const struct replay *r) {
+    if( r->count == 0 )
+        return 0.0;
+    return (entryAt(r, r->count - 1)->ts - entryAt(r, 0)->ts) / 1000000000.0;
+}
+
+size_t replay_bytes(const struct replay *r) {
+    return r->used;
+}
+
+struct replay_snapshot *replay_snapshot(const struct replay *r) {
+    struct replay_snapshot *snap = calloc(1, sizeof(struct replay_snapshot));
+    if( !snap )
+        return NULL;
+    snap->data = malloc(r->used + 1);
+    snap->entries = malloc((r->count + 1) * sizeof(struct replay_entry));
+    if( !snap->data || !snap->entries ) {
+        LOG_ERROR("Unable to allocate %zu bytes replay copy", r->used);
+        replay_snapshot_free(snap);
+        return NULL;
+    }
+    size_t offset = 0;
+    for( int i = 0; i < r->count; i++ ) {
+        const struct replay_entry *e = entryAt(r, i);
+        memcpy(&snap->data[offset], &r->buf[e->offset], e->size);
+        snap->entries[i] = *e;
+        snap->entries[i].offset = offset;
+        offset += e->size;
+    }
+    snap->count = r->count;
+    memcpy(snap->avcc, r->avcc, r->avcc_len);
+    snap->avcc_len = r->avcc_len;
+    snap->width = r->width;
+    snap->height = r->height;
+    return snap;
+}
+
+void replay_snapshot_free(struct replay_snapshot *snap) {
+    if( !snap )
+        return;
+    free(snap->data);
+    free(snap->entries);
+    free(snap);
+}
+
+int replay_write(const struct replay_snapshot *snap, const char *path) {
+    if( snap->count == 0 || snap->avcc_len == 0 ) {
+        LOG_ERROR("Replay buffer is empty");
+        return -1;
+    }
+
+    AVFormatContext *fmt = NULL;
+    if( avformat_alloc_output_context2(&fmt, NULL, NULL, path) < 0
+            && avformat_alloc_output_context2(&fmt, NULL, "matroska", path) < 0 ) {
+        LOG_ERROR("Unable to create replay container for %s", path);
+        return -1;
+    }
+    int ret = -1;
+    AVPacket *pkt = av_packet_alloc();
+    AVStream *st = avformat_new_stream(fmt, NULL);
+    if( !pkt || !st )
+        goto done;
+
+    // Frames are AVCC already, so avcC goes as is to the extradata of mp4 & matroska
+    st->time_base = (AVRational){ 1, 1000 };
+    st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    st->codecpar->codec_id = AV_CODEC_ID_H264;
+    st->codecpar->width = snap->width;
+    st->codecpar->height = snap->height;
+    st->codecpar->extradata = av_mallocz(snap->avcc_len + AV_INPUT_BUFFER_PADDING_SIZE);
+    if( !st->codecpar->extradata )
+        goto done;
+    memcpy(st->codecpar->extradata, snap->avcc, snap->avcc_len);
+    st->codecpar->extradata_size = snap->avcc_len;
+
+    if( avio_open(&fmt->pb, path, AVIO_FLAG_WRITE) < 0 ) {
+        LOG_ERROR("Unable to open %s", path);
+        goto done;
+    }
+    if( avformat_write_header(fmt, NULL) < 0 ) {
+        LOG_ERROR("Unable to write replay header to %s", path);
+        goto done;
+    }
+
+    // Muxer time base is known after the header
+    int64_t prev_pts = -1;
+    ret = 0;
+    for( int i = 0; i < snap->count && ret == 0; i++ ) {
+        const struct replay_entry *e = &snap->entries[i];
+        int64_t pts = av_rescale_q(e->ts - snap->entries[0].ts, (AVRational){ 1, 1000000000 }, st->time_base);
+        if( pts <= prev_pts )
+            pts = prev_pts + 1;
+        pkt->data = &snap->data[e->offset];
+        pkt->size = e->size;
+        pkt->pts = pkt->dts = prev_pts = pts;
+        pkt->flags = e->keyframe ? AV_PKT_FLAG_KEY : 0;
+        pkt->stream_index = st->index;
+        if( av_write_frame(fmt, pkt) < 0 ) {
+            LOG_ERROR("Unable to write replay frame to %s", path);
+            ret = -1;
+        }
+    }
+    if( av_write_trailer(fmt) < 0 )
+        ret = -1;
+    if( ret == 0 )
+        LOG_INFO("Replay of %d frames (%.1f s) written to %s", snap->count,
+            (snap->entries[snap->count - 1].ts - snap->entries[0].ts) / 1000000000.0, path);
+
+done:
+    if( fmt->pb )
+        avio_closep(&fmt->pb);
+    // Frame data belongs to the snapshot, the packet has no buffer to free
+    av_packet_free(&pkt);
+    avformat_free_context(fmt);
+    return ret;
+}
@@ -0,0 +1,65 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define REPLAY_MB_DEFAULT 32
+// Entries are allocated for the max capture rate
+#define REPLAY_FPS_MAX 120
+#define REPLAY_AVCC_SIZE 1024
+
+struct replay_entry {
+    size_t offset;
+    size_t size;
+    int64_t ts;    // presentation time, nsec
+    bool keyframe;
+};
+
+// Instant replay: the last seconds of the encoded frames (AVCC payloads as they go
+// to the receivers) in the preallocated byte ring. The ring always starts with a
+// keyframe, the older frames are dropped by the whole GOPs when they are out of
+// the time window or the space is needed. Used under the session lock.
+struct replay {
+    int64_t window_ns;
+    uint8_t *buf;
+    size_t size;
+    size_t head;                   // write offset of the next frame
+    struct replay_entry *entries;
+    int entries_max;
+    int first, count;
+    size_t used;                   // bytes of the frames in the ring
+    uint8_t avcc[REPLAY_AVCC_SIZE];
+    size_t avcc_len;
+    int width, height;
+    uint64_t frames_dropped;       // didn't fit the ring or had no keyframe before
+};
+
+// Copy of the ring taken under the lock, written to the file without it
+struct replay_snapshot {
+    uint8_t *data;
+    struct replay_entry *entries;
+    int count;
+    uint8_t avcc[REPLAY_AVCC_SIZE];
+    size_t avcc_len;
+    int width, height;
+};
+
+struct replay *replay_new(int seconds, size_t bytes);
+void replay_free(struct replay *r);
+
+// New codec data (encoder reopen) clears the ring, the frames before don't decode with it
+void replay_set_codec(struct replay *r, const uint8_t *avcc, size_t size, int width, int height);
+// Copies the frame to the ring, the frames before the first keyframe are skipped
+void replay_add(struct replay *r, const uint8_t *data, size_t size, int64_t ts, bool keyframe);
+// Seconds & bytes of the video in the ring
+double replay_seconds(const struct replay *r);
+size_t replay_bytes(const struct replay *r);
+
+struct replay_snapshot *replay_snapshot(const struct replay *r);
+void replay_snapshot_free(struct replay_snapshot *snap);
+// Muxes the frames to the file, container is chosen by the extension (matroska if unknown)
+int replay_write(const struct replay_snapshot *snap, const char *path);
+
+#endif // REPLAY_H
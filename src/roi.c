@@ -0,0 +1,145 @@
+#include <string.h>
+#include <sys/param.h>
+
+#include <libavutil/mem.h>
+
+#include "roi.h"
+#include "log.h"
+
+// libx264 maps the offset range -1..1 to the whole quantizer range
+#define ROI_QP_RANGE 51
+
+struct rects {
+    struct capture_rect list[ROI_RECTS_MAX];
+    int count;
+    bool overflow;
+    struct capture_rect bbox;
+    int64_t area;
+};
+
+static void addRect(struct rects *rects, int x, int y, int width, int height) {
+    if( width <= 0 || height <= 0 )
+        return;
+    if( rects->count == 0 && !rects->overflow ) {
+        rects->bbox = (struct capture_rect){ x, y, width, height };
+    } else {
+        int x2 = MAX(rects->bbox.x + rects->bbox.width, x + width);
+        int y2 = MAX(rects->bbox.y + rects->bbox.height, y + height);
+        rects->bbox.x = MIN(rects->bbox.x, x);
+        rects->bbox.y = MIN(rects->bbox.y, y);
+        rects->bbox.width = x2 - rects->bbox.x;
+        rects->bbox.height = y2 - rects->bbox.y;
+    }
+    rects->area += (int64_t)width * height;
+    if( rects->count < ROI_RECTS_MAX )
+        rects->list[rects->count++] = (struct capture_rect){ x, y, width, height };
+    else
+        rects->overflow = true;
+}
+
+// Damage is scaled to the frame size, rounding outwards
+static void damageRects(struct rects *rects, const AVFrame *frame, const struct capture_frame *captured) {
+    for( int i = 0; i < captured->damage_count; i++ ) {
+        const struct capture_rect *d = &captured->damage[i];
+        int x1 = (int64_t)d->x * frame->width / captured->width;
+        int y1 = (int64_t)d->y * frame->height / captured->height;
+        int x2 = ((int64_t)(d->x + d->width) * frame->width + captured->width - 1) / captured->width;
+        int y2 = ((int64_t)(d->y + d->height) * frame->height + captured->height - 1) / captured->height;
+        x1 = MAX(x1, 0);
+        y1 = MAX(y1, 0);
+        addRect(rects, x1, y1, MIN(x2, frame->width) - x1, MIN(y2, frame->height) - y1);
+    }
+}
+
+// Compares the tile with the previous luma and updates it if changed
+static bool tileChanged(struct roi *roi, const AVFrame *frame, int x, int y, int width, int height) {
+    bool changed = !roi->prev_valid;
+    for( int row = y; row < y + height && !changed; row++ )
+        changed = memcmp(&frame->data[0][(ptrdiff_t)row * frame->linesize[0] + x],
+            &roi->prev_luma[(size_t)row * roi->prev_width + x], width) != 0;
+    if( changed ) {
+        for( int row = y; row < y + height; row++ )
+            memcpy(&roi->prev_luma[(size_t)row * roi->prev_width + x],
+                &frame->data[0][(ptrdiff_t)row * frame->linesize[0] + x], width);
+    }
+    return changed;
+}
+
+// Changed tiles of every tile row are merged into the horizontal runs
+static int diffRects(struct roi *roi, struct rects *rects, const AVFrame *frame) {
+    if( !roi->prev_luma || roi->prev_width != frame->width || roi->prev_height != frame->height ) {
+        av_freep(&roi->prev_luma);
+        roi->prev_luma = av_malloc((size_t)frame->width * frame->height);
+        if( !roi->prev_luma ) {
+            LOG_ERROR("Unable to allocate ROI diff buffer");
+            return -1;
+        }
+        roi->prev_width = frame->width;
+        roi->prev_height = frame->height;
+        roi->prev_valid = false;
+    }
+
+    for( int y = 0; y < frame->height; y += ROI_TILE_SIZE ) {
+        int height = MIN(ROI_TILE_SIZE, frame->height - y);
+        int run_x = -1;
+        for( int x = 0; x < frame->width; x += ROI_TILE_SIZE ) {
+            int width = MIN(ROI_TILE_SIZE, frame->width - x);
+            if( tileChanged(roi, frame, x, y, width, height) ) {
+                if( run_x < 0 )
+                    run_x = x;
+            } else if( run_x >= 0 ) {
+                addRect(rects, run_x, y, x - run_x, height);
+                run_x = -1;
+            }
+        }
+        if( run_x >= 0 )
+            addRect(rects, run_x, y, frame->width - run_x, height);
+    }
+    roi->prev_valid = true;
+    return 0;
+}
+
+int roi_apply(struct roi *roi, AVFrame *frame, const struct capture_frame *captured) {
+    struct rects rects;
+    rects.count = 0;
+    rects.overflow = false;
+    rects.area = 0;
+
+    if( captured->damage_count >= 0 ) {
+        damageRects(&rects, frame, captured);
+        // Diff has to start over when the damage is gone
+        roi->prev_valid = false;
+    } else if( diffRects(roi, &rects, frame) < 0 ) {
+        return -1;
+    }
+    if( rects.overflow ) {
+        rects.list[0] = rects.bbox;
+        rects.count = 1;
+    }
+    roi->changed_area = MIN(1.0, (double)rects.area / ((int64_t)frame->width * frame->height));
+    if( roi->qp == 0 )
+        return 0;
+
+    // Frame buffer is reused, so the regions of the previous frame are still there
+    av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    AVFrameSideData *sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+        (rects.count + 1) * sizeof(AVRegionOfInterest));
+    if( !sd )
+        return -1;
+
+    // First region takes precedence where they overlap, so the whole frame goes last
+    AVRegionOfInterest *out = (AVRegionOfInterest *)sd->data;
+    for( int i = 0; i < rects.count; i++ ) {
+        const struct capture_rect *r = &rects.list[i];
+        out[i] = (AVRegionOfInterest){ sizeof(AVRegionOfInterest), r->y, r->y + r->height, r->x,
+            r->x + r->width, (AVRational){ -roi->qp, ROI_QP_RANGE } };
+    }
+    out[rects.count] = (AVRegionOfInterest){ sizeof(AVRegionOfInterest), 0, frame->height, 0, frame->width,
+        (AVRational){ roi->qp, ROI_QP_RANGE } };
+    return 0;
+}
+
+void roi_free(struct roi *roi) {
+    av_freep(&roi->prev_luma);
+    roi->prev_valid = false;
+}
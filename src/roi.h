@@ -0,0 +1,33 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+
+#include "capture.h"
+
+// Tile diff granularity (two x264 macroblocks)
+#define ROI_TILE_SIZE 32
+// Changed areas above that are merged into the bounding box
+#define ROI_RECTS_MAX 64
+
+// Region of interest encoding: changed areas of the frame get lower quantizer
+// than the static ones. The areas come from the capture damage, or from the diff
+// of the frame tiles with the previous frame when the source has no damage.
+struct roi {
+    int qp;               // changed areas get -qp, the static ones +qp (0 - only measured)
+    // Luma of the previous frame for the tile diff
+    uint8_t *prev_luma;
+    int prev_width, prev_height;
+    bool prev_valid;
+    double changed_area;  // fraction of the last frame marked as changed
+};
+
+// Attaches AVRegionOfInterest side data to the converted frame, the capture frame
+// gives the damage in its own coordinates. Returns -1 on error.
+int roi_apply(struct roi *roi, AVFrame *frame, const struct capture_frame *captured);
+void roi_free(struct roi *roi);
+
+#endif // ROI_H
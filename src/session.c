@@ -0,0 +1,1144 @@
+#define _GNU_SOURCE /* for pthread_setname_np */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/random.h>
+#include <unistd.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+
+#include "session.h"
+#include "alloc_stats.h"
+#include "log.h"
+#include "perf.h"
+#include "realtime.h"
+#include "workers.h"
+
+#ifdef ALLOC_ACCOUNTING
+#define ALLOC_WARMUP_FRAMES 30
+#define ALLOC_CHECK_FAILED 3
+// Fails the process if steady-state frame allocates buffers
+static bool opt_alloc_check = false;
+#endif
+
+volatile sig_atomic_t sessions_running = 1;
+
+static const AVCodec *encoder = NULL;
+
+// Stream request plist file used instead of the generated one
+static uint8_t plist_file_buf[SESSION_PLIST_SIZE];
+static size_t plist_file_len = 0;
+static const char *device_id = SESSION_DEVICE_ID;
+
+static bool running(struct session *s) {
+    return sessions_running && !s->stopping;
+}
+
+static void writeToFiles(struct session *s, const void *buffer, size_t num_bytes) {
+    if( s->output_file )
+        fwrite(buffer, 1, num_bytes, s->output_file);
+    if( s->output_stdout )
+        fwrite(buffer, 1, num_bytes, s->output_stdout);
+}
+
+static int sendToReceiver(struct receiver *r, const void *buffer, size_t num_bytes) {
+    if( receiver_send(r, buffer, num_bytes) < 0 ) {
+        LOG_ERROR("Unable to send to %s: %m", r->address);
+        return -1;
+    }
+    return 0;
+}
+
+static void sendToOutputs(struct session *s, const void *buffer, size_t num_bytes) {
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        if( s->receivers[i]->state == RECEIVER_UP && !s->receivers[i]->need_setup )
+            sendToReceiver(s->receivers[i], buffer, num_bytes);
+    }
+    writeToFiles(s, buffer, num_bytes);
+}
+
+static void frameSent(struct receiver *r, size_t bytes, int64_t queued_ts) {
+    r->frames_sent++;
+    if( bytes > r->max_burst_bytes )
+        r->max_burst_bytes = bytes;
+    latency_hist_add(r->latency, queued_ts, latency_now());
+    if( !r->first_frame_ts ) {
+        r->first_frame_ts = latency_now();
+        LOG_INFO("Receiver %s: connected in %.1f ms, first frame in %.1f ms", r->address,
+            (r->connected_ts - r->connect_ts) / 1000000.0, (r->first_frame_ts - r->connect_ts) / 1000000.0);
+    }
+}
+
+static void setWrite(struct uring_write *w, int fd, bool socket, uint8_t *header, uint8_t *data, size_t num_bytes) {
+    w->fd = fd;
+    w->socket = socket;
+    w->iov[0] = (struct iovec){ header, STREAM_HEADER_SIZE };
+    w->iov[1] = (struct iovec){ data, num_bytes };
+    w->iovcnt = 2;
+}
+
+// Frame goes to the receivers and files by one io_uring submission, the files get
+// the headers buffered by stdio before it
+static void sendFrameBatch(struct session *s, struct receiver **receivers, unsigned int count, uint8_t *header,
+        uint8_t *data, size_t num_bytes, int64_t queued_ts) {
+    FILE *files[] = { s->output_file, s->output_stdout };
+    unsigned int writes = count;
+    for( unsigned int i = 0; i < sizeof(files) / sizeof(files[0]); i++ ) {
+        if( !files[i] )
+            continue;
+        fflush(files[i]);
+        setWrite(&s->uring_writes[writes++], fileno(files[i]), false, header, data, num_bytes);
+    }
+    if( writes == 0 )
+        return;
+
+    if( uring_write_all(s->uring, s->uring_writes, writes, RECEIVER_SEND_TIMEOUT_MS) < 0 ) {
+        // Part of the frame could be sent already, so the receivers start over
+        for( unsigned int i = 0; i < count; i++ ) {
+            errno = EIO;
+            receiver_fail(receivers[i]);
+            receivers[i]->frames_dropped++;
+        }
+        return;
+    }
+    for( unsigned int i = 0; i < count; i++ ) {
+        struct uring_write *w = &s->uring_writes[i];
+        if( receiver_sent(receivers[i], w->done, w->error) < 0 ) {
+            receivers[i]->frames_dropped++;
+            continue;
+        }
+        frameSent(receivers[i], STREAM_HEADER_SIZE + num_bytes, queued_ts);
+    }
+    for( unsigned int i = count; i < writes; i++ ) {
+        if( s->uring_writes[i].error )
+            LOG_ERROR("Session %u unable to write the stream: %s", s->index, strerror(s->uring_writes[i].error));
+    }
+}
+
+// Sends header with payload to every receiver one by one (or all at once by io_uring)
+// and records per-receiver latency. Receivers waiting for the keyframe (connected or
+// reconnected) skip the frames before it.
+static int64_t sendFrameToOutputs(struct session *s, uint8_t *header, uint8_t *data, size_t num_bytes,
+        bool keyframe, int64_t queued_ts) {
+    // Frame goes out over the part of the interval instead of one burst
+    int64_t pacing_window = s->pacing > 0 ? 1000000000LL / s->fps * s->pacing / 100 : 0;
+    struct receiver *batch[RECEIVERS_MAX];
+    unsigned int batch_count = 0;
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        struct receiver *r = s->receivers[i];
+        if( r->state != RECEIVER_UP ) {
+            r->frames_dropped++;
+            continue;
+        }
+        if( r->need_setup || (r->need_keyframe && !keyframe) )
+            continue;
+        r->need_keyframe = false;
+        receiver_pace(r, STREAM_HEADER_SIZE + num_bytes, pacing_window);
+        if( s->uring ) {
+            setWrite(&s->uring_writes[batch_count], r->fd, true, header, data, num_bytes);
+            batch[batch_count++] = r;
+            continue;
+        }
+        if( receiver_send(r, header, STREAM_HEADER_SIZE) < 0 || receiver_send(r, data, num_bytes) < 0 ) {
+            r->frames_dropped++;
+            continue;
+        }
+        frameSent(r, STREAM_HEADER_SIZE + num_bytes, queued_ts);
+    }
+    if( s->uring ) {
+        sendFrameBatch(s, batch, batch_count, header, data, num_bytes, queued_ts);
+    } else {
+        writeToFiles(s, header, STREAM_HEADER_SIZE);
+        writeToFiles(s, data, num_bytes);
+    }
+    if( s->config.packet_cb )
+        s->config.packet_cb(s->config.packet_opaque, STREAM_VIDEO_DATA, data, num_bytes, s->frame_ntp, keyframe);
+    return latency_now();
+}
+
+static int loadStreamPlist(const char *path) {
+    FILE* fh = NULL;
+    fh = fopen(path, "rb");
+    if( fh == NULL ) {
+        LOG_ERROR("unable to open '%s': %m", path);
+        return -1;
+    }
+    LOG_DEBUG("plist reading");
+    plist_file_len = fread(plist_file_buf, 1, sizeof(plist_file_buf), fh);
+    LOG_DEBUG("plist read done: len: %ld", plist_file_len);
+    fclose(fh);
+    fh = NULL;
+    return 0;
+}
+
+// Stream request with the session settings, the same keys as the iOS client sends
+static int buildStreamPlist(struct session *s) {
+    ssize_t len = stream_request_plist(s->plist_buf, sizeof(s->plist_buf), device_id, s->config.latency_ms,
+        s->session_id);
+    if( len < 0 ) {
+        LOG_ERROR("Stream plist doesn't fit %d bytes", SESSION_PLIST_SIZE);
+        return -1;
+    }
+    s->plist_len = len;
+    return 0;
+}
+
+// Sends stream request to the receiver or to the files if receiver is NULL
+static int initMirroringConnection(struct session *s, struct receiver *r) {
+    char buff[2048];
+
+    // Generate headers
+    snprintf(buff, sizeof(buff), "POST /stream HTTP/1.1\r\n"
+        "User-Agent: wlroots-airplay/1.0.0\r\n"
+        "X-Apple-Device-ID: 0x%s\r\n"
+        "X-Apple-Client-Name: WLRootsAirplay\r\n"
+        "X-Apple-ProtocolVersion: 1\r\n"
+        "Content-Type: application/x-apple-binary-plist\r\n"
+        "Content-Length: %ld\r\n\r\n", device_id, s->plist_len);
+
+    if( !r ) {
+        writeToFiles(s, buff, strlen(buff));
+        writeToFiles(s, s->plist_buf, s->plist_len);
+        return 0;
+    }
+
+    // Send Headers & plist
+    if( sendToReceiver(r, buff, strlen(buff)) < 0 || sendToReceiver(r, s->plist_buf, s->plist_len) < 0 )
+        return -1;
+    LOG_DEBUG("Initialized airplay mirroring: %s", r->address);
+    return 0;
+}
+
+// Stream request & codec data for the receivers connected since the last frame
+static void setupReceivers(struct session *s) {
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        struct receiver *r = s->receivers[i];
+        if( r->state != RECEIVER_UP || !r->need_setup )
+            continue;
+        if( !r->stream_requested && initMirroringConnection(s, r) < 0 )
+            continue;
+
+        stream_header(s->header_buff, 0, STREAM_HEART_BEAT, 0);
+        sendToReceiver(r, s->header_buff, STREAM_HEADER_SIZE);
+        stream_header(s->header_buff, s->avcc_len, STREAM_VIDEO_CODEC, stream_ntp_time(latency_now()));
+        sendToReceiver(r, s->header_buff, STREAM_HEADER_SIZE);
+        sendToReceiver(r, s->avcc_buff, s->avcc_len);
+
+        r->need_setup = false;
+    }
+}
+
+// Pool buffer could outlive the pool of its size (encoder reopen), so it keeps its own
+struct packet_buffer {
+    struct uring *uring;
+    size_t size;
+};
+
+static void packetBufferFree(void *opaque, uint8_t *data) {
+    struct packet_buffer *b = opaque;
+    if( b->uring )
+        uring_unregister_buffer(b->uring, data);
+    realtime_unlock(data, b->size);
+    av_free(data);
+    free(b);
+}
+
+// Packet pool buffers are locked in memory in realtime mode and registered for the
+// io_uring writes
+static AVBufferRef *packetBufferAlloc(void *opaque, size_t size) {
+    struct session *s = opaque;
+    struct packet_buffer *b = malloc(sizeof(struct packet_buffer));
+    uint8_t *data = av_malloc(size);
+    if( !b || !data ) {
+        free(b);
+        av_free(data);
+        return NULL;
+    }
+    b->size = size;
+    b->uring = s->uring && uring_register_buffer(s->uring, data, size) == 0 ? s->uring : NULL;
+    realtime_lock(data, size);
+    AVBufferRef *buf = av_buffer_create(data, size, packetBufferFree, b, 0);
+    if( !buf )
+        packetBufferFree(b, data);
+    return buf;
+}
+
+static int getPacketBuffer(struct AVCodecContext *ctx, AVPacket *pkt, int flags) {
+    struct session *s = ctx->opaque;
+    // Rare packets bigger than the raw frame are allocated as usual
+    if( (size_t)pkt->size + AV_INPUT_BUFFER_PADDING_SIZE > s->packet_pool_size )
+        return avcodec_default_get_encode_buffer(ctx, pkt, flags);
+
+    pkt->buf = av_buffer_pool_get(s->packet_pool);
+    if( !pkt->buf )
+        return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+static void closeEncoder(struct session *s) {
+    avcodec_free_context(&s->enc_ctx);
+    // Buffers still referenced by the packets are freed when released
+    av_buffer_pool_uninit(&s->packet_pool);
+}
+
+static int openEncoder(struct session *s, int width, int height, enum AVPixelFormat pix_fmt) {
+    struct AVCodecContext *enc_ctx = avcodec_alloc_context3(encoder);
+    if( !enc_ctx ) {
+        LOG_ERROR("Could not allocate video codec context");
+        return -1;
+    }
+    s->enc_ctx = enc_ctx;
+    enc_ctx->opaque = s;
+
+    // Encoded frame is never bigger than the raw YUV420 one in practice
+    s->packet_pool_size = width * height * 3 / 2 + AV_INPUT_BUFFER_PADDING_SIZE;
+    if( realtime_enabled() || s->uring )
+        s->packet_pool = av_buffer_pool_init2(s->packet_pool_size, s, packetBufferAlloc, NULL);
+    else
+        s->packet_pool = av_buffer_pool_init(s->packet_pool_size, NULL);
+    if( !s->packet_pool ) {
+        LOG_ERROR("Could not allocate packet pool");
+        avcodec_free_context(&s->enc_ctx);
+        return -1;
+    }
+    if( encoder->capabilities & AV_CODEC_CAP_DR1 )
+        enc_ctx->get_encode_buffer = getPacketBuffer;
+
+    /* put sample parameters */
+    enc_ctx->bit_rate = 4096000; // 2KB/sec
+    /* resolution must be a multiple of two */
+    enc_ctx->width = width;
+    enc_ctx->height = height;
+    // Capture rate the VBV budgets are set by (reopened on its change), frame timestamps in msec
+    // keep the governed and late frames apart
+    enc_ctx->time_base = (AVRational){1, 1000};
+    enc_ctx->framerate = (AVRational){s->fps, 1};
+
+    /* emit one intra frame every ten frames
+     * check frame pict_type before passing frame
+     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
+     * then gop_size is ignored and the output of encoder
+     * will always be I frame irrespective to gop_size
+     */
+    enc_ctx->gop_size = 10;
+    enc_ctx->pix_fmt = pix_fmt;
+
+    if( encoder->id == AV_CODEC_ID_H264 ) {
+        enc_ctx->max_b_frames = 3;
+        av_opt_set(enc_ctx->priv_data, "preset", "ultrafast", 0);
+        av_opt_set(enc_ctx->priv_data, "profile", "baseline", 0);
+        av_opt_set_int(enc_ctx->priv_data, "intra-refresh", 1, 0);
+        av_opt_set_int(enc_ctx->priv_data, "crf", s->crf, 0);
+        // Forced I frames (new receiver, control "idr") should be IDR to start decoding
+        av_opt_set_int(enc_ctx->priv_data, "forced-idr", 1, 0);
+        //av_opt_set(enc_ctx->priv_data, "x264-params", "vbv-maxrate=500000:vbv-bufsize=500:slice-max-size=1500:keyint=60", 0);
+        //av_opt_set(enc_ctx->priv_data, "x264opts", "no-mbtree:sliced-threads:sync-lookahead=0", 0);
+        enc_ctx->max_b_frames = 0;
+        enc_ctx->delay = 0;
+        enc_ctx->thread_count = 1;
+        enc_ctx->thread_type = FF_THREAD_SLICE;
+        enc_ctx->slices = 1;
+        enc_ctx->level = 40;
+        av_opt_set(enc_ctx->priv_data, "tune", "zerolatency", 0);
+        // libx264 ignores the regions of interest when AQ is off (ultrafast preset)
+        if( s->config.roi_qp > 0 )
+            av_opt_set_int(enc_ctx->priv_data, "aq-mode", 1, 0);
+    } else if( encoder->id == AV_CODEC_ID_MJPEG ) {
+        enc_ctx->max_b_frames = 0;
+        enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    }
+    if( s->frame_bytes > 0 ) {
+        // The same one frame VBV buffer sized by the byte cap. Intra refresh wave over a second
+        // replaces the periodic IDRs, so IDR is sent only for the first frame and on request
+        enc_ctx->rc_max_rate = s->frame_bytes * 8 * s->fps;
+        enc_ctx->rc_buffer_size = s->frame_bytes * 8;
+        if( encoder->id == AV_CODEC_ID_H264 )
+            enc_ctx->gop_size = s->fps;
+    } else if( s->max_bitrate > 0 ) {
+        // VBV buffer of one frame keeps every frame under the bitrate budget
+        enc_ctx->rc_max_rate = s->max_bitrate;
+        enc_ctx->rc_buffer_size = s->max_bitrate / s->fps;
+    }
+    enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    /* open it */
+    int ret = avcodec_open2(enc_ctx, encoder, NULL);
+    if( ret < 0 ) {
+        LOG_ERROR("Could not open codec: %s", av_err2str(ret));
+        closeEncoder(s);
+        return -1;
+    }
+    return 0;
+}
+
+// Native capture size or the one fitting the receiver screen with the same aspect,
+// both even for 4:2:0
+static void encodeSize(int width, int height, bool receiver_size, int *enc_width, int *enc_height) {
+    if( receiver_size ) {
+        if( (int64_t)width * RECEIVER_HEIGHT > (int64_t)height * RECEIVER_WIDTH ) {
+            height = (int64_t)height * RECEIVER_WIDTH / width;
+            width = RECEIVER_WIDTH;
+        } else {
+            width = (int64_t)width * RECEIVER_HEIGHT / height;
+            height = RECEIVER_HEIGHT;
+        }
+    }
+    *enc_width = width & ~1;
+    *enc_height = height & ~1;
+}
+
+// Frame buffer of the encoder size & format
+static int allocFrame(struct session *s) {
+    av_frame_unref(s->frame);
+    s->frame->format = s->enc_ctx->pix_fmt;
+    s->frame->width  = s->enc_ctx->width;
+    s->frame->height = s->enc_ctx->height;
+
+    if( av_frame_get_buffer(s->frame, 1) < 0 ) {
+        LOG_ERROR("Could not allocate the video frame data");
+        return -1;
+    }
+    for( int i = 0; i < AV_NUM_DATA_POINTERS && s->frame->buf[i]; i++ )
+        realtime_lock(s->frame->buf[i]->data, s->frame->buf[i]->size);
+    return 0;
+}
+
+// Encoder is reopened for the new settings or size, the frame buffer is
+// reallocated only if the size or format is changed
+static int reopenEncoder(struct session *s, int width, int height, enum AVPixelFormat pix_fmt) {
+    closeEncoder(s);
+    if( openEncoder(s, width, height, pix_fmt) < 0 )
+        return -1;
+    if( (width != s->frame->width || height != s->frame->height || s->enc_ctx->pix_fmt != s->frame->format)
+            && allocFrame(s) < 0 )
+        return -1;
+    // New SPS/PPS go to every receiver before the first frame of the new encoder
+    s->codec_data_refresh = true;
+    s->encoder_reopen = false;
+#ifdef ALLOC_ACCOUNTING
+    s->alloc_warmup = ALLOC_WARMUP_FRAMES;
+#endif
+    return 0;
+}
+
+// Failed receivers are reconnected in background without holding the frame, the ones
+// back up get the stream request & codec header replayed and the next frame as IDR
+static void pollReceivers(struct session *s) {
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        if( receiver_poll(s->receivers[i]) )
+            s->force_idr = true;
+    }
+}
+
+// Marks the end of the job stage and wakes the capture thread
+static void jobSignal(struct session *s, bool *flag) {
+    pthread_mutex_lock(&s->job_lock);
+    *flag = true;
+    pthread_cond_broadcast(&s->job_cond);
+    pthread_mutex_unlock(&s->job_lock);
+}
+
+static int encodeFrame(struct session *s) {
+    AVFrame *frame = s->frame;
+    AVPacket *pkt = s->pkt;
+    const struct capture_frame *captured = &s->captured;
+
+    pollReceivers(s);
+
+    // Output mode, scale or transform change gives the capture of another size or format,
+    // the change of the source format only is handled by the converter
+    int enc_width, enc_height;
+    encodeSize(captured->width, captured->height, s->config.receiver_size, &enc_width, &enc_height);
+    enum AVPixelFormat pix_fmt = convert_target_format(captured->format);
+    if( enc_width != frame->width || enc_height != frame->height || pix_fmt != frame->format ) {
+        LOG_INFO("Session %u capture changed to %dx%d %s, encoding as %dx%d", s->index,
+            captured->width, captured->height, av_get_pix_fmt_name(captured->format), enc_width, enc_height);
+        s->encoder_reopen = true;
+    } else {
+        pix_fmt = frame->format;
+    }
+    if( s->encoder_reopen && reopenEncoder(s, enc_width, enc_height, pix_fmt) < 0 )
+        return -1;
+
+    /* make sure the frame data is writable
+     * encoder drops its reference after encoding, so it's no-op
+     * in the steady state and the same frame buffer is reused */
+    if( av_frame_make_writable(frame) < 0 )
+        return -1;
+
+    // Convert from existing format to target one
+    struct perf_sample perf;
+    perf_begin(&perf);
+    if( convert_frame(&s->converter, captured->format, captured->width, captured->height,
+            captured->data, captured->linesize, frame) < 0 )
+        return -1;
+    perf_end(PERF_STAGE_CONVERT, &perf);
+    // Damage is in the captured frame, so it has to be done before it's released
+    if( s->config.roi_qp > 0 || s->governor.min_fps > 0 ) {
+        if( roi_apply(&s->roi, frame, captured) < 0 )
+            return -1;
+        s->stats.roi_changed_area += s->roi.changed_area;
+    }
+    frame->pts = av_rescale_q(captured->pts - s->start_pts, (AVRational){ 1, 1000000000 }, s->enc_ctx->time_base);
+    // Receiver shows the frame at its capture time shifted by the offset plus its own buffer (latencyMs)
+    int64_t capture_ts = s->source->monotonic_pts ? (int64_t)captured->pts : s->frame_latency.ready;
+    s->frame_ts = capture_ts + s->config.presentation_offset_ms * 1000000LL;
+    s->frame_ntp = stream_ntp_time(s->frame_ts);
+    s->frame_latency.converted = latency_now();
+    // Captured frame isn't used anymore, the next one could be captured while encoding
+    jobSignal(s, &s->job_converted);
+
+    frame->pict_type = s->force_idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    s->force_idr = false;
+
+    // ENCODE
+    // TODO: use vaapi to improve encoding:
+    // https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/vaapi_encode.c
+    perf_begin(&perf);
+    int ret = avcodec_send_frame(s->enc_ctx, frame);
+    if( ret < 0 ) {
+        LOG_ERROR("sending a frame for encoding failed");
+        return -1;
+    }
+
+    while( ret >= 0 ) {
+        ret = avcodec_receive_packet(s->enc_ctx, pkt);
+        if( ret == AVERROR(EAGAIN) || ret == AVERROR_EOF )
+            break;
+        else if( ret < 0 ) {
+            LOG_ERROR("encoding failed");
+            return -1;
+        }
+        s->frame_latency.encoded = latency_now();
+        perf_end(PERF_STAGE_ENCODE, &perf);
+        s->stats.frames_encoded++;
+        s->stats.bytes_encoded += pkt->size;
+        if( pkt->flags & AV_PKT_FLAG_KEY )
+            s->stats.keyframes++;
+        latency_hist_add_value(s->frame_sizes, pkt->size);
+        if( (uint64_t)pkt->size > s->stats.max_frame_bytes )
+            s->stats.max_frame_bytes = pkt->size;
+        if( s->frame_bytes > 0 && pkt->size > s->frame_bytes ) {
+            s->stats.frames_over_cap++;
+            LOG_DEBUG("Session %u frame of %d bytes is over the %ld bytes cap", s->index, pkt->size, s->frame_bytes);
+        }
+        if( s->governor.min_fps > 0 )
+            governor_update(&s->governor, s->roi.changed_area, pkt->size * 8.0 / (frame->width * frame->height),
+                pkt->flags & AV_PKT_FLAG_KEY, s->fps, s->frame_latency.encoded);
+
+        if( s->codec_data_refresh ) {
+            // Send ping
+            // TODO: send heart beat every second
+            stream_header(s->header_buff, 0, STREAM_HEART_BEAT, 0);
+            sendToOutputs(s, s->header_buff, STREAM_HEADER_SIZE);
+
+            // Send VIDEO_CODEC header
+            ssize_t avcc_len = stream_avcc_config(s->avcc_buff, sizeof(s->avcc_buff),
+                s->enc_ctx->extradata, s->enc_ctx->extradata_size);
+            if( avcc_len < 0 )
+                return -1;
+            s->avcc_len = avcc_len;
+            stream_header(s->header_buff, s->avcc_len, STREAM_VIDEO_CODEC, stream_ntp_time(latency_now()));
+            sendToOutputs(s, s->header_buff, STREAM_HEADER_SIZE);
+
+            // Send AVCC data
+            sendToOutputs(s, s->avcc_buff, s->avcc_len);
+            if( s->config.packet_cb )
+                s->config.packet_cb(s->config.packet_opaque, STREAM_VIDEO_CODEC, s->avcc_buff, s->avcc_len,
+                    s->frame_ntp, false);
+            if( s->replay )
+                replay_set_codec(s->replay, s->avcc_buff, s->avcc_len, s->enc_ctx->width, s->enc_ctx->height);
+
+            s->codec_data_refresh = false;
+        }
+        setupReceivers(s);
+
+        // Change nalu start to nalu size
+        perf_begin(&perf);
+        ssize_t first_nalu = stream_annexb_to_avcc(pkt->data, pkt->size);
+        if( first_nalu < 0 ) {
+            LOG_ERROR("No NALU in the encoded packet of %d bytes", pkt->size);
+            av_packet_unref(pkt);
+            continue;
+        }
+        stream_header(s->header_buff, pkt->size - first_nalu, STREAM_VIDEO_DATA, s->frame_ntp);
+        s->frame_latency.queued = latency_now();
+        perf_end(PERF_STAGE_PACKETIZE, &perf);
+
+        // Send packet header & data
+        perf_begin(&perf);
+        int64_t sent_ts = sendFrameToOutputs(s, s->header_buff, &pkt->data[first_nalu],
+            pkt->size - first_nalu, pkt->flags & AV_PKT_FLAG_KEY, s->frame_latency.queued);
+        latency_record_frame(&s->frame_latency, sent_ts);
+        perf_end(PERF_STAGE_SEND, &perf);
+        // Kept after sending, so the copy doesn't delay the frame
+        if( s->replay )
+            replay_add(s->replay, &pkt->data[first_nalu], pkt->size - first_nalu, s->frame_ts,
+                pkt->flags & AV_PKT_FLAG_KEY);
+
+        av_packet_unref(pkt);
+        // Next packet (if any) is encoded
+        perf_begin(&perf);
+    }
+    // ENCODE DONE
+    return 0;
+}
+
+// Worker pool job: converts, encodes and sends the captured frame
+static void frameJob(void *arg) {
+    struct session *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    s->frame_latency = s->capture_latency;
+#ifdef ALLOC_ACCOUNTING
+    struct alloc_stats frame_allocs;
+    alloc_stats_begin();
+#endif
+
+    bool failed = encodeFrame(s) < 0;
+
+#ifdef ALLOC_ACCOUNTING
+    alloc_stats_end(&frame_allocs);
+    if( s->alloc_warmup > 0 ) {
+        s->alloc_warmup--;
+    } else {
+        s->alloc_totals.frames++;
+        s->alloc_totals.count += frame_allocs.count;
+        s->alloc_totals.bytes += frame_allocs.bytes;
+        if( frame_allocs.large > 0 ) {
+            s->alloc_totals.large_frames++;
+            LOG_ERROR("Steady-state frame of session %u made %lu buffer allocations (%lu bytes total)",
+                s->index, frame_allocs.large, frame_allocs.bytes);
+            if( opt_alloc_check ) {
+                s->exit_code = ALLOC_CHECK_FAILED;
+                failed = true;
+            }
+        }
+    }
+#endif
+
+    s->fps_frames++;
+    if( latency_now() - s->fps_ts >= 1000000000LL ) {
+        s->stats.fps = s->fps_frames * 1000000000.0 / (latency_now() - s->fps_ts);
+        s->fps_ts = latency_now();
+        s->fps_frames = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_lock(&s->job_lock);
+    s->job_failed = failed;
+    s->job_converted = true; // in case of failure before the conversion
+    s->job_busy = false;
+    pthread_cond_broadcast(&s->job_cond);
+    pthread_mutex_unlock(&s->job_lock);
+}
+
+// Waits until the flag becomes the value, returns false if the job failed
+static bool jobWait(struct session *s, bool *flag, bool value) {
+    pthread_mutex_lock(&s->job_lock);
+    while( *flag != value )
+        pthread_cond_wait(&s->job_cond, &s->job_lock);
+    bool ok = !s->job_failed;
+    pthread_mutex_unlock(&s->job_lock);
+    return ok;
+}
+
+// Keeps the receivers connection alive in between the frames of the low capture rate
+static void sendHeartbeat(struct session *s) {
+    if( !jobWait(s, &s->job_busy, false) )
+        return;
+    pthread_mutex_lock(&s->lock);
+    pollReceivers(s);
+    stream_header(s->header_buff, 0, STREAM_HEART_BEAT, 0);
+    sendToOutputs(s, s->header_buff, STREAM_HEADER_SIZE);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Sleeps for the rest of the frame interval from the frame start
+static void frameSleep(struct session *s, int64_t frame_ts, int64_t frame_delay) {
+    // 100000 = 100msec == 0.1 sec = 10f/s
+    // 50000 = 50msec == 0.05 sec = 20f/s
+    int64_t delay = frame_delay - (latency_now() - frame_ts) / 1000;
+    LOG_DEBUG("--> Session %u frame ts: %ld, additional delay: %ld", s->index, frame_ts, delay);
+    // Governed interval longer than the heartbeat period is slept in parts
+    while( delay > SESSION_HEARTBEAT_MS * 1000 && running(s) ) {
+        struct timespec part = { SESSION_HEARTBEAT_MS / 1000, SESSION_HEARTBEAT_MS % 1000 * 1000000 };
+        while( clock_nanosleep(CLOCK_MONOTONIC, 0, &part, &part) == EINTR && running(s) ) {
+            // Interrupted by signal
+        }
+        sendHeartbeat(s);
+        delay = frame_delay - (latency_now() - frame_ts) / 1000;
+    }
+    if( delay > 0 && delay <= SESSION_HEARTBEAT_MS * 1000 ) {
+        // Absolute deadline, so the wakeup lateness is the scheduling latency
+        int64_t wake_ts = latency_now() + delay * 1000;
+        struct timespec wake = { wake_ts / 1000000000, wake_ts % 1000000000 };
+        while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR ) {
+            // Interrupted by signal
+        }
+        latency_record(LATENCY_STAGE_WAKEUP, wake_ts, latency_now());
+    }
+}
+
+// Capture is paused, but connections are kept alive with heartbeats
+static void waitPaused(struct session *s) {
+    pthread_mutex_lock(&s->lock);
+    while( s->paused && running(s) ) {
+        pollReceivers(s);
+        stream_header(s->header_buff, 0, STREAM_HEART_BEAT, 0);
+        sendToOutputs(s, s->header_buff, STREAM_HEADER_SIZE);
+
+        struct timespec wait_ts;
+        clock_gettime(CLOCK_REALTIME, &wait_ts);
+        wait_ts.tv_sec += 1;
+        pthread_cond_timedwait(&s->cond, &s->lock, &wait_ts);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Waits for the next frame, the receivers get heartbeats while the source waits for the
+// screen change (no outputs are set up before the first frame)
+static int captureNext(struct session *s, bool heartbeat) {
+    int ret;
+    while( (ret = capture_next(s->source, &s->captured)) == CAPTURE_TIMEOUT && running(s) ) {
+        if( heartbeat )
+            sendHeartbeat(s);
+        s->capture_latency.requested = latency_now();
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+// First frame gives the encoder size & format
+static int captureFirst(struct session *s) {
+    s->capture_latency.requested = latency_now();
+    if( captureNext(s, false) < 0 ) {
+        if( running(s) )
+            LOG_ERROR("Unable to capture the first frame from %s source", s->source->name);
+        return -1;
+    }
+    s->capture_latency.ready = latency_now();
+    s->start_pts = s->captured.pts;
+
+    // NV12 & YUV420P captures go to x264 without colour conversion, scaling is done
+    // in the same pass with it
+    int enc_width, enc_height;
+    encodeSize(s->captured.width, s->captured.height, s->config.receiver_size, &enc_width, &enc_height);
+    LOG_INFO("Session %u encoding %dx%d capture as %dx%d", s->index, s->captured.width, s->captured.height,
+        enc_width, enc_height);
+    if( openEncoder(s, enc_width, enc_height, convert_target_format(s->captured.format)) < 0 )
+        return -1;
+    s->codec_data_refresh = true;
+    return allocFrame(s);
+}
+
+static void *captureThread(void *arg) {
+    struct session *s = arg;
+    realtime_setup_thread(REALTIME_ROLE_CAPTURE);
+
+    // First frame is captured by session_new, unless the source is given by the caller
+    if( s->config.source && captureFirst(s) < 0 ) {
+        if( running(s) )
+            s->exit_code = EXIT_FAILURE;
+        goto done;
+    }
+    for( ;; ) {
+        int64_t frame_ts = latency_now();
+
+        // Previous frame is still encoded & sent while this one was captured
+        if( !jobWait(s, &s->job_busy, false) )
+            break;
+        // Job holds the lock while encoding, so the settings are read in between
+        pthread_mutex_lock(&s->lock);
+        s->stats.frames_captured++;
+        int64_t frame_delay = 1000000 / (s->governor.min_fps > 0 ? s->governor.fps : s->fps);
+        bool paused = s->paused;
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_mutex_lock(&s->job_lock);
+        s->job_busy = true;
+        s->job_converted = false;
+        pthread_mutex_unlock(&s->job_lock);
+        if( workers_submit(s->index, frameJob, s) < 0 ) {
+            LOG_ERROR("Worker queue is full");
+            pthread_mutex_lock(&s->job_lock);
+            s->job_busy = false;
+            s->job_failed = true;
+            pthread_mutex_unlock(&s->job_lock);
+            break;
+        }
+        if( !jobWait(s, &s->job_converted, true) )
+            break;
+
+        if( s->config.max_frames > 0 && s->stats.frames_captured >= s->config.max_frames )
+            break;
+        if( !running(s) )
+            break;
+
+        // Sleep for the next frame
+        // TODO: Multithreading capture/encoding to improve framerate
+        if( !s->config.unthrottled )
+            frameSleep(s, frame_ts, frame_delay);
+        if( paused ) {
+            // Heartbeats are sent after the last frame
+            if( !jobWait(s, &s->job_busy, false) )
+                break;
+            waitPaused(s);
+        }
+
+        s->capture_latency.requested = latency_now();
+        struct perf_sample perf;
+        perf_begin(&perf);
+        if( running(s) && captureNext(s, true) < 0 ) {
+            // Interrupted capture on exit is not an error
+            if( running(s) ) {
+                LOG_ERROR("Capture from %s source of session %u failed", s->source->name, s->index);
+                s->exit_code = EXIT_FAILURE;
+            }
+            break;
+        }
+        s->capture_latency.ready = latency_now();
+        perf_end(PERF_STAGE_CAPTURE, &perf);
+        if( !running(s) )
+            break;
+    }
+
+    jobWait(s, &s->job_busy, false);
+    if( s->job_failed && s->exit_code == EXIT_SUCCESS )
+        s->exit_code = EXIT_FAILURE;
+done:
+    if( s->source->finish )
+        s->source->finish(s->source);
+    pthread_mutex_lock(&s->job_lock);
+    s->finished = true;
+    pthread_mutex_unlock(&s->job_lock);
+    return NULL;
+}
+
+// Resolves, connects and sends the stream request, the plist is already built
+static void *connectThread(void *arg) {
+    struct session_connect *c = arg;
+    c->receiver = receiver_connect(c->address, RECEIVER_CONNECT_TIMEOUT_MS);
+    if( c->receiver && initMirroringConnection(c->session, c->receiver) == 0 )
+        c->receiver->stream_requested = true;
+    return NULL;
+}
+
+// Collects the connected receivers, the failed ones are reconnected by pollReceivers
+static unsigned int joinConnects(struct session *s) {
+    unsigned int connected = 0;
+    for( unsigned int i = 0; i < s->connects_count; i++ ) {
+        struct session_connect *c = &s->connects[i];
+        if( c->started )
+            pthread_join(c->thread, NULL);
+        if( c->receiver ) {
+            connected++;
+        } else {
+            c->receiver = receiver_new_down(c->address);
+            if( !c->receiver )
+                continue;
+            LOG_WARN("Session %u receiver %s is unreachable, reconnecting in %d ms", s->index, c->address,
+                c->receiver->backoff_ms);
+        }
+        s->receivers[s->receivers_count++] = c->receiver;
+    }
+    s->connects_count = 0;
+    return connected;
+}
+
+int session_init(const char *plist_path, const char *id) {
+    if( id )
+        device_id = id;
+    if( plist_path && loadStreamPlist(plist_path) < 0 )
+        return -1;
+    encoder = avcodec_find_encoder_by_name("libx264");
+    if( !encoder ) {
+        LOG_ERROR("Codec '%s' not found", "libx264");
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef ALLOC_ACCOUNTING
+void session_set_alloc_check(bool enabled) {
+    opt_alloc_check = enabled;
+}
+#endif
+
+struct session *session_new(unsigned int index, const struct session_config *config) {
+    struct session *s = calloc(1, sizeof(struct session));
+    if( !s ) {
+        capture_close(config->source);
+        return NULL;
+    }
+    s->source = config->source;
+    s->index = index;
+    s->config = *config;
+    s->fps = config->fps;
+    governor_init(&s->governor, config->min_fps, config->fps);
+    s->crf = config->crf;
+    s->max_bitrate = config->max_bitrate;
+    s->frame_bytes = config->frame_bytes;
+    s->pacing = config->pacing;
+    s->roi.qp = config->roi_qp;
+    s->converter = (struct converter){ NULL, AV_PIX_FMT_NONE, AV_PIX_FMT_NONE, 0, 0, 0, 0 };
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_mutex_init(&s->job_lock, NULL);
+    pthread_cond_init(&s->job_cond, NULL);
+#ifdef ALLOC_ACCOUNTING
+    // Frames after start or encoder reopen allocate pools & caches
+    s->alloc_warmup = ALLOC_WARMUP_FRAMES;
+#endif
+
+    // Every session is a separate stream for the receivers
+    if( plist_file_len > 0 ) {
+        memcpy(s->plist_buf, plist_file_buf, plist_file_len);
+        s->plist_len = plist_file_len;
+    } else {
+        if( getrandom(&s->session_id, sizeof(s->session_id), 0) != sizeof(s->session_id) )
+            s->session_id = latency_now() ^ getpid();
+        s->session_id &= INT32_MAX;
+        if( buildStreamPlist(s) < 0 )
+            goto fail;
+    }
+
+    if( !s->source )
+        s->source = capture_open(config->source_spec, &config->capture);
+    if( !s->source )
+        goto fail;
+
+    if( config->receivers ) {
+        // TODO: Check MDNS on airplay features and determine mirroring support
+        char *saveptr = NULL;
+        char *addr_ptr = strtok_r(config->receivers, ",", &saveptr);
+        while( addr_ptr != NULL && s->connects_count < RECEIVERS_MAX ) {
+            struct session_connect *c = &s->connects[s->connects_count++];
+            c->session = s;
+            c->address = addr_ptr;
+            c->started = pthread_create(&c->thread, NULL, connectThread, c) == 0;
+            if( !c->started )
+                connectThread(c);
+            addr_ptr = strtok_r(NULL, ",", &saveptr);
+        }
+    }
+
+    if( config->file_path ) {
+        LOG_INFO("Session %u writing stream to file: %s", index, config->file_path);
+        s->output_file = fopen(config->file_path, "wb");
+        if( !s->output_file ) {
+            LOG_ERROR("Unable to open %s: %m", config->file_path);
+            goto fail;
+        }
+    }
+
+    if( config->write_stdout ) {
+        LOG_INFO("Session %u writing stream to stdout", index);
+        s->output_stdout = stdout;
+    }
+
+    if( config->io_uring ) {
+        s->uring = uring_new(URING_ENTRIES);
+        if( s->uring ) {
+            s->uring_writes = calloc(RECEIVERS_MAX + 2, sizeof(struct uring_write));
+            if( !s->uring_writes )
+                goto fail;
+            uring_register_buffer(s->uring, s->header_buff, sizeof(s->header_buff));
+            LOG_INFO("Session %u sends the frames by io_uring", index);
+        }
+    }
+
+    s->pkt = av_packet_alloc();
+    s->frame_sizes = latency_hist_new();
+    if( !s->pkt || !s->frame_sizes )
+        goto fail;
+    if( config->replay_seconds > 0 ) {
+        s->replay = replay_new(config->replay_seconds, config->replay_bytes);
+        if( !s->replay )
+            goto fail;
+        realtime_lock(s->replay->buf, s->replay->size);
+        LOG_INFO("Session %u keeps the last %d s of the stream for replay (up to %ld bytes)", index,
+            config->replay_seconds, config->replay_bytes);
+    }
+
+    s->frame = av_frame_alloc();
+    if( !s->frame ) {
+        LOG_ERROR("Could not allocate video frame");
+        goto fail;
+    }
+    // Caller given source (pushed frames) could have no frame yet, the capture thread waits for it
+    if( !config->source && captureFirst(s) < 0 )
+        goto fail;
+
+    return s;
+
+fail:
+    session_free(s);
+    return NULL;
+}
+
+int session_start(struct session *s) {
+    // Receivers down since the start are retried, but a session with none of them up and no
+    // other output is most likely misconfigured
+    if( joinConnects(s) == 0 && s->config.receivers && !s->output_file && !s->output_stdout ) {
+        LOG_ERROR("Session %u has no connected receivers", s->index);
+        return -1;
+    }
+    initMirroringConnection(s, NULL);
+    s->fps_ts = latency_now();
+    if( pthread_create(&s->thread, NULL, captureThread, s) != 0 ) {
+        LOG_ERROR("Unable to start capture thread of session %u", s->index);
+        return -1;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "capture-%u", s->index);
+    pthread_setname_np(s->thread, name);
+    return 0;
+}
+
+bool session_finished(struct session *s) {
+    pthread_mutex_lock(&s->job_lock);
+    bool finished = s->finished;
+    pthread_mutex_unlock(&s->job_lock);
+    return finished;
+}
+
+void session_stop(struct session *s) {
+    s->stopping = true;
+    pthread_mutex_lock(&s->lock);
+    session_wake(s);
+    pthread_mutex_unlock(&s->lock);
+    if( s->source->interrupt )
+        s->source->interrupt(s->source);
+}
+
+void session_join(struct session *s) {
+    // Paused session is woken up to see the stop
+    pthread_mutex_lock(&s->lock);
+    session_wake(s);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+}
+
+void session_free(struct session *s) {
+    joinConnects(s);
+    for( unsigned int i = 0; i < s->receivers_count; i++ )
+        receiver_free(s->receivers[i]);
+    s->receivers_count = 0;
+
+    if( s->output_file )
+        fclose(s->output_file);
+    if( s->output_stdout )
+        fclose(s->output_stdout);
+
+    closeEncoder(s);
+    convert_free(&s->converter);
+    roi_free(&s->roi);
+    av_frame_free(&s->frame);
+    av_packet_free(&s->pkt);
+    // Packet buffers are unregistered as they are freed
+    uring_free(s->uring);
+    free(s->uring_writes);
+    latency_hist_free(s->frame_sizes);
+    if( s->replay ) {
+        realtime_unlock(s->replay->buf, s->replay->size);
+        replay_free(s->replay);
+    }
+    capture_close(s->source);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->job_lock);
+    pthread_cond_destroy(&s->job_cond);
+    free(s);
+}
+
+void session_wake(struct session *s) {
+    pthread_cond_broadcast(&s->cond);
+}
+
+int session_add_receiver(struct session *s, struct receiver *r) {
+    if( s->receivers_count >= RECEIVERS_MAX )
+        return -1;
+    s->receivers[s->receivers_count++] = r;
+    // New receiver could start decoding only from IDR
+    s->force_idr = true;
+    return 0;
+}
+
+struct receiver *session_remove_receiver(struct session *s, const char *id) {
+    // Receiver could be specified by address or by "#<index>"
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        struct receiver *r = s->receivers[i];
+        if( (id[0] == '#' && (unsigned int)atoi(&id[1]) == i) || strcmp(r->address, id) == 0 ) {
+            s->receivers_count--;
+            memmove(&s->receivers[i], &s->receivers[i + 1], (s->receivers_count - i) * sizeof(s->receivers[0]));
+            return r;
+        }
+    }
+    return NULL;
+}
+
+int session_save_replay(struct session *s, const char *path) {
+    if( !s->replay ) {
+        LOG_ERROR("Session %u has no replay buffer (--replay)", s->index);
+        return -1;
+    }
+    pthread_mutex_lock(&s->lock);
+    struct replay_snapshot *snap = replay_snapshot(s->replay);
+    pthread_mutex_unlock(&s->lock);
+    if( !snap )
+        return -1;
+    int ret = replay_write(snap, path);
+    replay_snapshot_free(snap);
+    return ret;
+}
+
+void session_report_latency(struct session *s, FILE *out) {
+    char name[32];
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        if( s->index > 0 )
+            snprintf(name, sizeof(name), "sent @%u #%u", s->index, i);
+        else
+            snprintf(name, sizeof(name), "sent #%u", i);
+        latency_hist_report(out, name, s->receivers[i]->latency);
+    }
+}
+
+void session_report_sizes(struct session *s, FILE *out) {
+    char name[32];
+    if( s->index > 0 )
+        snprintf(name, sizeof(name), "frames @%u", s->index);
+    else
+        snprintf(name, sizeof(name), "frames");
+    latency_hist_report(out, name, s->frame_sizes);
+}
+
+void session_report(struct session *s) {
+    LOG_INFO("Session %u: %lu frames captured, %lu encoded (%lu keyframes, %lu bytes)", s->index,
+        s->stats.frames_captured, s->stats.frames_encoded, s->stats.keyframes, s->stats.bytes_encoded);
+    if( s->frame_bytes > 0 )
+        LOG_INFO("Session %u: %lu frames over the %ld bytes cap, the biggest one %lu bytes", s->index,
+            s->stats.frames_over_cap, s->frame_bytes, s->stats.max_frame_bytes);
+#ifdef ALLOC_ACCOUNTING
+    if( s->alloc_totals.frames > 0 )
+        LOG_INFO("Steady-state allocations per frame: %.1f (%lu bytes), frames with buffer allocations: %lu/%lu",
+            (double)s->alloc_totals.count / s->alloc_totals.frames, s->alloc_totals.bytes / s->alloc_totals.frames,
+            s->alloc_totals.large_frames, s->alloc_totals.frames);
+#endif
+    if( s->uring )
+        LOG_INFO("Session %u: %lu io_uring submissions of %lu sends & writes (%lu continued after short write)",
+            s->index, s->uring->enters, s->uring->submitted, s->uring->short_writes);
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        struct receiver *r = s->receivers[i];
+        LOG_INFO("Receiver %s: biggest frame %lu bytes, up to %lu bytes queued from the previous frames",
+            r->address, r->max_burst_bytes, r->pacing_backlog_max);
+    }
+}
@@ -0,0 +1,206 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "capture.h"
+#include "convert.h"
+#include "governor.h"
+#include "latency.h"
+#include "receiver.h"
+#include "replay.h"
+#include "roi.h"
+#include "stream.h"
+#include "uring.h"
+
+#define SESSIONS_MAX 16
+#define SESSION_AVCC_SIZE 1024
+#define SESSION_PLIST_SIZE 1024
+#define SESSION_LATENCY_MS 50
+#define SESSION_FPS 20
+#define SESSION_CRF 15
+// Idle connection keep-alive, sent when no frame is sent that long
+#define SESSION_HEARTBEAT_MS 1000
+#define SESSION_DEVICE_ID "7B:DE:DB:1F:BB:AB"
+
+// Cleared by the signal handler, every session stops after the current frame
+extern volatile sig_atomic_t sessions_running;
+
+// Payload as it goes to the receivers: avcC record or the frame NALUs with sizes
+typedef void (*session_packet_cb)(void *opaque, enum stream_payload type, const uint8_t *data, size_t size,
+    uint64_t ntp_ts, bool keyframe);
+
+struct session_config {
+    const char *source_spec;       // NULL - default wayland capture
+    // Opened source used instead of the spec, owned by the session. The first frame
+    // is captured by the capture thread, so session_new doesn't wait for it.
+    struct capture_source *source;
+    struct capture_options capture;
+    bool receiver_size;            // scale to fit the receiver screen
+    char *receivers;               // "addr[:port],..." or NULL
+    const char *file_path;
+    bool write_stdout;
+    int latency_ms;                // receiver playout buffer asked by the stream request
+    int presentation_offset_ms;    // added to the capture time in the frame timestamps
+    // Budgets of the session
+    int fps;
+    double min_fps;                // floor of the governed capture rate, 0 - fixed rate
+    int crf;
+    int64_t max_bitrate;           // VBV cap in bits/sec, 0 - disabled
+    int64_t frame_bytes;           // VBV cap of every frame with intra refresh instead of IDRs, 0 - off
+    int roi_qp;                    // quantizer offset of the changed/static areas, 0 - off
+    int pacing;                    // % of the frame interval to send the frame over, 0 - unpaced
+    int replay_seconds;            // instant replay of the last encoded frames, 0 - off
+    int64_t replay_bytes;          // memory of the replay ring
+    bool io_uring;                 // frame sends & writes batched by io_uring (send() if unavailable)
+    bool unthrottled;
+    uint64_t max_frames;           // 0 - until stopped
+    session_packet_cb packet_cb;   // called by the frame job for every payload, NULL - off
+    void *packet_opaque;
+};
+
+// Receiver connected & handshaked by its own thread while the session captures the
+// first frame and opens the encoder
+struct session_connect {
+    struct session *session;
+    const char *address;
+    pthread_t thread;
+    bool started;
+    struct receiver *receiver; // NULL on failure
+};
+
+// Capture of one output streamed to the group of receivers. The capture thread of
+// the session grabs the frames and queues them as jobs to the shared worker pool,
+// which converts, encodes and sends them (one job of a session at a time).
+struct session {
+    unsigned int index;
+    struct session_config config;
+    struct capture_source *source;
+    pthread_t thread;
+    _Atomic bool stopping;         // stops this session only, like sessions_running
+
+    // Held by the frame job, so the control socket could change the settings
+    // & receivers only in between the frames
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fps;
+    int crf;
+    int64_t max_bitrate;
+    int64_t frame_bytes;
+    int pacing;
+    struct governor governor;
+    bool paused;
+    bool force_idr;
+    bool encoder_reopen;
+
+    struct receiver *receivers[RECEIVERS_MAX];
+    unsigned int receivers_count;
+    struct session_connect connects[RECEIVERS_MAX];
+    unsigned int connects_count;
+    // Stream request body (POST /stream)
+    uint32_t session_id;
+    uint8_t plist_buf[SESSION_PLIST_SIZE];
+    size_t plist_len;
+    FILE *output_file;
+    FILE *output_stdout;
+
+    struct {
+        uint64_t frames_captured;
+        uint64_t frames_encoded;
+        uint64_t keyframes;
+        uint64_t bytes_encoded;
+        double fps;
+        double roi_changed_area;   // sum of the changed fractions of the encoded frames
+        uint64_t frames_over_cap;  // encoded frames bigger than frame_bytes
+        uint64_t max_frame_bytes;
+    } stats;
+    struct latency_hist *frame_sizes;
+
+    // Frame handed from the capture thread to the job, the capture buffer is
+    // reused as soon as the job converts it
+    pthread_mutex_t job_lock;
+    pthread_cond_t job_cond;
+    struct capture_frame captured;
+    struct latency_frame capture_latency;
+    bool job_busy;
+    bool job_converted;
+    bool job_failed;
+    bool finished;
+    int exit_code;
+
+    // Used by the frame job only
+    struct AVCodecContext *enc_ctx;
+    struct converter converter;
+    struct roi roi;
+    AVBufferPool *packet_pool;
+    size_t packet_pool_size;
+    struct uring *uring;           // NULL - classic path
+    struct uring_write *uring_writes; // receivers & files of the frame
+    AVFrame *frame;
+    AVPacket *pkt;
+    uint64_t start_pts;
+    bool codec_data_refresh;
+    struct latency_frame frame_latency;
+    uint64_t frame_ntp;            // presentation time of the encoded frame
+    int64_t frame_ts;              // the same in CLOCK_MONOTONIC nsec
+    struct replay *replay;         // read under the lock, NULL - off
+    int64_t fps_ts;
+    uint64_t fps_frames;
+    uint8_t header_buff[STREAM_HEADER_SIZE];
+    uint8_t avcc_buff[SESSION_AVCC_SIZE];
+    size_t avcc_len;
+#ifdef ALLOC_ACCOUNTING
+    int alloc_warmup;
+    struct {
+        uint64_t frames;
+        uint64_t count;
+        uint64_t bytes;
+        uint64_t large_frames;
+    } alloc_totals;
+#endif
+};
+
+// Finds the encoder, the stream request plist is loaded from plist_path if it's set
+// (generated for every session otherwise). Returns -1 on error.
+int session_init(const char *plist_path, const char *device_id);
+#ifdef ALLOC_ACCOUNTING
+void session_set_alloc_check(bool enabled);
+#endif
+
+// Opens the capture and outputs, captures the first frame to open the encoder with its size.
+// Receivers are connected in background meanwhile. Sessions should be created one by one,
+// since the first capture measures the formats.
+struct session *session_new(unsigned int index, const struct session_config *config);
+// Waits for the receivers connections, sends the stream request to the files and starts
+// the capture thread. Fails if no output of the session is left.
+int session_start(struct session *s);
+bool session_finished(struct session *s);
+// Stops the session after the current frame, the blocked capture is interrupted if the source can
+void session_stop(struct session *s);
+void session_join(struct session *s);
+void session_free(struct session *s);
+
+// Wakes the paused session, should be called with the session lock
+void session_wake(struct session *s);
+
+// Receivers are added & removed under the session lock, new one gets the stream
+// request and codec data before the next frame
+int session_add_receiver(struct session *s, struct receiver *r);
+struct receiver *session_remove_receiver(struct session *s, const char *id);
+
+// Writes the instant replay to the file, the session is locked only to copy it
+int session_save_replay(struct session *s, const char *path);
+
+void session_report_latency(struct session *s, FILE *out);
+// Encoded frame size rows (bytes) for the same kind of table
+void session_report_sizes(struct session *s, FILE *out);
+void session_report(struct session *s);
+
+#endif // SESSION_H
@@ -0,0 +1,257 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "bplist.h"
+#include "stream.h"
+#include "log.h"
+
+// Seconds from 1900 (NTP era 0) to 1970
+#define NTP_UNIX_OFFSET 2208988800ULL
+
+static void writeUInt32LE(uint8_t *buff, uint32_t buff_pos, uint32_t data32) {
+    buff[buff_pos] = (uint8_t) data32 & 0xff;
+    buff[buff_pos+1] = (uint8_t) (data32 >> 8) & 0xff;
+    buff[buff_pos+2] = (uint8_t) (data32 >> 16) & 0xff;
+    buff[buff_pos+3] = (uint8_t) (data32 >> 24) & 0xff;
+}
+
+static void writeFloat32LE(uint8_t *buff, uint32_t buff_pos, float data32) {
+    // TODO: probably will not work well somewhere
+    uint8_t *b = (uint8_t *) &buff[buff_pos];
+    uint8_t *p = (uint8_t *) &data32;
+#if defined (_M_IX86) || (defined (CPU_FAMILY) && (CPU_FAMILY == I80X86))
+    b[0] = p[3];
+    b[1] = p[2];
+    b[2] = p[1];
+    b[3] = p[0];
+#else
+    b[0] = p[0];
+    b[1] = p[1];
+    b[2] = p[2];
+    b[3] = p[3];
+#endif
+}
+
+static void writeUInt16LE(uint8_t *buff, uint32_t buff_pos, uint16_t data16) {
+    buff[buff_pos] = (uint8_t) data16 & 0xff;
+    buff[buff_pos+1] = (uint8_t) (data16 >> 8) & 0xff;
+}
+
+static void writeUInt16BE(uint8_t *buff, uint32_t buff_pos, uint16_t data16) {
+    buff[buff_pos] = (uint8_t) (data16 >> 8) & 0xff;
+    buff[buff_pos+1] = (uint8_t) data16 & 0xff;
+}
+
+// Formats bytes as "0x67, 0x42, ..." for the debug messages
+static const char *hexDump(const uint8_t *data, size_t size, char *out, size_t out_size) {
+    size_t pos = 0;
+    out[0] = '\0';
+    for( size_t j = 0; j < size && pos + 7 < out_size; ++j )
+        pos += snprintf(&out[pos], out_size - pos, "0x%02x, ", data[j]);
+    return out;
+}
+
+uint64_t stream_ntp_time(int64_t monotonic_ns) {
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    int64_t real_ns = monotonic_ns + (real.tv_sec - mono.tv_sec) * 1000000000LL + (real.tv_nsec - mono.tv_nsec);
+    uint64_t seconds = real_ns / 1000000000 + NTP_UNIX_OFFSET;
+    uint64_t fraction = ((uint64_t)(real_ns % 1000000000) << 32) / 1000000000;
+    return seconds << 32 | fraction;
+}
+
+void stream_header(uint8_t *header_buff, uint32_t payload_size, enum stream_payload type, uint64_t ntp_ts) {
+    // Clean buffer
+    memset(header_buff, 0x00, STREAM_HEADER_SIZE);
+
+    writeUInt32LE(header_buff, 0, payload_size); // 4 bytes Payload size
+    writeUInt16LE(header_buff, 4, type); // 2 bytes Payload type
+    writeUInt16LE(header_buff, 6, type == STREAM_HEART_BEAT ? 0x1e : 0x06 ); // 2 bytes Payload option (0x1e on heartbeat)
+
+    if( type == STREAM_HEART_BEAT )
+        return;
+
+    // Presentation time the receiver schedules the playout by
+    writeUInt32LE(header_buff, 8, ntp_ts & 0xffffffff); // 4 bytes NTP Timestamp fraction
+    writeUInt32LE(header_buff, 12, ntp_ts >> 32); // 4 bytes NTP Timestamp seconds
+
+    // Write source screen WxH if type VIDEO_CODEC
+    if( type == STREAM_VIDEO_CODEC ) {
+        writeFloat32LE(header_buff, 16, RECEIVER_WIDTH); // 4 bytes Source screen width
+        writeFloat32LE(header_buff, 20, RECEIVER_HEIGHT); // 4 bytes Source screen height
+    }
+
+    writeFloat32LE(header_buff, 40, RECEIVER_WIDTH); // 4 bytes Source screen width
+    writeFloat32LE(header_buff, 44, RECEIVER_HEIGHT); // 4 bytes Source screen height
+
+    // 48 byte - float (REAL_SCREEN_WIDTH - SENT_SCREEN_WIDTH)/2
+    // Probably to add black boxes and center the picture horizontally
+    writeFloat32LE(header_buff, 48, 0.0f);
+    // 52 byte - float (REAL_SCREEN_HEIGHT - SENT_SCREEN_HEIGHT)/2
+    // Probably to add black boxes and center the picture vertically
+    writeFloat32LE(header_buff, 52, 0.0f);
+
+    // Send the supported picture size
+    writeFloat32LE(header_buff, 56, RECEIVER_WIDTH); // 4 bytes Supported screen width
+    writeFloat32LE(header_buff, 60, RECEIVER_HEIGHT); // 4 bytes Supported screen height
+}
+
+size_t stream_find_start_code(const uint8_t *p, size_t left_size) {
+    int counter = 0;
+    for( size_t i = 0; i < left_size; ++i ) {
+        if( p[i] == 0 )
+            counter++;
+        else if( counter == 3 && p[i] == 1 ) {
+            return i+1;
+        } else
+            counter = 0;
+    }
+    return -1;
+}
+
+ssize_t stream_annexb_to_avcc(uint8_t *data, size_t size) {
+    uint8_t *pd = data;
+    size_t ps = size;
+    size_t pos_data = stream_find_start_code(pd, ps);
+    if( -1 == pos_data )
+        return -1;
+    size_t first_nalu = pos_data - 4; // To cut avcodec comments
+    while( -1 != pos_data ) {
+        size_t nalu_len;
+        pd = &pd[pos_data];
+        ps = ps - pos_data;
+        size_t pos_data2 = stream_find_start_code(pd, ps);
+        if( -1 == pos_data2 ) {
+            nalu_len = ps;
+        } else {
+            // Minus 4 because the position is at the end of the start code
+            nalu_len = pos_data2 - 4;
+        }
+        // BE size of the nalu buffer
+        pd[-1] = (uint8_t) nalu_len & 0xff;
+        pd[-2] = (uint8_t) (nalu_len >> 8) & 0xff;
+        pd[-3] = (uint8_t) (nalu_len >> 16) & 0xff;
+        pd[-4] = (uint8_t) (nalu_len >> 24) & 0xff;
+        pos_data = pos_data2;
+    }
+    return first_nalu;
+}
+
+ssize_t stream_request_plist(uint8_t *out, size_t size, const char *device_id, int latency_ms, int64_t session_id) {
+    static const char *const fps_info[] = { "SubS", "B4En", "EnDp", "IdEn", "IdDp", "EQDp", "QueF", "Sent" };
+    static const char *const timestamp_info[] = { "SubSu", "BePxT", "AfPxt", "BefEn", "EmEnc", "QueFr", "SndFr" };
+    int refs[8];
+    int keys[6], values[6];
+    struct bplist p;
+    bplist_init(&p, out, size);
+
+    keys[0] = bplist_add_string(&p, "deviceID");
+    values[0] = bplist_add_string(&p, device_id);
+    // Receiver keeps that much video buffered before the playout
+    keys[1] = bplist_add_string(&p, "latencyMs");
+    values[1] = bplist_add_int(&p, latency_ms);
+    keys[2] = bplist_add_string(&p, "sessionID");
+    values[2] = bplist_add_int(&p, session_id);
+    keys[3] = bplist_add_string(&p, "version");
+    values[3] = bplist_add_string(&p, "150.33");
+    keys[4] = bplist_add_string(&p, "fpsInfo");
+    for( int i = 0; i < 8; i++ )
+        refs[i] = bplist_add_string(&p, fps_info[i]);
+    values[4] = bplist_add_array(&p, refs, 8);
+    keys[5] = bplist_add_string(&p, "timestampInfo");
+    for( int i = 0; i < 7; i++ )
+        refs[i] = bplist_add_string(&p, timestamp_info[i]);
+    values[5] = bplist_add_array(&p, refs, 7);
+    bplist_add_dict(&p, keys, values, 6);
+    return bplist_finish(&p);
+}
+
+ssize_t stream_avcc_config(uint8_t *avcc_buff, size_t out_size, const uint8_t *extradata, size_t extradata_size) {
+    // Read extradata annexb
+    size_t pos_sps = stream_find_start_code(extradata, extradata_size);
+    if( -1 == pos_sps ) {
+        LOG_ERROR("No SPS in the codec data");
+        return -1;
+    }
+    size_t pos_pps = stream_find_start_code(&extradata[pos_sps], extradata_size - pos_sps);
+    if( -1 == pos_pps ) {
+        LOG_ERROR("No PPS in the codec data");
+        return -1;
+    }
+    pos_pps += pos_sps;
+    const uint8_t *sps = &extradata[pos_sps];
+    const uint8_t *pps = &extradata[pos_pps];
+    size_t sps_size = pos_pps - pos_sps - 4;
+    size_t pps_size = extradata_size - pos_pps;
+    char hex[200];
+    LOG_DEBUG("Found sps: %ld, size: %ld: %s", pos_sps, sps_size, hexDump(sps, sps_size, hex, sizeof(hex)));
+    LOG_DEBUG("Found pps: %ld, size: %ld: %s", pos_pps, pps_size, hexDump(pps, pps_size, hex, sizeof(hex)));
+
+    size_t next = stream_find_start_code(pps, pps_size);
+    if( -1 != next ) {
+        LOG_ERROR("Found another nalu, it should not be here: %ld", next);
+        return -1;
+    }
+    if( sps_size < 4 || sps_size > UINT16_MAX || pps_size > UINT16_MAX || 11 + sps_size + pps_size > out_size ) {
+        LOG_ERROR("Wrong codec data sizes: sps %ld, pps %ld", sps_size, pps_size);
+        return -1;
+    }
+
+    // Send codec data in avcc format
+    avcc_buff[0] = 0x01;  // version
+    avcc_buff[1] = sps[1]; // SPS profile
+    avcc_buff[2] = sps[2]; // SPS compatibility
+    avcc_buff[3] = sps[3]; // SPS level
+    avcc_buff[4] = 0xFC | 3; // reserved (6 bits), NULA length size - 1 (2 bits)
+    avcc_buff[5] = 0xE0 | 1; // reserved (3 bits), num of SPS (5 bits)
+    writeUInt16BE(avcc_buff, 6, sps_size); // 2 bytes for length of SPS in BE
+    memcpy(&avcc_buff[8], sps, sps_size); // data of SPS
+
+    size_t pps_begin = 8+sps_size;
+    avcc_buff[pps_begin] = 0x01;  // num of PPS
+    writeUInt16BE(avcc_buff, pps_begin+1, pps_size);  // 2 bytes for length of PPS in BE
+    memcpy(&avcc_buff[pps_begin+3], pps, pps_size); // data of PPS
+
+    return pps_begin+3+pps_size;
+}
+
+// SEI messages are type & size coded by the 0xff runs
+static bool seiRecoveryPoint(const uint8_t *sei, size_t size) {
+    size_t pos = 1;
+    while( pos < size && sei[pos] != 0x80 ) {
+        unsigned int type = 0, len = 0;
+        while( pos < size && sei[pos] == 0xff )
+            type += sei[pos++];
+        if( pos >= size )
+            return false;
+        type += sei[pos++];
+        while( pos < size && sei[pos] == 0xff )
+            len += sei[pos++];
+        if( pos >= size )
+            return false;
+        len += sei[pos++];
+        if( type == 6 )
+            return true;
+        pos += len;
+    }
+    return false;
+}
+
+bool stream_avcc_keyframe(const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    while( pos + 5 <= size ) {
+        size_t nalu_len = (size_t)data[pos] << 24 | data[pos+1] << 16 | data[pos+2] << 8 | data[pos+3];
+        pos += 4;
+        if( nalu_len == 0 || nalu_len > size - pos )
+            return false;
+        int nalu_type = data[pos] & 0x1f;
+        if( nalu_type == 5 || (nalu_type == 6 && seiRecoveryPoint(&data[pos], nalu_len)) )
+            return true;
+        pos += nalu_len;
+    }
+    return false;
+}
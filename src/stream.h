@@ -0,0 +1,45 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// AirPlay 1.0 mirroring stream: every payload follows the 128 bytes header,
+// H.264 goes as avcC codec data & NALUs prefixed by their sizes (AVCC)
+#define STREAM_HEADER_SIZE 128
+
+// Screen size supported by the receiver (could be gotten from "GET /stream.xml HTTP/1.1")
+#define RECEIVER_WIDTH 1920
+#define RECEIVER_HEIGHT 1080
+
+enum stream_payload {
+    STREAM_VIDEO_DATA = 0x00,
+    STREAM_VIDEO_CODEC = 0x01,
+    STREAM_HEART_BEAT = 0x02,
+};
+
+// NTP 32.32 wall clock time (seconds since 1900) of the monotonic time
+uint64_t stream_ntp_time(int64_t monotonic_ns);
+
+// Payload header with the presentation time (not used for heartbeats)
+void stream_header(uint8_t *header, uint32_t payload_size, enum stream_payload type, uint64_t ntp_ts);
+
+// Position right after the next 00 00 00 01 start code, or -1
+size_t stream_find_start_code(const uint8_t *data, size_t size);
+
+// Replaces the Annex B start codes of the encoded frame by the NALU sizes in place.
+// Returns the offset the AVCC payload starts at, or -1 if there is no start code.
+ssize_t stream_annexb_to_avcc(uint8_t *data, size_t size);
+
+// Binary plist body of the POST /stream request, returns its size or -1 if it doesn't fit
+ssize_t stream_request_plist(uint8_t *out, size_t size, const char *device_id, int latency_ms, int64_t session_id);
+
+// avcC record of the Annex B extradata with SPS & PPS, returns its size or -1
+ssize_t stream_avcc_config(uint8_t *out, size_t out_size, const uint8_t *extradata, size_t extradata_size);
+
+// AVCC frame the decoder could start from: IDR or the recovery point SEI of intra refresh
+bool stream_avcc_keyframe(const uint8_t *data, size_t size);
+
+#endif // STREAM_H
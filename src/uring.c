@@ -0,0 +1,353 @@
+#define _GNU_SOURCE /* for syscall */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+#include "log.h"
+
+// user_data of the completion: write index & which of its operations completed
+#define URING_OP_SEND 0
+#define URING_OP_TIMEOUT 3
+#define URING_USER_DATA(index, op) ((uint64_t)(index) << 2 | (op))
+
+static int uringSetup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Sends, linked timeouts & the writes at the file position are needed, the kernel
+// could be older than the header
+static bool probeOps(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if( !probe )
+        return false;
+    bool supported = false;
+    if( uringRegister(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 ) {
+        static const int ops[] = { IORING_OP_SENDMSG, IORING_OP_LINK_TIMEOUT, IORING_OP_WRITE, IORING_OP_WRITE_FIXED };
+        supported = true;
+        for( size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++ ) {
+            if( ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) )
+                supported = false;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+struct uring *uring_new(unsigned int entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Completions are processed by the waiting submitter, without interrupting it before
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    int fd = uringSetup(entries, &p);
+    if( fd < 0 && errno == EINVAL ) {
+        memset(&p, 0, sizeof(p));
+        fd = uringSetup(entries, &p);
+    }
+    if( fd < 0 ) {
+        LOG_WARN("io_uring is not available, using send(): %m");
+        return NULL;
+    }
+    if( !(p.features & IORING_FEAT_RW_CUR_POS) || !(p.features & IORING_FEAT_NODROP) || !probeOps(fd) ) {
+        LOG_WARN("io_uring of the kernel is too old, using send()");
+        close(fd);
+        return NULL;
+    }
+
+    struct uring *u = calloc(1, sizeof(struct uring));
+    if( !u ) {
+        close(fd);
+        return NULL;
+    }
+    u->fd = fd;
+    u->sq_entries = p.sq_entries;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        if( u->cq_ring_size > u->sq_ring_size )
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring;
+    if( u->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP) )
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if( u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED ) {
+        LOG_WARN("Unable to map io_uring, using send(): %m");
+        uring_free(u);
+        return NULL;
+    }
+    uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head_ptr = (unsigned int *)&sq[p.sq_off.head];
+    u->sq_tail_ptr = (unsigned int *)&sq[p.sq_off.tail];
+    u->sq_mask = (unsigned int *)&sq[p.sq_off.ring_mask];
+    u->sq_array = (unsigned int *)&sq[p.sq_off.array];
+    u->cq_head_ptr = (unsigned int *)&cq[p.cq_off.head];
+    u->cq_tail_ptr = (unsigned int *)&cq[p.cq_off.tail];
+    u->cq_mask = (unsigned int *)&cq[p.cq_off.ring_mask];
+    u->cqes = (struct io_uring_cqe *)&cq[p.cq_off.cqes];
+    u->sq_tail = *u->sq_tail_ptr;
+
+    // Empty table, the buffers are put to it as they are allocated
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = URING_BUFFERS_MAX;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    u->fixed = uringRegister(fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+    if( !u->fixed )
+        LOG_DEBUG("io_uring registered buffers are not supported: %m");
+    return u;
+}
+
+void uring_free(struct uring *u) {
+    if( !u )
+        return;
+    if( u->sqes && u->sqes != MAP_FAILED )
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    if( u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring )
+        munmap(u->cq_ring, u->cq_ring_size);
+    if( u->sq_ring && u->sq_ring != MAP_FAILED )
+        munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    free(u);
+}
+
+static int updateBuffer(struct uring *u, int slot, const void *addr, size_t len) {
+    struct iovec iov = { (void *)addr, len };
+    struct io_uring_rsrc_update2 update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.data = (uintptr_t)&iov;
+    update.nr = 1;
+    return uringRegister(u->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0 ? -1 : 0;
+}
+
+int uring_register_buffer(struct uring *u, const void *addr, size_t len) {
+    if( !u->fixed )
+        return -1;
+    for( int i = 0; i < URING_BUFFERS_MAX; i++ ) {
+        if( u->buffers[i].addr )
+            continue;
+        if( updateBuffer(u, i, addr, len) < 0 ) {
+            LOG_DEBUG("Unable to register %zu bytes io_uring buffer: %m", len);
+            return -1;
+        }
+        u->buffers[i].addr = addr;
+        u->buffers[i].len = len;
+        return 0;
+    }
+    return -1;
+}
+
+void uring_unregister_buffer(struct uring *u, const void *addr) {
+    for( int i = 0; i < URING_BUFFERS_MAX; i++ ) {
+        if( u->buffers[i].addr != addr )
+            continue;
+        updateBuffer(u, i, NULL, 0);
+        u->buffers[i].addr = NULL;
+        u->buffers[i].len = 0;
+        return;
+    }
+}
+
+// Slot of the registered buffer containing the data, or -1
+static int findBuffer(struct uring *u, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for( int i = 0; i < URING_BUFFERS_MAX; i++ ) {
+        if( u->buffers[i].addr && p >= u->buffers[i].addr && p + len <= u->buffers[i].addr + u->buffers[i].len )
+            return i;
+    }
+    return -1;
+}
+
+static struct io_uring_sqe *getSqe(struct uring *u) {
+    unsigned int head = atomic_load_explicit((_Atomic unsigned int *)u->sq_head_ptr, memory_order_acquire);
+    if( u->sq_tail - head >= u->sq_entries )
+        return NULL;
+    unsigned int index = u->sq_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sq_tail++;
+    return sqe;
+}
+
+static size_t writeSize(const struct uring_write *w) {
+    size_t size = 0;
+    for( int i = 0; i < w->iovcnt; i++ )
+        size += w->iov[i].iov_len;
+    return size;
+}
+
+// Rest of the iovecs after the written bytes
+static int leftIovecs(struct uring_write *w) {
+    size_t skip = w->done;
+    int count = 0;
+    for( int i = 0; i < w->iovcnt; i++ ) {
+        if( skip >= w->iov[i].iov_len ) {
+            skip -= w->iov[i].iov_len;
+            continue;
+        }
+        w->left[count].iov_base = (uint8_t *)w->iov[i].iov_base + skip;
+        w->left[count].iov_len = w->iov[i].iov_len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+// Operations of the write for this round: send & its timeout, or the linked file writes
+static unsigned int prepWrite(struct uring *u, struct uring_write *w, unsigned int index,
+        const struct __kernel_timespec *timeout) {
+    int count = leftIovecs(w);
+    w->round_short = false;
+    if( w->socket ) {
+        struct io_uring_sqe *send = getSqe(u);
+        struct io_uring_sqe *expire = getSqe(u);
+        memset(&w->msg, 0, sizeof(w->msg));
+        w->msg.msg_iov = w->left;
+        w->msg.msg_iovlen = count;
+        send->opcode = IORING_OP_SENDMSG;
+        send->fd = w->fd;
+        send->addr = (uintptr_t)&w->msg;
+        send->len = 1;
+        // Without SIGPIPE if the device is gone, it's handled as an error
+        send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        send->flags = IOSQE_IO_LINK;
+        send->user_data = URING_USER_DATA(index, URING_OP_SEND);
+        expire->opcode = IORING_OP_LINK_TIMEOUT;
+        expire->fd = -1;
+        expire->addr = (uintptr_t)timeout;
+        expire->len = 1;
+        expire->user_data = URING_USER_DATA(index, URING_OP_TIMEOUT);
+        return 2;
+    }
+    // File position moves by every write, the link keeps them in order
+    for( int i = 0; i < count; i++ ) {
+        struct io_uring_sqe *write = getSqe(u);
+        int slot = findBuffer(u, w->left[i].iov_base, w->left[i].iov_len);
+        write->opcode = slot >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        write->buf_index = slot >= 0 ? slot : 0;
+        write->fd = w->fd;
+        write->addr = (uintptr_t)w->left[i].iov_base;
+        write->len = w->left[i].iov_len;
+        write->off = -1;
+        write->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+        write->user_data = URING_USER_DATA(index, i + 1);
+        w->round_len[i] = w->left[i].iov_len;
+    }
+    return count;
+}
+
+static void complete(struct uring *u, struct uring_write *writes, const struct io_uring_cqe *cqe) {
+    unsigned int op = cqe->user_data & 3;
+    if( op == URING_OP_TIMEOUT )
+        return;
+    struct uring_write *w = &writes[cqe->user_data >> 2];
+    if( w->socket ) {
+        if( cqe->res > 0 )
+            w->done += cqe->res;
+        // Send is canceled by its timeout, like the blocked send() is failed by SO_SNDTIMEO
+        else if( cqe->res == -ECANCELED )
+            w->error = EAGAIN;
+        else if( cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN )
+            w->error = -cqe->res;
+        return;
+    }
+    // Writes after the short one are canceled by the link, continued by the next round
+    if( w->round_short )
+        return;
+    if( cqe->res < 0 ) {
+        if( cqe->res != -EINTR && cqe->res != -EAGAIN )
+            w->error = -cqe->res;
+        w->round_short = true;
+        return;
+    }
+    w->done += cqe->res;
+    if( (size_t)cqe->res < w->round_len[op - 1] )
+        w->round_short = true;
+}
+
+int uring_write_all(struct uring *u, struct uring_write *writes, unsigned int count, int timeout_ms) {
+    struct __kernel_timespec timeout = { timeout_ms / 1000, timeout_ms % 1000 * 1000000LL };
+    for( unsigned int i = 0; i < count; i++ ) {
+        writes[i].done = 0;
+        writes[i].error = 0;
+        writes[i].in_round = false;
+    }
+
+    unsigned int next = 0;
+    for( ;; ) {
+        // Round of the writes left, as many as the ring takes (it's empty in between)
+        unsigned int ops = 0;
+        for( unsigned int n = 0; n < count; n++, next = (next + 1) % count ) {
+            struct uring_write *w = &writes[next];
+            if( w->error || w->done >= writeSize(w) )
+                continue;
+            if( ops + (w->socket ? 2 : w->iovcnt) > u->sq_entries )
+                break;
+            if( w->done > 0 )
+                u->short_writes++;
+            w->round_start = w->done;
+            w->in_round = true;
+            ops += prepWrite(u, w, next, &timeout);
+            u->submitted++;
+        }
+        if( ops == 0 )
+            return 0;
+        atomic_store_explicit((_Atomic unsigned int *)u->sq_tail_ptr, u->sq_tail, memory_order_release);
+
+        // Submitted & waited by one syscall, unless it's interrupted
+        unsigned int to_submit = ops;
+        unsigned int completed = 0;
+        while( completed < ops ) {
+            u->enters++;
+            int ret = uringEnter(u->fd, to_submit, ops - completed, IORING_ENTER_GETEVENTS);
+            if( ret < 0 && errno != EINTR ) {
+                LOG_ERROR("io_uring_enter failed: %m");
+                return -1;
+            }
+            if( ret > 0 )
+                to_submit -= MIN((unsigned int)ret, to_submit);
+            unsigned int head = *u->cq_head_ptr;
+            unsigned int tail = atomic_load_explicit((_Atomic unsigned int *)u->cq_tail_ptr, memory_order_acquire);
+            for( ; head != tail; head++, completed++ )
+                complete(u, writes, &u->cqes[head & *u->cq_mask]);
+            atomic_store_explicit((_Atomic unsigned int *)u->cq_head_ptr, head, memory_order_release);
+        }
+        // Round where none of its writes wrote or failed (zero bytes writes) would be
+        // repeated forever
+        bool progressed = false;
+        for( unsigned int i = 0; i < count; i++ ) {
+            struct uring_write *w = &writes[i];
+            if( !w->in_round )
+                continue;
+            w->in_round = false;
+            progressed = progressed || w->error || w->done > w->round_start;
+        }
+        if( !progressed ) {
+            LOG_ERROR("io_uring writes don't progress");
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Send with its timeout per socket, up to two writes per file for every frame
+#define URING_ENTRIES 512
+// Slots of the registered buffers: packet pool & header (sparse table updated on allocation)
+#define URING_BUFFERS_MAX 64
+
+// Header & payload written to the socket or file, continued after the short writes
+struct uring_write {
+    int fd;
+    bool socket;                   // sent with the timeout, written at the file position otherwise
+    struct iovec iov[2];
+    int iovcnt;
+    // Result: bytes written and errno of the failed write (0 if everything is written)
+    size_t done;
+    int error;
+    // State of the submitted round
+    struct msghdr msg;
+    struct iovec left[2];
+    size_t round_len[2];
+    size_t round_start;            // done when the round was submitted
+    bool round_short;
+    bool in_round;
+};
+
+// io_uring of the session: the frame goes to all the receivers & files by one syscall,
+// which waits for them as well. Used under the session lock.
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int sq_tail;
+    unsigned int *sq_head_ptr, *sq_tail_ptr, *sq_mask, *sq_array;
+    unsigned int *cq_head_ptr, *cq_tail_ptr, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    bool fixed;                    // registered buffers are supported
+    struct {
+        const uint8_t *addr;
+        size_t len;
+    } buffers[URING_BUFFERS_MAX];
+
+    uint64_t enters;               // io_uring_enter syscalls
+    uint64_t submitted;            // writes & sends
+    uint64_t short_writes;         // continued by the next round
+};
+
+// NULL if io_uring isn't available (old kernel, seccomp or io_uring_disabled sysctl),
+// the classic send() & fwrite() path is used then
+struct uring *uring_new(unsigned int entries);
+void uring_free(struct uring *u);
+
+// Registered buffer is written without mapping its pages on every write. Returns -1
+// if there is no slot or the pages can't be pinned (RLIMIT_MEMLOCK), it's written as usual then.
+int uring_register_buffer(struct uring *u, const void *addr, size_t len);
+void uring_unregister_buffer(struct uring *u, const void *addr);
+
+// Submits all the writes at once and waits until everything is written or failed,
+// the socket send is failed with EAGAIN if it doesn't progress for timeout_ms.
+// Returns -1 if the ring failed (the results are not set).
+int uring_write_all(struct uring *u, struct uring_write *writes, unsigned int count, int timeout_ms);
+
+#endif // URING_H
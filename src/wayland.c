@@ -0,0 +1,273 @@
+// memfd_create
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <wayland-client.h>
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+
+#include <libavutil/pixdesc.h>
+
+#include "wayland.h"
+#include "convert.h"
+#include "log.h"
+#include "realtime.h"
+
+// Version 3 offers all the buffer types before the copy
+#define SCREENCOPY_VERSION 3
+#define SHM_FORMATS_MAX 64
+#define SHM_COST_UNMEASURED INT64_MIN
+
+static struct wayland wl;
+static struct wl_registry *registry = NULL;
+static unsigned int refs = 0;
+
+// Formats advertised by wl_shm with the conversion cost in nsec (-1 - unsupported),
+// measured with the size of the first capture offered the format. Shared by the capture
+// threads of the sessions.
+static struct {
+    uint32_t format;
+    int64_t cost;
+} shm_formats[SHM_FORMATS_MAX];
+static int shm_formats_count = 0;
+static pthread_mutex_t shm_formats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum AVPixelFormat wayland_shm_pixfmt(uint32_t fmt) {
+    switch (fmt) {
+    case WL_SHM_FORMAT_NV12: return AV_PIX_FMT_NV12;
+    case WL_SHM_FORMAT_ARGB8888: return AV_PIX_FMT_BGRA;
+    case WL_SHM_FORMAT_XRGB8888: return AV_PIX_FMT_BGR0;
+    case WL_SHM_FORMAT_ABGR8888: return AV_PIX_FMT_RGBA;
+    case WL_SHM_FORMAT_XBGR8888: return AV_PIX_FMT_RGB0;
+    case WL_SHM_FORMAT_RGBA8888: return AV_PIX_FMT_ABGR;
+    case WL_SHM_FORMAT_RGBX8888: return AV_PIX_FMT_0BGR;
+    case WL_SHM_FORMAT_BGRA8888: return AV_PIX_FMT_ARGB;
+    case WL_SHM_FORMAT_BGRX8888: return AV_PIX_FMT_0RGB;
+    default: return AV_PIX_FMT_NONE;
+    };
+}
+
+// Measures conversion of the format once, only the formats offered for the capture are
+// measured instead of everything wl_shm advertises
+static void measureFormatCost(int i, int width, int height) {
+    enum AVPixelFormat pix_fmt = wayland_shm_pixfmt(shm_formats[i].format);
+    shm_formats[i].cost = convert_cost(pix_fmt, width, height);
+    if( pix_fmt == AV_PIX_FMT_NONE )
+        LOG_DEBUG("Conversion of shm format 0x%08x: not supported", shm_formats[i].format);
+    else if( shm_formats[i].cost < 0 )
+        LOG_INFO("Conversion of %s: not supported", av_get_pix_fmt_name(pix_fmt));
+    else
+        LOG_INFO("Conversion of %dx%d %s -> %s: %.3f ms%s", width, height, av_get_pix_fmt_name(pix_fmt),
+            av_get_pix_fmt_name(convert_target_format(pix_fmt)), shm_formats[i].cost / 1000000.0,
+            pix_fmt == convert_target_format(pix_fmt) ? " (copy)" : "");
+}
+
+int64_t wayland_format_cost(uint32_t fmt, int width, int height) {
+    pthread_mutex_lock(&shm_formats_lock);
+    for( int i = 0; i < shm_formats_count; i++ ) {
+        if( shm_formats[i].format != fmt )
+            continue;
+        if( shm_formats[i].cost == SHM_COST_UNMEASURED )
+            measureFormatCost(i, width, height);
+        int64_t cost = shm_formats[i].cost < 0 ? INT64_MAX : shm_formats[i].cost;
+        pthread_mutex_unlock(&shm_formats_lock);
+        return cost;
+    }
+    pthread_mutex_unlock(&shm_formats_lock);
+    // Offered, but not advertised by wl_shm, could be used only if nothing better
+    return wayland_shm_pixfmt(fmt) == AV_PIX_FMT_NONE ? INT64_MAX : INT64_MAX - 1;
+}
+
+// NV12 chroma plane follows the luma one with the same stride
+static size_t shmBufferSize(uint32_t fmt, int height, int stride) {
+    size_t size = (size_t)stride * height;
+    if( fmt == WL_SHM_FORMAT_NV12 )
+        size += (size_t)stride * ((height + 1) / 2);
+    return size;
+}
+
+struct wl_buffer *wayland_create_shm_buffer(uint32_t fmt, int width, int height, int stride,
+        size_t *size_out, void **data_out) {
+
+    // Anonymous file, so the capture threads of the sessions don't race for the name
+    int fd = memfd_create("wlroots-airplay-shm", MFD_CLOEXEC);
+    if( fd < 0 ) {
+        LOG_ERROR("memfd_create failed: %m");
+        return NULL;
+    }
+
+    size_t size = shmBufferSize(fmt, height, stride);
+    int ret;
+    while( (ret = ftruncate(fd, size)) == EINTR ) {
+        // No-op
+    }
+    if( ret < 0 ) {
+        close(fd);
+        LOG_ERROR("ftruncate failed");
+        return NULL;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if( data == MAP_FAILED ) {
+        LOG_ERROR("mmap failed: %m");
+        close(fd);
+        return NULL;
+    }
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(wl.shm, fd, size);
+    close(fd);
+    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
+        stride, fmt);
+    wl_shm_pool_destroy(pool);
+
+    realtime_lock(data, size);
+    *size_out = size;
+    *data_out = data;
+    return buffer;
+}
+
+int wayland_dispatch_timeout(struct wl_event_queue *queue, int interrupt_fd, int timeout_ms) {
+    struct wl_display *display = wl.display;
+    // Events already read by another source thread are only dispatched
+    if( wl_display_prepare_read_queue(display, queue) != 0 )
+        return wl_display_dispatch_queue_pending(display, queue) < 0 ? -1 : 1;
+    if( wl_display_flush(display) < 0 && errno != EAGAIN ) {
+        wl_display_cancel_read(display);
+        LOG_ERROR("wayland connection failed: %m");
+        return -1;
+    }
+
+    struct pollfd fds[2] = { { wl_display_get_fd(display), POLLIN, 0 }, { interrupt_fd, POLLIN, 0 } };
+    int ret;
+    while( (ret = poll(fds, 2, timeout_ms)) < 0 && errno == EINTR ) {
+        // Interrupted by signal
+    }
+    if( ret <= 0 || !fds[0].revents ) {
+        wl_display_cancel_read(display);
+        if( ret < 0 )
+            LOG_ERROR("wayland connection poll failed: %m");
+        return ret < 0 || fds[1].revents ? -1 : 0;
+    }
+    if( wl_display_read_events(display) < 0 || wl_display_dispatch_queue_pending(display, queue) < 0 ) {
+        LOG_ERROR("wayland connection failed: %m");
+        return -1;
+    }
+    return 1;
+}
+
+void wayland_destroy_shm_buffer(struct wl_buffer *buffer, void *data, size_t size) {
+    if( !buffer )
+        return;
+    wl_buffer_destroy(buffer);
+    realtime_unlock(data, size);
+    munmap(data, size);
+}
+
+static void shm_handle_format(void *data, struct wl_shm *wl_shm, uint32_t format) {
+    pthread_mutex_lock(&shm_formats_lock);
+    if( shm_formats_count < SHM_FORMATS_MAX ) {
+        shm_formats[shm_formats_count].format = format;
+        shm_formats[shm_formats_count++].cost = SHM_COST_UNMEASURED;
+    }
+    pthread_mutex_unlock(&shm_formats_lock);
+}
+
+static const struct wl_shm_listener shm_listener = {
+    .format = shm_handle_format,
+};
+
+static void handle_global(void *data, struct wl_registry *registry,
+        uint32_t name, const char *interface, uint32_t version) {
+    if( strcmp(interface, wl_output_interface.name) == 0 ) {
+        if( wl.outputs_count < WAYLAND_OUTPUTS_MAX )
+            wl.outputs[wl.outputs_count++] = wl_registry_bind(registry, name, &wl_output_interface, 1);
+    } else if( strcmp(interface, wl_shm_interface.name) == 0 ) {
+        wl.shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+        wl_shm_add_listener(wl.shm, &shm_listener, NULL);
+    } else if( strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0 ) {
+        wl.screencopy_version = MIN(version, SCREENCOPY_VERSION);
+        wl.screencopy_manager = wl_registry_bind(registry, name,
+            &zwlr_screencopy_manager_v1_interface, wl.screencopy_version);
+    } else if( strcmp(interface, ext_image_copy_capture_manager_v1_interface.name) == 0 ) {
+        wl.copy_capture_manager = wl_registry_bind(registry, name,
+            &ext_image_copy_capture_manager_v1_interface, 1);
+    } else if( strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name) == 0 ) {
+        wl.output_source_manager = wl_registry_bind(registry, name,
+            &ext_output_image_capture_source_manager_v1_interface, 1);
+    }
+}
+
+static void handle_global_remove(void *data, struct wl_registry *registry,
+        uint32_t name) {
+    // Who cares?
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = handle_global,
+    .global_remove = handle_global_remove,
+};
+
+static void wlDisconnect() {
+    for( int i = 0; i < wl.outputs_count; i++ )
+        wl_output_destroy(wl.outputs[i]);
+    if( wl.screencopy_manager )
+        zwlr_screencopy_manager_v1_destroy(wl.screencopy_manager);
+    if( wl.copy_capture_manager )
+        ext_image_copy_capture_manager_v1_destroy(wl.copy_capture_manager);
+    if( wl.output_source_manager )
+        ext_output_image_capture_source_manager_v1_destroy(wl.output_source_manager);
+    if( wl.shm )
+        wl_shm_destroy(wl.shm);
+    if( registry )
+        wl_registry_destroy(registry);
+    registry = NULL;
+    wl_display_disconnect(wl.display);
+    memset(&wl, 0, sizeof(wl));
+    pthread_mutex_lock(&shm_formats_lock);
+    shm_formats_count = 0;
+    pthread_mutex_unlock(&shm_formats_lock);
+}
+
+static int wlConnect() {
+    wl.display = wl_display_connect(NULL);
+    if( wl.display == NULL ) {
+        LOG_ERROR("failed to create display: %m");
+        return -1;
+    }
+
+    registry = wl_display_get_registry(wl.display);
+    wl_registry_add_listener(registry, &registry_listener, NULL);
+    wl_display_dispatch(wl.display);
+    wl_display_roundtrip(wl.display);
+
+    if( wl.shm == NULL ) {
+        LOG_ERROR("compositor is missing wl_shm");
+        wlDisconnect();
+        return -1;
+    }
+    return 0;
+}
+
+struct wayland *wayland_acquire(void) {
+    if( refs == 0 && wlConnect() < 0 )
+        return NULL;
+    refs++;
+    return &wl;
+}
+
+void wayland_release(void) {
+    if( --refs == 0 )
+        wlDisconnect();
+}
@@ -0,0 +1,46 @@
+#ifndef WAYLAND_H
+#define WAYLAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-client.h>
+#include <libavutil/pixfmt.h>
+
+#define WAYLAND_OUTPUTS_MAX 16
+
+// Compositor connection shared by all the wayland capture sources
+struct wayland {
+    struct wl_display *display;
+    struct wl_shm *shm;
+    struct wl_output *outputs[WAYLAND_OUTPUTS_MAX];
+    int outputs_count;
+    // Capture protocols, NULL when not advertised
+    struct zwlr_screencopy_manager_v1 *screencopy_manager;
+    uint32_t screencopy_version;
+    struct ext_image_copy_capture_manager_v1 *copy_capture_manager;
+    struct ext_output_image_capture_source_manager_v1 *output_source_manager;
+};
+
+// Connects on the first call, every call must be paired with wayland_release
+struct wayland *wayland_acquire(void);
+void wayland_release(void);
+
+enum AVPixelFormat wayland_shm_pixfmt(uint32_t fmt);
+
+// Conversion cost of the shm format in nsec, INT64_MAX if unsupported.
+// Every advertised format is measured and shown on its first call, thread-safe.
+int64_t wayland_format_cost(uint32_t fmt, int width, int height);
+
+// Dispatches the events of the source queue waiting up to timeout_ms (-1 - no limit), the
+// wait is woken by the interrupt eventfd. Returns 1 if dispatched, 0 on timeout, -1 on error
+// or interrupt. Safe with the other source threads dispatching their queues.
+int wayland_dispatch_timeout(struct wl_event_queue *queue, int interrupt_fd, int timeout_ms);
+
+// Shm buffer with the NV12 chroma plane after the luma one, size is returned with the data
+struct wl_buffer *wayland_create_shm_buffer(uint32_t fmt, int width, int height, int stride,
+    size_t *size_out, void **data_out);
+void wayland_destroy_shm_buffer(struct wl_buffer *buffer, void *data, size_t size);
+
+#endif // WAYLAND_H
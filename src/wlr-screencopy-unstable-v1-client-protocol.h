@@ -85,8 +85,10 @@ extern const struct wl_interface zwlr_screencopy_manager_v1_interface;
  *
  * This object represents a single frame.
  *
- * When created, a "buffer" event will be sent. The client will then be able
- * to send a "copy" request. If the capture is successful, the compositor
+ * When created, a series of buffer events will be sent, each representing a
+ * supported buffer type. The "buffer_done" event is sent afterwards to
+ * indicate that all supported buffer types have been enumerated. The client
+ * will then be able to send a "copy" request. If the capture is successful, the compositor
  * will send a "flags" followed by a "ready" event.
  *
  * If the capture failed, the "failed" event is sent. This can happen anytime
@@ -102,8 +104,10 @@ extern const struct wl_interface zwlr_screencopy_manager_v1_interface;
  *
  * This object represents a single frame.
  *
- * When created, a "buffer" event will be sent. The client will then be able
- * to send a "copy" request. If the capture is successful, the compositor
+ * When created, a series of buffer events will be sent, each representing a
+ * supported buffer type. The "buffer_done" event is sent afterwards to
+ * indicate that all supported buffer types have been enumerated. The client
+ * will then be able to send a "copy" request. If the capture is successful, the compositor
  * will send a "flags" followed by a "ready" event.
  *
  * If the capture failed, the "failed" event is sent. This can happen anytime
@@ -233,13 +237,11 @@ enum zwlr_screencopy_frame_v1_flags {
  */
 struct zwlr_screencopy_frame_v1_listener {
 	/**
-	 * buffer information
+	 * wl_shm buffer information
 	 *
-	 * Provides information about the frame's buffer. This event is
-	 * sent once as soon as the frame is created.
-	 *
-	 * The client should then create a buffer with the provided
-	 * attributes, and send a "copy" request.
+	 * Provides information about wl_shm buffer parameters that need
+	 * to be used for this frame. This event is sent once after the
+	 * frame is created if wl_shm buffers are supported.
 	 * @param format buffer format
 	 * @param width buffer width
 	 * @param height buffer height
@@ -323,6 +325,34 @@ struct zwlr_screencopy_frame_v1_listener {
 		       uint32_t y,
 		       uint32_t width,
 		       uint32_t height);
+	/**
+	 * linux-dmabuf buffer information
+	 *
+	 * Provides information about linux-dmabuf buffer parameters that
+	 * need to be used for this frame. This event is sent once after
+	 * the frame is created if linux-dmabuf buffers are supported.
+	 * @param format fourcc pixel format
+	 * @param width buffer width
+	 * @param height buffer height
+	 * @since 3
+	 */
+	void (*linux_dmabuf)(void *data,
+			     struct zwlr_screencopy_frame_v1 *zwlr_screencopy_frame_v1,
+			     uint32_t format,
+			     uint32_t width,
+			     uint32_t height);
+	/**
+	 * all buffer types reported
+	 *
+	 * This event is sent once after all buffer events have been
+	 * sent.
+	 *
+	 * The client should proceed to create a buffer of one of the
+	 * supported types, and send a "copy" request.
+	 * @since 3
+	 */
+	void (*buffer_done)(void *data,
+			    struct zwlr_screencopy_frame_v1 *zwlr_screencopy_frame_v1);
 };
 
 /**
@@ -360,6 +390,14 @@ zwlr_screencopy_frame_v1_add_listener(struct zwlr_screencopy_frame_v1 *zwlr_scre
  * @ingroup iface_zwlr_screencopy_frame_v1
  */
 #define ZWLR_SCREENCOPY_FRAME_V1_DAMAGE_SINCE_VERSION 2
+/**
+ * @ingroup iface_zwlr_screencopy_frame_v1
+ */
+#define ZWLR_SCREENCOPY_FRAME_V1_LINUX_DMABUF_SINCE_VERSION 3
+/**
+ * @ingroup iface_zwlr_screencopy_frame_v1
+ */
+#define ZWLR_SCREENCOPY_FRAME_V1_BUFFER_DONE_SINCE_VERSION 3
 
 /**
  * @ingroup iface_zwlr_screencopy_frame_v1
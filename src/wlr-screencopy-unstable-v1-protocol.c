@@ -68,7 +68,7 @@ static const struct wl_message zwlr_screencopy_manager_v1_requests[] = {
 };
 
 WL_PRIVATE const struct wl_interface zwlr_screencopy_manager_v1_interface = {
-	"zwlr_screencopy_manager_v1", 2,
+	"zwlr_screencopy_manager_v1", 3,
 	3, zwlr_screencopy_manager_v1_requests,
 	0, NULL,
 };
@@ -85,11 +85,13 @@ static const struct wl_message zwlr_screencopy_frame_v1_events[] = {
 	{ "ready", "uuu", types + 0 },
 	{ "failed", "", types + 0 },
 	{ "damage", "2uuuu", types + 0 },
+	{ "linux_dmabuf", "3uuu", types + 0 },
+	{ "buffer_done", "3", types + 0 },
 };
 
 WL_PRIVATE const struct wl_interface zwlr_screencopy_frame_v1_interface = {
-	"zwlr_screencopy_frame_v1", 2,
+	"zwlr_screencopy_frame_v1", 3,
 	3, zwlr_screencopy_frame_v1_requests,
-	5, zwlr_screencopy_frame_v1_events,
+	7, zwlr_screencopy_frame_v1_events,
 };
 
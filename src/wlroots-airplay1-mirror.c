@@ -1,388 +1,394 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 
-#define _XOPEN_SOURCE 600 /* for usleep */
 #include <ctype.h>
-#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "capture.h"
+#include "latency.h"
+#include "receiver.h"
+#include "control.h"
+#include "log.h"
+#include "perf.h"
+#include "realtime.h"
+#include "relay.h"
+#include "session.h"
+#include "workers.h"
+
+#include <libavutil/log.h>
+#include <libavutil/opt.h>
 
-#include <wayland-client-protocol.h>
-#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#ifdef ALLOC_ACCOUNTING
+#define ALLOC_OPTSTRING "A"
+#else
+#define ALLOC_OPTSTRING ""
+#endif
 
-#include <libavcodec/avcodec.h>
-#include <libavutil/imgutils.h>
-#include <libavutil/opt.h>
-#include <libavutil/pixdesc.h>
-#include <libswscale/swscale.h>
-
-#include <sys/socket.h>
-#include <netinet/tcp.h>
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <errno.h>
-
-#include <sys/time.h>
-
-#define STREAM_FRAME_RATE 10
-#define STREAM_PIX_FMT    AV_PIX_FMT_YUV420P
-
-static int opt_output_num = 0;
-
-// Multiple output sockets to stream to multiple devices
-int output_sockets[255] = {};
-FILE *output_file = NULL;
-FILE *output_stdout = NULL;
-
-static struct AVCodecContext *enc_ctx = NULL;
-static struct SwsContext *sws_ctx = NULL;
-
-static struct wl_shm *shm = NULL;
-static struct zwlr_screencopy_manager_v1 *screencopy_manager = NULL;
-const char *output_name = NULL;
-static struct wl_output *output = NULL;
-
-static struct {
-    struct wl_buffer *wl_buffer;
-    void *data;
-    enum wl_shm_format format;
-    int width, height, stride;
-    bool y_invert;
-    uint64_t start_pts;
-    uint64_t pts;
-} buffer;
-bool buffer_copy_done = false;
-
-static struct wl_buffer *create_shm_buffer(int32_t fmt,
-        int width, int height, int stride, void **data_out) {
-    int size = stride * height;
-
-    const char shm_name[] = "/scrcpy-capture-wlroots-airplay1-mirror";
-    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-    if( fd < 0 ) {
-        fprintf(stderr, "ERROR: shm_open failed %d\n", fd);
+// Output -> receivers group pipelines running in parallel
+static struct session *sessions[SESSIONS_MAX];
+static unsigned int sessions_count = 0;
+
+// Commands apply to the session given as "@<index>" first argument, or to the first one
+static struct session *sessionArg(char **args, FILE *reply) {
+    unsigned int index = 0;
+    if( (*args)[0] == '@' ) {
+        char *end;
+        index = strtoul(&(*args)[1], &end, 10);
+        *args = end + strspn(end, " \t");
+    }
+    if( index >= sessions_count ) {
+        fprintf(reply, "Unknown session @%u\n", index);
         return NULL;
     }
-    shm_unlink(shm_name);
+    return sessions[index];
+}
 
-    int ret;
-    while( (ret = ftruncate(fd, size)) == EINTR ) {
-        // No-op
+static void statsSession(struct session *s, const char *prefix, FILE *reply) {
+    pthread_mutex_lock(&s->lock);
+    fprintf(reply, "%sfps %.1f\n", prefix, s->stats.fps);
+    fprintf(reply, "%spaused %d\n", prefix, s->paused);
+    fprintf(reply, "%sframes_captured %lu\n", prefix, s->stats.frames_captured);
+    fprintf(reply, "%sframes_encoded %lu\n", prefix, s->stats.frames_encoded);
+    fprintf(reply, "%sencoder_keyframes %lu\n", prefix, s->stats.keyframes);
+    fprintf(reply, "%sencoder_bytes %lu\n", prefix, s->stats.bytes_encoded);
+    fprintf(reply, "%sencoder_avg_frame_bytes %lu\n", prefix,
+        s->stats.frames_encoded ? s->stats.bytes_encoded / s->stats.frames_encoded : 0);
+    fprintf(reply, "%starget_fps %d\n", prefix, s->fps);
+    if( s->governor.min_fps > 0 ) {
+        fprintf(reply, "%sgovernor_fps %.1f\n", prefix, s->governor.fps);
+        fprintf(reply, "%sgovernor_activity %.2f\n", prefix, s->governor.level);
+        fprintf(reply, "%sgovernor_changes %lu\n", prefix, s->governor.changes);
     }
-    if( ret < 0 ) {
-        close(fd);
-        fprintf(stderr, "ERROR: ftruncate failed\n");
-        return NULL;
+    fprintf(reply, "%starget_crf %d\n", prefix, s->crf);
+    fprintf(reply, "%starget_max_bitrate %ld\n", prefix, s->max_bitrate);
+    if( s->frame_bytes > 0 ) {
+        fprintf(reply, "%starget_frame_bytes %ld\n", prefix, s->frame_bytes);
+        fprintf(reply, "%sencoder_frames_over_cap %lu\n", prefix, s->stats.frames_over_cap);
     }
-
-    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if( data == MAP_FAILED ) {
-        fprintf(stderr, "ERROR: mmap failed: %m\n");
-        close(fd);
-        return NULL;
+    fprintf(reply, "%sencoder_max_frame_bytes %lu\n", prefix, s->stats.max_frame_bytes);
+    fprintf(reply, "%starget_pacing %d\n", prefix, s->pacing);
+    if( s->config.roi_qp > 0 )
+        fprintf(reply, "%sroi_avg_changed_area %.3f\n", prefix,
+            s->stats.frames_encoded ? s->stats.roi_changed_area / s->stats.frames_encoded : 0.0);
+    if( s->replay ) {
+        fprintf(reply, "%sreplay_seconds %.1f\n", prefix, replay_seconds(s->replay));
+        fprintf(reply, "%sreplay_bytes %zu\n", prefix, replay_bytes(s->replay));
+        fprintf(reply, "%sreplay_frames_dropped %lu\n", prefix, s->replay->frames_dropped);
     }
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-    close(fd);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-        stride, fmt);
-    wl_shm_pool_destroy(pool);
-
-    *data_out = data;
-    return buffer;
+    if( s->uring ) {
+        fprintf(reply, "%sio_uring_submissions %lu\n", prefix, s->uring->enters);
+        fprintf(reply, "%sio_uring_writes %lu\n", prefix, s->uring->submitted);
+        fprintf(reply, "%sio_uring_short_writes %lu\n", prefix, s->uring->short_writes);
+    }
+    fprintf(reply, "%sreceivers %u\n", prefix, s->receivers_count);
+    for( unsigned int i = 0; i < s->receivers_count; i++ ) {
+        struct receiver *r = s->receivers[i];
+        fprintf(reply, "%sreceiver.%u.address %s\n", prefix, i, r->address);
+        fprintf(reply, "%sreceiver.%u.state %s\n", prefix, i,
+            r->state == RECEIVER_UP ? "up" : r->state == RECEIVER_DOWN ? "down" : "reconnecting");
+        fprintf(reply, "%sreceiver.%u.reconnects %lu\n", prefix, i, r->reconnects);
+        fprintf(reply, "%sreceiver.%u.bytes_sent %lu\n", prefix, i, r->bytes_sent);
+        fprintf(reply, "%sreceiver.%u.frames_sent %lu\n", prefix, i, r->frames_sent);
+        fprintf(reply, "%sreceiver.%u.frames_dropped %lu\n", prefix, i, r->frames_dropped);
+        fprintf(reply, "%sreceiver.%u.queue_bytes %d\n", prefix, i, receiver_queued_bytes(r));
+        fprintf(reply, "%sreceiver.%u.max_burst_bytes %lu\n", prefix, i, r->max_burst_bytes);
+        fprintf(reply, "%sreceiver.%u.pacing_rate %lu\n", prefix, i, r->pacing_rate * 8UL);
+        fprintf(reply, "%sreceiver.%u.pacing_backlog_max %lu\n", prefix, i, r->pacing_backlog_max);
+        fprintf(reply, "%sreceiver.%u.delivery_rate %lu\n", prefix, i, receiver_delivery_rate(r) * 8);
+        fprintf(reply, "%sreceiver.%u.connect_ms %.1f\n", prefix, i, (r->connected_ts - r->connect_ts) / 1000000.0);
+        if( r->first_frame_ts )
+            fprintf(reply, "%sreceiver.%u.first_frame_ms %.1f\n", prefix, i,
+                (r->first_frame_ts - r->connect_ts) / 1000000.0);
+    }
+    pthread_mutex_unlock(&s->lock);
 }
 
-static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
-        uint32_t width, uint32_t height, uint32_t stride) {
-    buffer.format = format;
-    buffer.width = width;
-    buffer.height = height;
-    buffer.stride = stride;
-
-    if( !buffer.wl_buffer ) {
-        buffer.wl_buffer =
-            create_shm_buffer(format, width, height, stride, &buffer.data);
+static int controlStats(char *args, FILE *reply) {
+    if( args[0] == '@' ) {
+        struct session *s = sessionArg(&args, reply);
+        if( !s )
+            return -1;
+        statsSession(s, "", reply);
+        return 0;
     }
-
-    if( buffer.wl_buffer == NULL ) {
-        fprintf(stderr, "ERROR: failed to create buffer\n");
-        exit(EXIT_FAILURE);
+    // Keys of the single session are kept without prefix
+    char prefix[32] = "";
+    for( unsigned int i = 0; i < sessions_count; i++ ) {
+        if( sessions_count > 1 )
+            snprintf(prefix, sizeof(prefix), "session.%u.", i);
+        statsSession(sessions[i], prefix, reply);
     }
-
-    zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
+    return 0;
 }
 
-static void frame_handle_flags(void *data,
-        struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
-    buffer.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+// Stage histograms are shared by all the sessions, receivers & frame sizes are listed per session
+static void reportLatency(FILE *out) {
+    latency_report(out);
+    for( unsigned int i = 0; i < sessions_count; i++ ) {
+        pthread_mutex_lock(&sessions[i]->lock);
+        session_report_latency(sessions[i], out);
+        pthread_mutex_unlock(&sessions[i]->lock);
+    }
+    fprintf(out, "INFO: Encoded frame sizes (bytes):\n");
+    fprintf(out, "  %-12s %10s %10s %10s %10s %10s\n", "session", "count", "p50", "p95", "p99", "max");
+    for( unsigned int i = 0; i < sessions_count; i++ )
+        session_report_sizes(sessions[i], out);
 }
 
-static void frame_handle_ready(void *data,
-        struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
-        uint32_t tv_sec_lo, uint32_t tv_nsec) {
-    buffer.pts = ((((uint64_t)tv_sec_hi) << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
-    buffer_copy_done = true;
+// Stats tables go through the log to not interleave with the other messages
+static void logReport(void (*report)(FILE *out)) {
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if( !out )
+        return;
+    report(out);
+    fclose(out);
+    log_lines(LOG_LEVEL_INFO, text);
+    free(text);
 }
 
-static void frame_handle_failed(void *data,
-        struct zwlr_screencopy_frame_v1 *frame) {
-    fprintf(stderr, "ERROR: failed to copy frame\n");
-    exit(EXIT_FAILURE);
+static int controlLatency(char *args, FILE *reply) {
+    reportLatency(reply);
+    return 0;
 }
 
-static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
-    .buffer = frame_handle_buffer,
-    .flags = frame_handle_flags,
-    .ready = frame_handle_ready,
-    .failed = frame_handle_failed,
-};
+static int controlSet(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    char name[16];
+    double value;
+    if( sscanf(args, "%15s %lf", name, &value) != 2 ) {
+        fprintf(reply, "Usage: set [@session] <bitrate|fps|crf|pacing> <value>\n");
+        return -1;
+    }
 
-static void handle_global(void *data, struct wl_registry *registry,
-        uint32_t name, const char *interface, uint32_t version) {
-    if( strcmp(interface, wl_output_interface.name) == 0 && opt_output_num > 0 ) {
-        fprintf(stderr, "INFO: Using output: %s\n", interface);
-        output = wl_registry_bind(registry, name, &wl_output_interface, 1);
-        opt_output_num--;
-    } else if( strcmp(interface, wl_shm_interface.name) == 0 ) {
-        shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
-    } else if( strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0 ) {
-        screencopy_manager = wl_registry_bind(registry, name,
-            &zwlr_screencopy_manager_v1_interface, 1);
+    int ret = 0;
+    pthread_mutex_lock(&s->lock);
+    if( strcmp(name, "fps") == 0 && value >= 1 && value <= 120 ) {
+        s->fps = value;
+        // Keeps VBV buffer in sync with the frame interval
+        s->encoder_reopen = s->max_bitrate > 0 || s->frame_bytes > 0;
+    } else if( strcmp(name, "crf") == 0 && value >= 0 && value <= 51 ) {
+        s->crf = value;
+        // libx264 reconfigures CRF on the fly with the next frame
+        if( s->enc_ctx )
+            av_opt_set_double(s->enc_ctx->priv_data, "crf", s->crf, 0);
+    } else if( strcmp(name, "bitrate") == 0 && value >= 0 ) {
+        // VBV can't be enabled on the fly, so the encoder is reopened
+        s->max_bitrate = value;
+        s->encoder_reopen = true;
+    } else if( strcmp(name, "pacing") == 0 && value >= 0 && value <= 100 ) {
+        // Applied to the next frame sent
+        s->pacing = value;
+    } else {
+        fprintf(reply, "Wrong setting or value: %s\n", args);
+        ret = -1;
     }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
 }
 
-static void handle_global_remove(void *data, struct wl_registry *registry,
-        uint32_t name) {
-    // Who cares?
+static int controlIdr(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    pthread_mutex_lock(&s->lock);
+    s->force_idr = true;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
 }
 
-static const struct wl_registry_listener registry_listener = {
-    .global = handle_global,
-    .global_remove = handle_global_remove,
-};
+static int controlAdd(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    // Connecting could take a while, so it's done without the lock
+    struct receiver *r = receiver_connect(args, RECEIVER_CONNECT_TIMEOUT_MS);
+    if( !r ) {
+        fprintf(reply, "Unable to connect to %s\n", args);
+        return -1;
+    }
 
-static enum AVPixelFormat scrcpy_fmt_to_pixfmt(uint32_t fmt) {
-    switch (fmt) {
-    case WL_SHM_FORMAT_NV12: return AV_PIX_FMT_NV12;
-    case WL_SHM_FORMAT_ARGB8888: return AV_PIX_FMT_BGRA;
-    case WL_SHM_FORMAT_XRGB8888: return AV_PIX_FMT_BGR0;
-    case WL_SHM_FORMAT_ABGR8888: return AV_PIX_FMT_RGBA;
-    case WL_SHM_FORMAT_XBGR8888: return AV_PIX_FMT_RGB0;
-    case WL_SHM_FORMAT_RGBA8888: return AV_PIX_FMT_ABGR;
-    case WL_SHM_FORMAT_RGBX8888: return AV_PIX_FMT_0BGR;
-    case WL_SHM_FORMAT_BGRA8888: return AV_PIX_FMT_ARGB;
-    case WL_SHM_FORMAT_BGRX8888: return AV_PIX_FMT_0RGB;
-    default: return AV_PIX_FMT_NONE;
-    };
+    pthread_mutex_lock(&s->lock);
+    int ret = session_add_receiver(s, r);
+    pthread_mutex_unlock(&s->lock);
+    if( ret < 0 ) {
+        receiver_free(r);
+        fprintf(reply, "Too many receivers\n");
+        return -1;
+    }
+    return 0;
 }
 
-static void writeUInt32LE(uint8_t *buff, uint32_t buff_pos, uint32_t data32) {
-    buff[buff_pos] = (uint8_t) data32 & 0xff;
-    buff[buff_pos+1] = (uint8_t) (data32 >> 8) & 0xff;
-    buff[buff_pos+2] = (uint8_t) (data32 >> 16) & 0xff;
-    buff[buff_pos+3] = (uint8_t) (data32 >> 24) & 0xff;
+static int controlRemove(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    pthread_mutex_lock(&s->lock);
+    struct receiver *r = session_remove_receiver(s, args);
+    pthread_mutex_unlock(&s->lock);
+
+    if( !r ) {
+        fprintf(reply, "Unknown receiver %s\n", args);
+        return -1;
+    }
+    LOG_INFO("Removed airplay 1.0 device: %s", r->address);
+    receiver_free(r);
+    return 0;
 }
 
-static void writeFloat32LE(uint8_t *buff, uint32_t buff_pos, float data32) {
-    // TODO: probably will not work well somewhere
-    uint8_t *b = (uint8_t *) &buff[buff_pos];
-    uint8_t *p = (uint8_t *) &data32;
-#if defined (_M_IX86) || (defined (CPU_FAMILY) && (CPU_FAMILY == I80X86))
-    b[0] = p[3];
-    b[1] = p[2];
-    b[2] = p[1];
-    b[3] = p[0];
-#else
-    b[0] = p[0];
-    b[1] = p[1];
-    b[2] = p[2];
-    b[3] = p[3];
-#endif
+// Default replay file: replay-<session>-<local time>.mkv in the current directory
+static void replayPath(char *path, size_t size, unsigned int index) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, size, "replay-%u-%s.mkv", index, stamp);
 }
 
-static void writeUInt16LE(uint8_t *buff, uint32_t buff_pos, uint16_t data16) {
-    buff[buff_pos] = (uint8_t) data16 & 0xff;
-    buff[buff_pos+1] = (uint8_t) (data16 >> 8) & 0xff;
+static int controlReplay(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    char path[PATH_MAX];
+    if( args[0] )
+        snprintf(path, sizeof(path), "%s", args);
+    else
+        replayPath(path, sizeof(path), s->index);
+    if( session_save_replay(s, path) < 0 ) {
+        fprintf(reply, "Unable to save replay to %s\n", path);
+        return -1;
+    }
+    fprintf(reply, "%s\n", path);
+    return 0;
 }
 
-static void writeUInt16BE(uint8_t *buff, uint32_t buff_pos, uint16_t data16) {
-    buff[buff_pos] = (uint8_t) (data16 >> 8) & 0xff;
-    buff[buff_pos+1] = (uint8_t) data16 & 0xff;
+static int controlPause(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    pthread_mutex_lock(&s->lock);
+    s->paused = true;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
 }
 
-static size_t find0001(const uint8_t *p, size_t left_size) {
-    char counter = 0;
-    for( size_t i = 0; i < left_size; ++i ) {
-        if( p[i] == 0 )
-            counter++;
-        else if( counter == 3 && p[i] == 1 ) {
-            return i+1;
-        } else
-            counter = 0;
-    }
-    return -1;
+static int controlResume(char *args, FILE *reply) {
+    struct session *s = sessionArg(&args, reply);
+    if( !s )
+        return -1;
+    pthread_mutex_lock(&s->lock);
+    s->paused = false;
+    session_wake(s);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
 }
 
-uint8_t avcc_buff[1024];
-static size_t prepareAVCCData() {
-    // Read extradata annexb
-    uint8_t *sps = NULL;
-    uint8_t sps_size = 0;
-    uint8_t *pps = NULL;
-    uint8_t pps_size = 0;
-    char counter = 0;
-
-    size_t pos_sps = find0001(enc_ctx->extradata, enc_ctx->extradata_size);
-    sps = &enc_ctx->extradata[pos_sps];
-    size_t pos_pps = pos_sps + find0001(&enc_ctx->extradata[pos_sps], enc_ctx->extradata_size-pos_sps);
-    pps = &enc_ctx->extradata[pos_pps];
-    sps_size = pos_pps - pos_sps - 4;
-    fprintf(stderr, "DEBUG: Found sps: %ld, size: %d\n", pos_sps, sps_size);
-    for( size_t j = 0; j < sps_size; ++j )
-        fprintf(stderr, "0x%02x, ", (unsigned char)sps[j]);
-    fprintf(stderr, "\n");
-    pps_size = enc_ctx->extradata_size - pos_pps;
-    fprintf(stderr, "DEBUG: Found pps: %ld, size: %d\n", pos_pps, pps_size);
-    for( size_t j = 0; j < pps_size; ++j )
-        fprintf(stderr, "0x%02x, ", (unsigned char)pps[j]);
-    fprintf(stderr, "\n");
-
-    pos_pps = find0001(&enc_ctx->extradata[pos_pps], enc_ctx->extradata_size-pos_pps);
-    if( -1 != pos_pps ) {
-        fprintf(stderr, "ERROR: Found another nalu, it should not be here: %ld\n", pos_pps);
-        exit(1);
-    }
-
-    // Send codec data in avcc format
-    avcc_buff[0] = 0x01;  // version
-    avcc_buff[1] = sps[1]; // SPS profile
-    avcc_buff[2] = sps[2]; // SPS compatibility
-    avcc_buff[3] = sps[3]; // SPS level
-    avcc_buff[4] = 0xFC | 3; // reserved (6 bits), NULA length size - 1 (2 bits)
-    avcc_buff[5] = 0xE0 | 1; // reserved (3 bits), num of SPS (5 bits)
-    writeUInt16BE(avcc_buff, 6, sps_size); // 2 bytes for length of SPS in BE
-
-    // TODO: check buffer overload
-    memcpy(&avcc_buff[8], sps, sps_size); // data of SPS
-
-    size_t pps_begin = 8+sps_size;
-    avcc_buff[pps_begin] = 0x01;  // num of PPS
-    writeUInt16BE(avcc_buff, pps_begin+1, pps_size);  // 2 bytes for length of PPS in BE
-    memcpy(&avcc_buff[pps_begin+3], pps, pps_size); // data of PPS
+static const struct control_command control_commands[] = {
+    { "stats", "[@session]", "Show live counters of the capture, encoder and receivers.", controlStats },
+    { "latency", NULL, "Show frame latency stats.", controlLatency },
+    { "set", "[@session] <bitrate|fps|crf|pacing> <value>", "Change encoder setting (bitrate 0 - no cap).", controlSet },
+    { "idr", "[@session]", "Force the next frame to be IDR.", controlIdr },
+    { "add", "[@session] <addr[:port]>", "Connect to airplay 1.0 device and start streaming.", controlAdd },
+    { "remove", "[@session] <addr[:port]|#index>", "Stop streaming to the device.", controlRemove },
+    { "replay", "[@session] [<path>]", "Save the instant replay (mkv or by the extension).", controlReplay },
+    { "pause", "[@session]", "Pause capture, the receivers will get heartbeats only.", controlPause },
+    { "resume", "[@session]", "Resume capture.", controlResume },
+    { NULL },
+};
 
-    return pps_begin+3+pps_size;
+// Relay mode forwards the incoming stream instead of the sessions
+static struct relay *relay = NULL;
+
+static int controlRelayStats(char *args, FILE *reply) {
+    pthread_mutex_lock(&relay->lock);
+    fprintf(reply, "relay_port %d\n", relay->port);
+    fprintf(reply, "relay_sender %s\n", relay->upstream[0] ? relay->upstream : "none");
+    fprintf(reply, "relay_streams %lu\n", relay->stats.streams);
+    fprintf(reply, "relay_packets_received %lu\n", relay->stats.packets_received);
+    fprintf(reply, "relay_bytes_received %lu\n", relay->stats.bytes_received);
+    fprintf(reply, "relay_keyframes %lu\n", relay->stats.keyframes);
+    fprintf(reply, "receivers %u\n", relay->sinks_count);
+    for( unsigned int i = 0; i < relay->sinks_count; i++ ) {
+        struct relay_sink *sink = relay->sinks[i];
+        pthread_mutex_lock(&sink->lock);
+        fprintf(reply, "receiver.%u.address %s\n", i, sink->receiver->address);
+        fprintf(reply, "receiver.%u.state %s\n", i,
+            sink->state == RECEIVER_UP ? "up" : sink->state == RECEIVER_DOWN ? "down" : "reconnecting");
+        fprintf(reply, "receiver.%u.reconnects %lu\n", i, sink->reconnects);
+        fprintf(reply, "receiver.%u.bytes_sent %lu\n", i, sink->bytes_sent);
+        fprintf(reply, "receiver.%u.frames_sent %lu\n", i, sink->frames_sent);
+        fprintf(reply, "receiver.%u.frames_dropped %lu\n", i, sink->frames_dropped + sink->frames_flushed);
+        fprintf(reply, "receiver.%u.queue_packets %u\n", i, sink->count);
+        fprintf(reply, "receiver.%u.queue_bytes %zu\n", i, sink->queued_bytes);
+        fprintf(reply, "receiver.%u.queue_overflows %lu\n", i, sink->overflows);
+        pthread_mutex_unlock(&sink->lock);
+    }
+    pthread_mutex_unlock(&relay->lock);
+    return 0;
 }
 
-const int HEADER_BUFF_SIZE = 128;
-uint8_t header_buff[128];
-static void prepareHeader(uint32_t payload_size, uint16_t type) {
-    // Clean buffer
-    memset(header_buff, 0x00, 128);
-
-    writeUInt32LE(header_buff, 0, payload_size); // 4 bytes Payload size
-    writeUInt16LE(header_buff, 4, type); // 2 bytes Payload type
-    writeUInt16LE(header_buff, 6, type == 0x02 ? 0x1e : 0x06 ); // 2 bytes Payload option (0x1e on heartbeat)
-
-    if( type == 0x02 ) // HEART_BEAT
-        return;
-
-    // Get current seconds and fraction
-    struct timeval ts;
-    gettimeofday(&ts, NULL);
-    writeUInt32LE(header_buff, 8, ts.tv_usec); // 4 bytes NTP Timestamp fraction
-    writeUInt32LE(header_buff, 12, ts.tv_sec); // 4 bytes NTP Timestamp seconds
-
-    /*fprintf(stderr, "DEBUG: data size: %u : ", payload_size);
-    for( size_t j = 0; j < 16; ++j )
-        fprintf(stderr, "%02x ", header_buff[j]);
-    fprintf(stderr, "\n");*/
-
-    // Write source screen WxH if type VIDEO_CODEC
-    if( type == 0x01 ) {
-        writeFloat32LE(header_buff, 16, 1920.0f); // 4 bytes Source screen width
-        writeFloat32LE(header_buff, 20, 1080.0f); // 4 bytes Source screen height
+static int controlRelayAdd(char *args, FILE *reply) {
+    struct receiver *r = receiver_connect(args, RECEIVER_CONNECT_TIMEOUT_MS);
+    if( !r ) {
+        fprintf(reply, "Unable to connect to %s\n", args);
+        return -1;
     }
+    if( relay_add_receiver(relay, r) < 0 ) {
+        receiver_free(r);
+        fprintf(reply, "Too many receivers\n");
+        return -1;
+    }
+    return 0;
+}
 
-    writeFloat32LE(header_buff, 40, 1920.0f); // 4 bytes Source screen width
-    writeFloat32LE(header_buff, 44, 1080.0f); // 4 bytes Source screen height
+static int controlRelayRemove(char *args, FILE *reply) {
+    if( relay_remove_receiver(relay, args) < 0 ) {
+        fprintf(reply, "Unknown receiver %s\n", args);
+        return -1;
+    }
+    return 0;
+}
 
-    // 48 byte - float (REAL_SCREEN_WIDTH - SENT_SCREEN_WIDTH)/2
-    // Probably to add black boxes and center the picture horizontally
-    writeFloat32LE(header_buff, 48, 0.0f);
-    // 52 byte - float (REAL_SCREEN_HEIGHT - SENT_SCREEN_HEIGHT)/2
-    // Probably to add black boxes and center the picture vertically
-    writeFloat32LE(header_buff, 52, 0.0f);
+static const struct control_command relay_commands[] = {
+    { "stats", NULL, "Show counters of the incoming stream and receivers.", controlRelayStats },
+    { "add", "<addr[:port]>", "Connect to airplay 1.0 device, it gets the stream from the next keyframe.", controlRelayAdd },
+    { "remove", "<addr[:port]|#index>", "Stop forwarding to the device.", controlRelayRemove },
+    { NULL },
+};
 
-    // Send the supported picture size (could be gotten from "GET /stream.xml HTTP/1.1")
-    writeFloat32LE(header_buff, 56, 1920.0f); // 4 bytes Supported screen width
-    writeFloat32LE(header_buff, 60, 1080.0f); // 4 bytes Supported screen height
-}
+// Routes libav messages (x264 info and warnings) to the async log
+static void avLogCallback(void *avcl, int level, const char *fmt, va_list vl) {
+    if( level > AV_LOG_INFO )
+        return;
 
-static void sendToOutputs(uint8_t *buffer, size_t num_bytes) {
-    // TODO: parallelize to increase the framerate
-    //struct timespec tm;
-    //clock_gettime( CLOCK_REALTIME, &tm );
-    //int64_t start = tm.tv_nsec + tm.tv_sec * 1000000000;
-    for( uint8_t i = 0; i < 255; i++ ) {
-        if( output_sockets[i] == 0 )
-            break;
-        send(output_sockets[i], buffer, num_bytes, 0);
-    }
-    if( output_file )
-        fwrite(buffer, 1, num_bytes, output_file);
-    if( output_stdout )
-        fwrite(buffer, 1, num_bytes, output_stdout);
-    //clock_gettime( CLOCK_REALTIME, &tm );
-    //int64_t end = tm.tv_nsec + tm.tv_sec * 1000000000;
-    //fprintf(stderr, "----> send bytes %li delay: %ldms\n", num_bytes, (end - start) / 1000);
-}
+    static __thread char line[1024];
+    static __thread int print_prefix = 1;
+    static __thread size_t line_len = 0;
+    // libav could print one line in several calls, so it's buffered until newline
+    av_log_format_line(avcl, level, fmt, vl, &line[line_len], sizeof(line) - line_len, &print_prefix);
+    line_len = strnlen(line, sizeof(line) - 1);
+    if( line_len > 0 && line[line_len - 1] != '\n' && line_len < sizeof(line) - 1 )
+        return;
 
-static void initMirroringConnection() {
-    // Read plist
-    // TODO: Generate plist dynamically
-    char plist_buf[1024] = {0};
-    FILE* fh = NULL;
-    fh = fopen("stream-mirror.bplist", "rb");
-    if( fh == NULL ) {
-        fprintf(stderr, "ERROR: unable to open 'stream-mirror.bplist' from current dir\n");
-        exit(1);
-    }
-    fprintf(stderr, "DEBUG: plist reading\n");
-    size_t plist_len = fread(plist_buf, 1, 1024, fh);
-    fprintf(stderr, "DEBUG: plist read done: len: %ld\n", plist_len);
-    fclose(fh);
-    fh = NULL;
-
-    // Create buffers for data
-    char data_len[32];
-    sprintf(data_len, "%ld\r\n\r\n", plist_len);
-    char buff[2048] = {0};
-
-    // Generate headers
-    const char *header = "POST /stream HTTP/1.1\r\n"
-        "User-Agent: wlroots-airplay/1.0.0\r\n"
-        "X-Apple-Device-ID: 0x7B:DE:DB:1F:BB:AB\r\n"
-        "X-Apple-Client-Name: WLRootsAirplay\r\n"
-        "X-Apple-ProtocolVersion: 1\r\n"
-        "Content-Type: application/x-apple-binary-plist\r\n"
-        "Content-Length: ";
-
-    strcat(buff, header);
-    strcat(buff, data_len);
-
-    // Send Headers
-    sendToOutputs(buff, strlen(header) + strlen(data_len));
-    // Send plist
-    sendToOutputs(plist_buf, plist_len);
-    fprintf(stderr, "DEBUG: Initialized airplay mirroring\n");
+    int log_lvl = level <= AV_LOG_ERROR ? LOG_LEVEL_ERROR : level <= AV_LOG_WARNING ? LOG_LEVEL_WARN : LOG_LEVEL_INFO;
+    LOG_AT(log_lvl, "%s", line);
+    line_len = 0;
+    line[0] = '\0';
 }
 
 static const char usage[] =
@@ -394,387 +400,482 @@ static const char usage[] =
     "                         address:port list (separated by comma).\n"
     "  -s                     Output stream to stdout.\n"
     "  -f <file_path>         Output stream to the specified file path.\n"
-    "  -c                     Include cursors in the capture.\n";
+    "  -c                     Include cursors in the capture.\n"
+    "  --region <x,y,w,h>     Capture only the area of the output.\n"
+    "  --encode-size <size>   Encode the capture at native size (default) or scale\n"
+    "                         it to fit the receiver screen (receiver).\n"
+    "  --source <spec>        Capture source: ext or wlr (default is ext when\n"
+    "                         supported by the compositor), y4m:<path>,\n"
+    "                         raw:<path>:<w>x<h> (BGRx frames) or\n"
+    "                         synthetic[:static|scroll|motion][:<w>x<h>].\n"
+    "  --fps <fps>            Capture rate (default 20).\n"
+    "  --fps-min <fps>        Vary the capture rate with the screen activity between\n"
+    "                         the floor rate (could be fractional) and --fps.\n"
+    "  --max-bitrate <bps>    Cap every frame of the stream by VBV (default no cap).\n"
+    "  --frame-bytes <bytes>  Cap every frame by VBV to the size and replace the\n"
+    "                         periodic IDRs by intra refresh (IDR only on request).\n"
+    "  --pacing <percent>     Spread every frame sent to the receivers over the part\n"
+    "                         of the frame interval (default 0 - unpaced).\n"
+    "  --roi <qp>             Encode the changed areas of the frame with the quantizer\n"
+    "                         lowered by qp and the static ones raised by qp (1-20,\n"
+    "                         default 0 - off).\n"
+    "  --replay <seconds>     Keep the last seconds of the stream in memory, saved to\n"
+    "                         replay-<session>-<time>.mkv on SIGUSR1 or control\n"
+    "                         replay command.\n"
+    "  --replay-mb <MB>       Memory limit of the replay (default 32), the older\n"
+    "                         frames are dropped to fit it.\n"
+    "  --latency-ms <ms>      Playout buffer asked from the receiver (default 50).\n"
+    "  --presentation-offset <ms> Shift of the frame timestamps from the capture\n"
+    "                         time (default 0), the receiver plays the frame at\n"
+    "                         capture time + offset + latency.\n"
+    "  --device-id <mac>      Device ID sent to the receivers (7B:DE:DB:1F:BB:AB).\n"
+    "  --stream-plist <path>  Send the stream request plist file instead of the\n"
+    "                         generated one.\n"
+    "  --relay <port>         Relay mode: receive the mirror stream of another sender\n"
+    "                         on the port and forward it to the -a devices (no capture).\n"
+    "  --io-uring             Send every frame to the receivers and files by one\n"
+    "                         io_uring submission (send() if it's unavailable).\n"
+    "  --unthrottled          Capture as fast as the pipeline goes (benchmarks).\n"
+    "  --frames <count>       Stop after the number of frames.\n"
+    "  --workers <count>      Conversion & encoding threads shared by the sessions\n"
+    "                         (default is one per session up to the cpus count).\n"
+    "  -t <seconds>           Print frame latency stats every N seconds\n"
+    "                         (default 10, 0 - only on exit).\n"
+    "  --perf                 Count cycles, instructions, cache misses and context\n"
+    "                         switches of every pipeline stage, print them on exit.\n"
+    "  -C <socket_path>       Listen for the control commands on unix socket.\n"
+    "  -v                     Verbose output (debug messages, -vv for trace).\n"
+    "  --realtime[=<policy>]  Realtime mode: fifo (default), rr or nice scheduling\n"
+    "                         for the pipeline threads and locking buffers in memory.\n"
+    "  --rt-priority <1-99>   Priority of fifo/rr scheduling (default 10).\n"
+    "  --cpus [<role>=]<list> Pin pipeline threads to cpus, like 2,4-5. Role could be\n"
+    "                         capture, convert, encode or send (default all of them),\n"
+    "                         could be specified multiple times.\n"
+#ifdef ALLOC_ACCOUNTING
+    "  -A                     Exit with code 3 if steady-state frame allocates buffers.\n"
+#endif
+    "\n"
+    "Every -o or --source after the first one starts the next session mirroring\n"
+    "another output, the -a, -f, -c, --region, --encode-size, --fps, --fps-min,\n"
+    "--max-bitrate, --frame-bytes, --roi, --pacing, --replay, --replay-mb,\n"
+    "--latency-ms and --presentation-offset options following it apply to that\n"
+    "session only.\n"
+    ;
+
+static void defaultConfig(struct session_config *config) {
+    memset(config, 0, sizeof(*config));
+    config->fps = SESSION_FPS;
+    config->crf = SESSION_CRF;
+    config->latency_ms = SESSION_LATENCY_MS;
+    config->replay_bytes = REPLAY_MB_DEFAULT << 20;
+}
+
+// Output or source for the session that already has one starts the next session
+static struct session_config *captureConfig(struct session_config *configs, unsigned int *count, bool *capture_set) {
+    if( !*capture_set ) {
+        *capture_set = true;
+        return &configs[*count - 1];
+    }
+    if( *count >= SESSIONS_MAX ) {
+        LOG_ERROR("Too many sessions (max %d)", SESSIONS_MAX);
+        return NULL;
+    }
+    defaultConfig(&configs[*count]);
+    return &configs[(*count)++];
+}
+
+static volatile sig_atomic_t replay_requested = 0;
+
+static void handle_replay_signal(int sig) {
+    replay_requested = 1;
+}
+
+static void handle_signal(int sig) {
+    sessions_running = 0;
+}
+
+// Relay runs until the signal, control socket changes the receivers
+static int runRelay(int port, char *receivers, const char *control_path) {
+    relay = relay_new(port);
+    if( !relay )
+        return EXIT_FAILURE;
+    if( receivers )
+        relay_connect(relay, receivers);
+    if( (control_path && control_start(control_path, relay_commands) < 0) || relay_start(relay) < 0 ) {
+        relay_free(relay);
+        return EXIT_FAILURE;
+    }
+    while( sessions_running ) {
+        struct timespec poll_ts = { 0, 100000000 };
+        nanosleep(&poll_ts, NULL);
+    }
+    control_stop();
+    relay_free(relay);
+    relay = NULL;
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[]) {
-    bool write_stdout = false;
-    bool with_cursor = false;
-    const char *file_path = NULL;
-    char *airplay_addresses = NULL;
+    struct session_config configs[SESSIONS_MAX];
+    unsigned int configs_count = 1;
+    struct session_config *config = &configs[0];
+    bool capture_set = false;
+    const char *control_path = NULL;
+    bool unthrottled = false;
+    bool io_uring = false;
+    uint64_t max_frames = 0;
+    int workers = 0;
+    const char *device_id = NULL;
+    const char *plist_path = NULL;
+    int stats_interval = 10;
+    int relay_port = 0;
+    int exit_code = EXIT_SUCCESS;
 
     int c;
 
-    while( (c = getopt(argc, argv, "hf:o:a:p:sc")) != -1 ) {
+    log_start();
+    defaultConfig(config);
+
+    enum { OPT_REALTIME = 256, OPT_RT_PRIORITY, OPT_CPUS, OPT_SOURCE, OPT_FPS, OPT_UNTHROTTLED, OPT_FRAMES,
+        OPT_REGION, OPT_ENCODE_SIZE, OPT_MAX_BITRATE, OPT_WORKERS, OPT_LATENCY_MS, OPT_DEVICE_ID, OPT_STREAM_PLIST,
+        OPT_PRESENTATION_OFFSET, OPT_ROI, OPT_PACING, OPT_FRAME_BYTES, OPT_FPS_MIN, OPT_PERF, OPT_REPLAY, OPT_REPLAY_MB,
+        OPT_RELAY, OPT_IO_URING };
+    static const struct option long_options[] = {
+        { "realtime", optional_argument, NULL, OPT_REALTIME },
+        { "rt-priority", required_argument, NULL, OPT_RT_PRIORITY },
+        { "cpus", required_argument, NULL, OPT_CPUS },
+        { "source", required_argument, NULL, OPT_SOURCE },
+        { "fps", required_argument, NULL, OPT_FPS },
+        { "fps-min", required_argument, NULL, OPT_FPS_MIN },
+        { "perf", no_argument, NULL, OPT_PERF },
+        { "unthrottled", no_argument, NULL, OPT_UNTHROTTLED },
+        { "frames", required_argument, NULL, OPT_FRAMES },
+        { "region", required_argument, NULL, OPT_REGION },
+        { "encode-size", required_argument, NULL, OPT_ENCODE_SIZE },
+        { "max-bitrate", required_argument, NULL, OPT_MAX_BITRATE },
+        { "workers", required_argument, NULL, OPT_WORKERS },
+        { "latency-ms", required_argument, NULL, OPT_LATENCY_MS },
+        { "device-id", required_argument, NULL, OPT_DEVICE_ID },
+        { "stream-plist", required_argument, NULL, OPT_STREAM_PLIST },
+        { "presentation-offset", required_argument, NULL, OPT_PRESENTATION_OFFSET },
+        { "roi", required_argument, NULL, OPT_ROI },
+        { "pacing", required_argument, NULL, OPT_PACING },
+        { "frame-bytes", required_argument, NULL, OPT_FRAME_BYTES },
+        { "replay", required_argument, NULL, OPT_REPLAY },
+        { "replay-mb", required_argument, NULL, OPT_REPLAY_MB },
+        { "relay", required_argument, NULL, OPT_RELAY },
+        { "io-uring", no_argument, NULL, OPT_IO_URING },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while( (c = getopt_long(argc, argv, "hf:o:a:p:sct:C:v" ALLOC_OPTSTRING, long_options, NULL)) != -1 ) {
         switch( c ) {
         case 'h':
             printf("%s", usage);
             return EXIT_SUCCESS;
         case 'f':
-            file_path = optarg;
+            config->file_path = optarg;
             break;
         case 'o':
-            opt_output_num = atoi(optarg);
+            config = captureConfig(configs, &configs_count, &capture_set);
+            if( !config )
+                return 1;
+            config->capture.output_num = atoi(optarg);
             break;
         case 'a':
-            airplay_addresses = optarg;
+            config->receivers = optarg;
             break;
         case 's':
-            write_stdout = true;
+            config->write_stdout = true;
             break;
         case 'c':
-            with_cursor = true;
+            config->capture.with_cursor = true;
+            break;
+        case 't':
+            stats_interval = atoi(optarg);
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'v':
+            log_set_level(atomic_load(&log_level) + 1);
+            break;
+#ifdef ALLOC_ACCOUNTING
+        case 'A':
+            session_set_alloc_check(true);
+            break;
+#endif
+        case OPT_REALTIME:
+            if( realtime_set_policy(optarg) < 0 )
+                return 1;
+            break;
+        case OPT_RT_PRIORITY:
+            realtime_set_priority(atoi(optarg));
+            break;
+        case OPT_CPUS:
+            if( realtime_set_cpus(optarg) < 0 )
+                return 1;
+            break;
+        case OPT_SOURCE:
+            config = captureConfig(configs, &configs_count, &capture_set);
+            if( !config )
+                return 1;
+            config->source_spec = optarg;
+            break;
+        case OPT_FPS:
+            config->fps = atoi(optarg);
+            if( config->fps < 1 || config->fps > 120 ) {
+                LOG_ERROR("Wrong fps %s (1-120)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_FPS_MIN:
+            config->min_fps = atof(optarg);
+            if( config->min_fps < 0.1 || config->min_fps > 120 ) {
+                LOG_ERROR("Wrong minimal fps %s (0.1-120)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_PERF:
+            if( perf_init() < 0 )
+                return 1;
+            break;
+        case OPT_UNTHROTTLED:
+            unthrottled = true;
+            break;
+        case OPT_IO_URING:
+            io_uring = true;
+            break;
+        case OPT_FRAMES:
+            max_frames = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_REGION:
+            if( capture_parse_region(optarg, &config->capture.region) < 0 ) {
+                LOG_ERROR("Wrong region %s (x,y,w,h with even w & h)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_ENCODE_SIZE:
+            if( strcmp(optarg, "receiver") == 0 )
+                config->receiver_size = true;
+            else if( strcmp(optarg, "native") != 0 ) {
+                LOG_ERROR("Wrong encode size %s (native, receiver)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_MAX_BITRATE:
+            config->max_bitrate = strtoll(optarg, NULL, 10);
+            break;
+        case OPT_FRAME_BYTES:
+            config->frame_bytes = strtoll(optarg, NULL, 10);
+            if( config->frame_bytes < 0 ) {
+                LOG_ERROR("Wrong frame size cap %s", optarg);
+                return 1;
+            }
+            break;
+        case OPT_WORKERS:
+            workers = atoi(optarg);
+            if( workers < 1 || workers > WORKERS_MAX ) {
+                LOG_ERROR("Wrong workers count %s (1-%d)", optarg, WORKERS_MAX);
+                return 1;
+            }
+            break;
+        case OPT_LATENCY_MS:
+            config->latency_ms = atoi(optarg);
+            if( config->latency_ms < 0 || config->latency_ms > 10000 ) {
+                LOG_ERROR("Wrong latency %s (0-10000 ms)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_DEVICE_ID: {
+            unsigned int mac[6];
+            char end;
+            if( strlen(optarg) != 17 || sscanf(optarg, "%2x:%2x:%2x:%2x:%2x:%2x%c", &mac[0], &mac[1], &mac[2],
+                    &mac[3], &mac[4], &mac[5], &end) != 6 ) {
+                LOG_ERROR("Wrong device id %s (like 7B:DE:DB:1F:BB:AB)", optarg);
+                return 1;
+            }
+            device_id = optarg;
+            break;
+        }
+        case OPT_PRESENTATION_OFFSET:
+            config->presentation_offset_ms = atoi(optarg);
+            if( config->presentation_offset_ms < -1000 || config->presentation_offset_ms > 1000 ) {
+                LOG_ERROR("Wrong presentation offset %s (-1000-1000 ms)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_ROI:
+            config->roi_qp = atoi(optarg);
+            if( config->roi_qp < 0 || config->roi_qp > 20 ) {
+                LOG_ERROR("Wrong ROI quantizer offset %s (0-20)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_PACING:
+            config->pacing = atoi(optarg);
+            if( config->pacing < 0 || config->pacing > 100 ) {
+                LOG_ERROR("Wrong pacing %s (0-100 %%)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_REPLAY:
+            config->replay_seconds = atoi(optarg);
+            if( config->replay_seconds < 1 || config->replay_seconds > 3600 ) {
+                LOG_ERROR("Wrong replay length %s (1-3600 s)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_REPLAY_MB:
+            config->replay_bytes = strtoll(optarg, NULL, 10) << 20;
+            if( config->replay_bytes < 1 << 20 || config->replay_bytes > 4096LL << 20 ) {
+                LOG_ERROR("Wrong replay memory %s (1-4096 MB)", optarg);
+                return 1;
+            }
+            break;
+        case OPT_STREAM_PLIST:
+            plist_path = optarg;
+            break;
+        case OPT_RELAY:
+            relay_port = atoi(optarg);
+            if( relay_port < 1 || relay_port > 65535 ) {
+                LOG_ERROR("Wrong relay port %s", optarg);
+                return 1;
+            }
             break;
         case '?':
             if( isprint(optopt) )
-              fprintf(stderr, "ERROR: Unknown option `-%c'.\n", optopt);
+              LOG_ERROR("Unknown option `-%c'.", optopt);
             else
-              fprintf(stderr, "ERROR: Unknown option character `\\x%x'.\n", optopt);
+              LOG_ERROR("Unknown option character `\\x%x'.", optopt);
             return 1;
         default:
             break;
         }
     }
 
-    struct wl_display * display = wl_display_connect(NULL);
-    if( display == NULL ) {
-        fprintf(stderr, "ERROR: failed to create display: %m\n");
-        return EXIT_FAILURE;
-    }
+    struct sigaction sa = { .sa_handler = handle_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-    struct wl_registry *registry = wl_display_get_registry(display);
-    wl_registry_add_listener(registry, &registry_listener, NULL);
-    wl_display_dispatch(display);
-    wl_display_roundtrip(display);
-
-    if( shm == NULL ) {
-        fprintf(stderr, "ERROR: compositor is missing wl_shm\n");
-        return EXIT_FAILURE;
-    }
-    if( screencopy_manager == NULL ) {
-        fprintf(stderr, "ERROR: compositor doesn't support wlr-screencopy-unstable-v1\n");
-        return EXIT_FAILURE;
-    }
-    if( output == NULL ) {
-        fprintf(stderr, "ERROR: no output available\n");
-        return EXIT_FAILURE;
-    }
-
-    struct zwlr_screencopy_frame_v1 *wl_frame =
-        zwlr_screencopy_manager_v1_capture_output(screencopy_manager, with_cursor, output);
-    zwlr_screencopy_frame_v1_add_listener(wl_frame, &frame_listener, NULL);
-
-    if( airplay_addresses ) {
-        // TODO: Check MDNS on airplay features and determine mirroring support
-        char *addr_ptr = strtok(airplay_addresses, ",");
-        uint8_t counter = 0;
-        while( addr_ptr != NULL ) {
-            int port = 7100;
-            char *port_ptr = strchr(addr_ptr, ':');
-            if( port_ptr != NULL ) {
-                port = atoi(&port_ptr[1]);
-                port_ptr[0] = '\0';
-            }
-
-            fprintf(stderr, "INFO: Writing stream to airplay 1.0 device: %s:%d\n", addr_ptr, port);
-
-            // Create socket
-            if( (output_sockets[counter] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ) {
-                fprintf(stderr, "ERROR: Socket creation error\n");
-                return -1;
-            }
-            int yes = 1;
-            if( setsockopt(output_sockets[counter], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1 ) {
-                fprintf(stderr, "ERROR: Socket setsockopt TCP_NODELAY error\n");
-                return -1;
-            }
-
-            struct sockaddr_in serv_addr;
-            struct hostent *host;
-            serv_addr.sin_family = AF_INET;
-            serv_addr.sin_port = htons(port);
-            // Try to parse IPv4
-            if( inet_pton(AF_INET, addr_ptr, &serv_addr.sin_addr) <= 0 ) {
-                // Try to get address from DNS
-                host = gethostbyname(addr_ptr);
-                if( !host ) {
-                    fprintf(stderr, "ERROR: Wrong address %s\n", addr_ptr);
-                    return -1;
-                }
-                memcpy(&serv_addr.sin_addr, host->h_addr_list[0], host->h_length);
-            }
-            // Connect to socket
-            if( connect(output_sockets[counter], (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 ) {
-                fprintf(stderr, "ERROR: Connection Failed\n");
-                return -1;
-            }
-
-            if( port_ptr != NULL )
-                port_ptr[0] = ':';
-            addr_ptr = strtok(NULL, ",");
-            counter++;
+    if( relay_port ) {
+        if( capture_set || config->file_path || config->write_stdout ) {
+            LOG_ERROR("Relay mode forwards the received stream to -a devices only (no -o, --source, -s, -f)");
+            return 1;
         }
-        if( counter < 255 )
-            output_sockets[counter] = 0;
-    } else
-        output_sockets[0] = 0;
-
-    if( file_path ) {
-        fprintf(stderr, "INFO: Writing stream to file: %s\n", file_path);
-        output_file = fopen(file_path, "wb");
+        if( !config->receivers && !control_path ) {
+            LOG_ERROR("No receivers are specified for the relay (check -a, -C)");
+            return 1;
+        }
+        exit_code = runRelay(relay_port, config->receivers, control_path);
+        log_stop();
+        return exit_code;
     }
 
-    if( write_stdout ) {
-        fprintf(stderr, "INFO: Writing stream to stdout\n");
-        output_stdout = stdout;
+    for( unsigned int i = 0; i < configs_count; i++ ) {
+        struct session_config *cfg = &configs[i];
+        cfg->capture.fps = cfg->fps;
+        cfg->unthrottled = unthrottled;
+        cfg->io_uring = io_uring;
+        cfg->max_frames = max_frames;
+        if( !cfg->file_path && !cfg->write_stdout && !cfg->receivers && !control_path ) {
+            LOG_ERROR("No output is specified for session %u (check -s, -f, -a, -C)", i);
+            exit(1);
+        }
+        if( cfg->write_stdout && configs_count > 1 ) {
+            LOG_ERROR("Stdout output could be used with one session only");
+            exit(1);
+        }
     }
 
-    if( !output_file && !output_stdout && output_sockets[0] == 0 ) {
-        fprintf(stderr, "ERROR: No output is specified (check -s, -f, -a)\n");
-        exit(1);
-    }
+    struct sigaction sa_replay = { .sa_handler = handle_replay_signal };
+    sigaction(SIGUSR1, &sa_replay, NULL);
 
     // AVLIB INIT
-    const AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
-    if( !encoder ) {
-        fprintf(stderr, "ERROR: Codec '%s' not found\n", "libx264");
+    av_log_set_callback(avLogCallback);
+    if( session_init(plist_path, device_id) < 0 )
         exit(1);
-    }
 
-    enc_ctx = avcodec_alloc_context3(encoder);
-    if( !enc_ctx ) {
-        fprintf(stderr, "ERROR: Could not allocate video codec context\n");
-        exit(1);
+    // Sessions are opened one by one, the first capture of each gives its encoder size
+    for( ; sessions_count < configs_count; sessions_count++ ) {
+        sessions[sessions_count] = session_new(sessions_count, &configs[sessions_count]);
+        if( !sessions[sessions_count] )
+            exit(1);
     }
 
-    AVPacket *pkt = av_packet_alloc();
-    if( !pkt )
-        exit(1);
-
-    while( !buffer_copy_done && wl_display_dispatch(display) != -1 ) {
-        // This space is intentionally left blank
-    }
-
-    /* put sample parameters */
-    enc_ctx->bit_rate = 4096000; // 2KB/sec
-    /* resolution must be a multiple of two */
-    enc_ctx->width = buffer.width;
-    enc_ctx->height = buffer.height;
-    /* frames per second */
-    enc_ctx->time_base = (AVRational){1, STREAM_FRAME_RATE};
-    enc_ctx->framerate = (AVRational){STREAM_FRAME_RATE, 1};
-
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    enc_ctx->gop_size = 10;
-    enc_ctx->pix_fmt = STREAM_PIX_FMT;
-
-    if( encoder->id == AV_CODEC_ID_H264 ) {
-        enc_ctx->max_b_frames = 3;
-        av_opt_set(enc_ctx->priv_data, "preset", "ultrafast", 0);
-        av_opt_set(enc_ctx->priv_data, "profile", "baseline", 0);
-        av_opt_set_int(enc_ctx->priv_data, "intra-refresh", 1, 0);
-        av_opt_set_int(enc_ctx->priv_data, "crf", 15, 0);
-        //av_opt_set(enc_ctx->priv_data, "x264-params", "vbv-maxrate=500000:vbv-bufsize=500:slice-max-size=1500:keyint=60", 0);
-        //av_opt_set(enc_ctx->priv_data, "x264opts", "no-mbtree:sliced-threads:sync-lookahead=0", 0);
-        enc_ctx->max_b_frames = 0;
-        enc_ctx->delay = 0;
-        enc_ctx->thread_count = 1;
-        enc_ctx->thread_type = FF_THREAD_SLICE;
-        enc_ctx->slices = 1;
-        enc_ctx->level = 40;
-        av_opt_set(enc_ctx->priv_data, "tune", "zerolatency", 0);
-    } else if( encoder->id == AV_CODEC_ID_MJPEG ) {
-        enc_ctx->max_b_frames = 0;
-        enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
-    }
-    enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    bool codec_data_refresh = true;
-
-    /* open it */
-    int ret;
-    ret = avcodec_open2(enc_ctx, encoder, NULL);
-    if( ret < 0 ) {
-        fprintf(stderr, "ERROR: Could not open codec: %s\n", av_err2str(ret));
-        exit(1);
+    if( workers == 0 ) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 && cpus < (long)sessions_count ? cpus : (long)sessions_count;
     }
-
-    AVFrame *frame = av_frame_alloc();
-    if( !frame ) {
-        fprintf(stderr, "ERROR: Could not allocate video frame\n");
+    if( workers_start(workers) < 0 )
         exit(1);
-    }
-    frame->format = enc_ctx->pix_fmt;
-    frame->width  = enc_ctx->width;
-    frame->height = enc_ctx->height;
 
-    ret = av_frame_get_buffer(frame, 1);
-    if( ret < 0 ) {
-        fprintf(stderr, "ERROR: Could not allocate the video frame data\n");
+    if( control_path && control_start(control_path, control_commands) < 0 )
         exit(1);
-    }
-
-    initMirroringConnection();
-
-    struct timespec tm;
-    int64_t last_ts = 0;
-
-    do {
-        if( ! buffer_copy_done )
-            continue;
-
-        clock_gettime( CLOCK_REALTIME, &tm );
-        int64_t frame_ts = tm.tv_nsec + tm.tv_sec * 1000000000;
-
-        /* make sure the frame data is writable */
-        ret = av_frame_make_writable(frame);
-        if( ret < 0 )
-            exit(1);
-
-        // Convert from existing format to target one
-        sws_ctx = sws_getCachedContext(sws_ctx,
-            frame->width, frame->height, scrcpy_fmt_to_pixfmt(buffer.format),
-            frame->width, frame->height, STREAM_PIX_FMT, 0, NULL, NULL, NULL);
-        //int *inv_table, srcrange, *table, dstrange, brightness, contrast, saturation;
-        //sws_getColorspaceDetails(sws_ctx, &inv_table, &srcrange, &table, &dstrange, &brightness, &contrast, &saturation);
-        //sws_setColorspaceDetails(sws_ctx, inv_table, srcrange, table, 1, brightness, contrast, saturation);
-        uint8_t * inData[1] = { buffer.data };
-        int inLinesize[1] = { buffer.stride };
-
-        // Inverting Y axis if source buffer is inverted
-        if( buffer.y_invert ) {
-            inData[0] += inLinesize[0]*(frame->height-1);
-            inLinesize[0] = -inLinesize[0];
-        }
-
-        sws_scale(sws_ctx, (const uint8_t * const *)&inData, inLinesize, 0, frame->height, frame->data, frame->linesize);
-
-        frame->pts = buffer.pts;
 
-        if( !buffer.start_pts )
-            buffer.start_pts = frame->pts;
-
-        frame->pts = av_rescale_q(frame->pts - buffer.start_pts, (AVRational){ 1, 1000000000 }, enc_ctx->time_base);
-
-        // ENCODE
-        // TODO: use vaapi to improve encoding:
-        // https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/vaapi_encode.c
-        ret = avcodec_send_frame(enc_ctx, frame);
-        if( ret < 0 ) {
-            fprintf(stderr, "ERROR: sending a frame for encoding failed\n");
+    int64_t run_ts = latency_now();
+    for( unsigned int i = 0; i < sessions_count; i++ ) {
+        if( session_start(sessions[i]) < 0 )
             exit(1);
-        }
-
-        while( ret >= 0 ) {
-            ret = avcodec_receive_packet(enc_ctx, pkt);
-            if( ret == AVERROR(EAGAIN) || ret == AVERROR_EOF )
-                break;
-            else if( ret < 0 ) {
-                fprintf(stderr, "ERROR: encoding failed\n");
-                exit(1);
-            }
-
-            if( codec_data_refresh ) {
-                // Send ping
-                // TODO: send heart beat every second
-                prepareHeader(0, 0x02); // type HEART_BEAT
-                sendToOutputs(header_buff, HEADER_BUFF_SIZE);
-
-                // Send VIDEO_CODEC header
-                size_t avcc_len = prepareAVCCData();
-                prepareHeader(avcc_len, 0x01); // type VIDEO_CODEC
-                sendToOutputs(header_buff, HEADER_BUFF_SIZE);
-
-                // Send AVCC data
-                sendToOutputs(avcc_buff, avcc_len);
-
-                codec_data_refresh = false;
-            }
-            //fprintf(stderr, "DEBUG: extradata: %d, packet: %d\n", enc_ctx->extradata_size, pkt->size);
-
-            // Change nalu start to nalu size
-            uint8_t *pd = pkt->data;
-            size_t ps = pkt->size;
-            size_t pos_data = find0001(pd, ps);
-            size_t first_nalu = pos_data - 4; // To cut avcodec comments
-            while( -1 != pos_data ) {
-                size_t nalu_len;
-                //fprintf(stderr, "DEBUG: Found nalu data pos: %ld", pos_data);
-                pd = &pd[pos_data];
-                ps = ps - pos_data;
-                size_t pos_data2 = find0001(pd, ps);
-                if( -1 == pos_data2 ) {
-                    nalu_len = ps;
-                } else {
-                    // Minus 4 because find0001 returns end of nalu token
-                    nalu_len = pos_data2 - pos_data - 4;
-                }
-                //fprintf(stderr, ", size: %ld\n", nalu_len);
-                // BE size of the nalu buffer
-                pd[-1] = (uint8_t) nalu_len & 0xff;
-                pd[-2] = (uint8_t) (nalu_len >> 8) & 0xff;
-                pd[-3] = (uint8_t) (nalu_len >> 16) & 0xff;
-                pd[-4] = (uint8_t) (nalu_len >> 24) & 0xff;
-                pos_data = pos_data2;
-            }
-
-            prepareHeader(pkt->size - first_nalu, 0x00); // type VIDEO_DATA
-            sendToOutputs(header_buff, HEADER_BUFF_SIZE);
-
-            // Send packet data
-            sendToOutputs(&pkt->data[first_nalu], pkt->size - first_nalu);
+    }
 
-            av_packet_unref(pkt);
+    // Main thread only waits for the sessions & prints the stats
+    int64_t next_stats_ts = latency_now() + stats_interval * 1000000000LL;
+    bool stopping = false;
+    for( ;; ) {
+        bool finished = true;
+        for( unsigned int i = 0; i < sessions_count; i++ )
+            finished = finished && session_finished(sessions[i]);
+        if( finished )
+            break;
+        // Signal doesn't wake the capture waiting for the screen change
+        if( !sessions_running && !stopping ) {
+            for( unsigned int i = 0; i < sessions_count; i++ )
+                session_stop(sessions[i]);
+            stopping = true;
         }
-        // ENCODE DONE
-
-        buffer_copy_done = false;
-
-        // Sleep for the next frame
-        // TODO: Multithreading capture/encoding to improve framerate
-        if( frame->pts != AV_NOPTS_VALUE ) {
-            clock_gettime( CLOCK_REALTIME, &tm );
-            int64_t curr_ts = tm.tv_nsec + tm.tv_sec * 1000000000;
-
-            if( last_ts != AV_NOPTS_VALUE ) {
-                // 100000 = 100msec == 0.1 sec = 10f/s
-                // 50000 = 50msec == 0.05 sec = 20f/s
-                // TODO: add fps option to specify required frames per second
-                int64_t delay = 50000 - (curr_ts - frame_ts)/1000;
 
-                fprintf(stderr, "--> Frame ts: %ld, last_ts: %ld, additional delay: %ld\n", frame_ts, last_ts, delay);
-                if( delay > 0 && delay < 1000000 )
-                    usleep(delay);
+        if( replay_requested ) {
+            replay_requested = 0;
+            for( unsigned int i = 0; i < sessions_count; i++ ) {
+                char path[PATH_MAX];
+                replayPath(path, sizeof(path), i);
+                if( sessions[i]->replay )
+                    session_save_replay(sessions[i], path);
             }
-            last_ts = frame_ts;
         }
-
-        zwlr_screencopy_frame_v1_destroy(wl_frame);
-
-        wl_frame = zwlr_screencopy_manager_v1_capture_output(screencopy_manager, with_cursor, output);
-        zwlr_screencopy_frame_v1_add_listener(wl_frame, &frame_listener, NULL);
-    } while( wl_display_dispatch(display) != -1 );
-
-    if( output_sockets[0] != 0 ) {
-        for( uint8_t i = 0; i < 255; i++ ) {
-            if( output_sockets[i] == 0 )
-                break;
-            close(output_sockets[i]);
+        if( stats_interval > 0 && latency_now() >= next_stats_ts ) {
+            logReport(reportLatency);
+            next_stats_ts = latency_now() + stats_interval * 1000000000LL;
         }
+        struct timespec poll_ts = { 0, 100000000 };
+        nanosleep(&poll_ts, NULL);
     }
-    if( output_file )
-        fclose(output_file);
-    if( output_stdout )
-        fclose(output_stdout);
 
-    avcodec_free_context(&enc_ctx);
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
+    uint64_t frames_captured = 0;
+    for( unsigned int i = 0; i < sessions_count; i++ ) {
+        session_join(sessions[i]);
+        frames_captured += sessions[i]->stats.frames_captured;
+        if( sessions[i]->exit_code != EXIT_SUCCESS )
+            exit_code = sessions[i]->exit_code;
+    }
+    workers_stop();
+    control_stop();
+
+    double run_time = (latency_now() - run_ts) / 1000000000.0;
+    LOG_INFO("Processed %lu frames in %.2f s (%.1f fps)", frames_captured, run_time,
+        run_time > 0 ? frames_captured / run_time : 0.0);
+    logReport(reportLatency);
+    logReport(perf_report);
+    for( unsigned int i = 0; i < sessions_count; i++ ) {
+        session_report(sessions[i]);
+        session_free(sessions[i]);
+    }
+    if( sessions_count > 1 )
+        workers_report();
+    sessions_count = 0;
 
-    wl_buffer_destroy(buffer.wl_buffer);
+    log_stop();
 
-    return EXIT_SUCCESS;
+    return exit_code;
 }
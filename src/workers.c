@@ -0,0 +1,169 @@
+#define _GNU_SOURCE /* for pthread_setname_np */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "workers.h"
+#include "log.h"
+#include "realtime.h"
+
+// Every session has one frame job in flight at most, so the queues are small
+#define WORKER_QUEUE_SIZE 64
+
+struct job {
+    void (*run)(void *arg);
+    void *arg;
+};
+
+struct worker {
+    pthread_t thread;
+    unsigned int index;
+    // Own jobs are taken from the head, the stolen ones from the tail
+    pthread_mutex_t lock;
+    struct job jobs[WORKER_QUEUE_SIZE];
+    unsigned int head, count;
+
+    uint64_t jobs_run;
+    uint64_t jobs_stolen;
+};
+
+static struct worker workers[WORKERS_MAX];
+static int count = 0;
+static bool stopping = false;
+// Idle workers sleep until any job is queued
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int pending = 0;
+
+static bool popHead(struct worker *w, struct job *job) {
+    bool found = false;
+    pthread_mutex_lock(&w->lock);
+    if( w->count > 0 ) {
+        *job = w->jobs[w->head];
+        w->head = (w->head + 1) % WORKER_QUEUE_SIZE;
+        w->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static bool popTail(struct worker *w, struct job *job) {
+    bool found = false;
+    pthread_mutex_lock(&w->lock);
+    if( w->count > 0 ) {
+        w->count--;
+        *job = w->jobs[(w->head + w->count) % WORKER_QUEUE_SIZE];
+        found = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+// Own queue first, then the others starting from the neighbour
+static bool takeJob(struct worker *w, struct job *job) {
+    if( popHead(w, job) )
+        return true;
+    for( int i = 1; i < count; i++ ) {
+        if( popTail(&workers[(w->index + i) % count], job) ) {
+            w->jobs_stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *workerThread(void *arg) {
+    struct worker *w = arg;
+    realtime_setup_thread(REALTIME_ROLE_CONVERT | REALTIME_ROLE_ENCODE | REALTIME_ROLE_SEND);
+
+    for( ;; ) {
+        pthread_mutex_lock(&idle_lock);
+        while( pending == 0 && !stopping )
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        if( pending == 0 && stopping ) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        // Reserved job is in one of the queues, since it's queued before counted
+        pending--;
+        pthread_mutex_unlock(&idle_lock);
+
+        struct job job;
+        while( !takeJob(w, &job) ) {
+            // Queue of the reserved job is being updated
+        }
+        job.run(job.arg);
+        w->jobs_run++;
+    }
+    return NULL;
+}
+
+int workers_start(int workers_count) {
+    if( workers_count < 1 )
+        workers_count = 1;
+    if( workers_count > WORKERS_MAX )
+        workers_count = WORKERS_MAX;
+
+    stopping = false;
+    for( count = 0; count < workers_count; count++ ) {
+        struct worker *w = &workers[count];
+        w->index = count;
+        w->head = w->count = 0;
+        w->jobs_run = w->jobs_stolen = 0;
+        pthread_mutex_init(&w->lock, NULL);
+        if( pthread_create(&w->thread, NULL, workerThread, w) != 0 ) {
+            LOG_ERROR("Unable to start worker thread");
+            pthread_mutex_destroy(&w->lock);
+            workers_stop();
+            return -1;
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "worker-%d", count);
+        pthread_setname_np(w->thread, name);
+    }
+    LOG_DEBUG("Started %d workers", count);
+    return 0;
+}
+
+void workers_stop() {
+    pthread_mutex_lock(&idle_lock);
+    stopping = true;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+
+    for( int i = 0; i < count; i++ ) {
+        pthread_join(workers[i].thread, NULL);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    count = 0;
+}
+
+int workers_count() {
+    return count;
+}
+
+int workers_submit(unsigned int home, void (*run)(void *arg), void *arg) {
+    struct worker *w = &workers[home % count];
+    pthread_mutex_lock(&w->lock);
+    if( w->count == WORKER_QUEUE_SIZE ) {
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+    w->jobs[(w->head + w->count) % WORKER_QUEUE_SIZE] = (struct job){ run, arg };
+    w->count++;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&idle_lock);
+    pending++;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    return 0;
+}
+
+void workers_report() {
+    for( int i = 0; i < count; i++ )
+        LOG_INFO("Worker %d: %lu jobs, %lu stolen", i, workers[i].jobs_run, workers[i].jobs_stolen);
+}
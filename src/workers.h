@@ -0,0 +1,21 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#define WORKERS_MAX 64
+
+// Shared pool running the frame jobs of all the sessions. Every worker has its
+// own queue, the job goes to the queue of its home worker (so the session stays
+// on the same core caches when possible) and idle workers steal from the others.
+int workers_start(int count);
+// Waits for the queued jobs and stops the threads
+void workers_stop();
+
+int workers_count();
+
+// Queues the job for the home worker (taken modulo the workers count), returns -1 if full
+int workers_submit(unsigned int home, void (*run)(void *arg), void *arg);
+
+// Jobs run by every worker and how many of them were stolen from the other queues
+void workers_report();
+
+#endif // WORKERS_H
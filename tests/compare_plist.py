@@ -0,0 +1,27 @@
+#!/usr/bin/env python3
+
+import argparse
+import plistlib
+import subprocess
+import sys
+
+def main():
+    parser = argparse.ArgumentParser(description='Compares the generated stream request plist with the captured one')
+    parser.add_argument('generator', help='test-plist binary writing the generated plist to stdout')
+    parser.add_argument('reference', help='captured plist (stream-mirror.bplist)')
+    args = parser.parse_args()
+
+    generated = plistlib.loads(subprocess.run([args.generator], check=True, stdout=subprocess.PIPE).stdout)
+    with open(args.reference, 'rb') as f:
+        reference = plistlib.load(f)
+
+    if generated != reference:
+        print('Generated plist differs from %s' % args.reference)
+        for key in sorted(set(generated) | set(reference)):
+            if generated.get(key) != reference.get(key):
+                print('  %s: %r != %r' % (key, generated.get(key), reference.get(key)))
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,18 @@
+// Writes the generated stream request plist with the values of the captured
+// stream-mirror.bplist to stdout, compare_plist.py decodes & compares them
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stream.h"
+
+int main() {
+    uint8_t plist[1024];
+    ssize_t len = stream_request_plist(plist, sizeof(plist), "7B:DE:DB:1F:BB:AB", 50, 432128842);
+    if( len < 0 ) {
+        fprintf(stderr, "Stream plist doesn't fit %zu bytes\n", sizeof(plist));
+        return EXIT_FAILURE;
+    }
+    if( fwrite(plist, 1, len, stdout) != (size_t)len )
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
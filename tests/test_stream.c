@@ -0,0 +1,121 @@
+// Stream payload checks: Annex B to AVCC conversion (several NALUs per packet),
+// avcC record, payload header and the keyframe detection
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "stream.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+        if( !(cond) ) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while( 0 )
+
+static uint32_t readUInt32BE(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t readUInt32LE(const uint8_t *p) {
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+// Appends the start code & NALU of the header byte and size filled by the pattern
+static size_t appendNalu(uint8_t *buf, size_t pos, uint8_t header, size_t size) {
+    static const uint8_t start_code[] = { 0, 0, 0, 1 };
+    memcpy(&buf[pos], start_code, sizeof(start_code));
+    pos += sizeof(start_code);
+    buf[pos] = header;
+    for( size_t i = 1; i < size; i++ )
+        buf[pos + i] = 0x10 + i % 0xe0;
+    return pos + size;
+}
+
+static void testAnnexbToAvcc() {
+    // x264 puts its settings SEI without the start code before the first NALU
+    uint8_t buf[4096];
+    static const char comment[] = "x264 - core";
+    memcpy(buf, comment, sizeof(comment) - 1);
+    size_t size = sizeof(comment) - 1;
+    static const size_t sizes[] = { 9, 300, 1, 2000 };
+    static const uint8_t headers[] = { 0x06, 0x65, 0x65, 0x65 };
+    size_t offsets[4];
+    for( int i = 0; i < 4; i++ ) {
+        offsets[i] = size;
+        size = appendNalu(buf, size, headers[i], sizes[i]);
+    }
+    uint8_t orig[sizeof(buf)];
+    memcpy(orig, buf, size);
+
+    ssize_t start = stream_annexb_to_avcc(buf, size);
+    CHECK(start == (ssize_t)offsets[0]);
+    // Every NALU gets its own size, the data is kept
+    for( int i = 0; i < 4; i++ ) {
+        CHECK(readUInt32BE(&buf[offsets[i]]) == sizes[i]);
+        CHECK(memcmp(&buf[offsets[i] + 4], &orig[offsets[i] + 4], sizes[i]) == 0);
+    }
+    CHECK(stream_avcc_keyframe(&buf[start], size - start));
+
+    // Single NALU without the prefix
+    size = appendNalu(buf, 0, 0x41, 100);
+    CHECK(stream_annexb_to_avcc(buf, size) == 0);
+    CHECK(readUInt32BE(buf) == 100);
+    CHECK(!stream_avcc_keyframe(buf, size));
+
+    memset(buf, 0x55, 64);
+    CHECK(stream_annexb_to_avcc(buf, 64) == -1);
+}
+
+static void testAvccConfig() {
+    uint8_t extradata[64];
+    size_t size = appendNalu(extradata, 0, 0x67, 12);
+    extradata[5] = 0x64;
+    extradata[6] = 0x00;
+    extradata[7] = 0x1f;
+    size_t pps = size;
+    size = appendNalu(extradata, size, 0x68, 5);
+
+    uint8_t avcc[128];
+    ssize_t len = stream_avcc_config(avcc, sizeof(avcc), extradata, size);
+    CHECK(len == 11 + 12 + 5);
+    CHECK(avcc[0] == 1 && avcc[1] == 0x64 && avcc[2] == 0x00 && avcc[3] == 0x1f);
+    CHECK(avcc[6] == 0 && avcc[7] == 12);
+    CHECK(memcmp(&avcc[8], &extradata[4], 12) == 0);
+    CHECK(avcc[20] == 1 && avcc[21] == 0 && avcc[22] == 5);
+    CHECK(memcmp(&avcc[23], &extradata[pps + 4], 5) == 0);
+
+    // Too small record buffer fails instead of overflowing
+    CHECK(stream_avcc_config(avcc, 20, extradata, size) == -1);
+}
+
+static void testHeader() {
+    uint8_t header[STREAM_HEADER_SIZE];
+    stream_header(header, 12345, STREAM_VIDEO_DATA, 0x0102030405060708ULL);
+    CHECK(readUInt32LE(header) == 12345);
+    CHECK(header[4] == STREAM_VIDEO_DATA && header[6] == 0x06);
+    CHECK(readUInt32LE(&header[8]) == 0x05060708 && readUInt32LE(&header[12]) == 0x01020304);
+
+    stream_header(header, 0, STREAM_HEART_BEAT, 0x0102030405060708ULL);
+    CHECK(header[4] == STREAM_HEART_BEAT && header[6] == 0x1e);
+    CHECK(readUInt32LE(&header[8]) == 0 && readUInt32LE(&header[12]) == 0);
+}
+
+int main() {
+    log_start();
+    log_set_level(LOG_LEVEL_ERROR);
+    testAnnexbToAvcc();
+    testAvccConfig();
+    testHeader();
+    log_stop();
+    if( failures > 0 ) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
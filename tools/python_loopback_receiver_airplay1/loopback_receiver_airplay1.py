@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+import socket
+import struct
+import sys
+import time
+
+import plistlib
+
+# Seconds from 1900 (NTP era 0) to 1970
+NTP_UNIX_OFFSET = 2208988800
+
+class LoopbackReceiverAirPlay1:
+    '''Accepts the mirroring stream on the same host and measures when the frames
+    would be played: at the frame timestamp + latencyMs, or on arrival if late'''
+    def __init__(self, args):
+        # Default AirPlay1 mirroring port: 7100
+        self._port = int(args[0]) if len(args) > 0 else 7100
+        # Presentation offset used by the sender, to get the capture time back
+        self._offset = float(args[1]) / 1000.0 if len(args) > 1 else 0.0
+        self._latency = 0.0
+
+    def _read(self, conn, size):
+        data = b''
+        while len(data) < size:
+            chunk = conn.recv(size - len(data))
+            if not chunk:
+                raise EOFError()
+            data += chunk
+        return data
+
+    def _read_request(self, conn):
+        head = b''
+        while not head.endswith(b'\r\n\r\n'):
+            head += self._read(conn, 1)
+        length = 0
+        for line in head.decode().split('\r\n'):
+            if line.lower().startswith('content-length:'):
+                length = int(line.split(':')[1])
+        plist = plistlib.loads(self._read(conn, length))
+        self._latency = plist.get('latencyMs', 0) / 1000.0
+        print('%s: latencyMs %d, sessionID %d, deviceID %s' % (head.decode().split('\r\n')[0],
+            plist.get('latencyMs', 0), plist.get('sessionID', 0), plist.get('deviceID', '')))
+
+    def _stream(self, conn):
+        frames = late = 0
+        lateness = []
+        delays = []
+        report_ts = time.time() + 1
+        while True:
+            header = self._read(conn, 128)
+            size, kind = struct.unpack_from('<IH', header)
+            self._read(conn, size)
+            arrival = time.time()
+            if kind != 0:
+                continue
+
+            fraction, seconds = struct.unpack_from('<II', header, 8)
+            ts = seconds - NTP_UNIX_OFFSET + fraction / 2**32
+            playout = ts + self._latency
+            frames += 1
+            lateness.append(arrival - (ts - self._offset))
+            # Late frame is shown as soon as it's decoded
+            delays.append(max(arrival, playout) - (ts - self._offset))
+            if arrival > playout:
+                late += 1
+
+            if arrival >= report_ts:
+                print('frames %d, arrival %.1f/%.1f ms after capture (avg/max), '
+                    'playout delay %.1f ms (budget %.1f ms), late %d' % (frames,
+                    sum(lateness) * 1000 / frames, max(lateness) * 1000,
+                    sum(delays) * 1000 / frames, (self._offset + self._latency) * 1000, late))
+                frames = late = 0
+                lateness = []
+                delays = []
+                report_ts = arrival + 1
+
+    def process(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind(('127.0.0.1', self._port))
+        server.listen(1)
+        print('Listening on 127.0.0.1:%d' % self._port)
+        while True:
+            conn, addr = server.accept()
+            print('Connected %s:%d' % addr)
+            try:
+                self._read_request(conn)
+                self._stream(conn)
+            except EOFError:
+                print('Disconnected')
+            conn.close()
+
+def main():
+    rv = LoopbackReceiverAirPlay1(sys.argv[1:])
+    rv.process()
+
+if __name__ == '__main__':
+    main()